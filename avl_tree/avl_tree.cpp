@@ -4,24 +4,43 @@
 #define _AVL_TREE_H
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <functional>
+#include <iterator>
+#include <limits>
 // type_traits: had some changes in C++17
 #include <memory>
+#include <new>
 #include <stdexcept>
+#include <thread>
 #include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+// mmap: used to reserve contiguous arenas without committing memory
+#include <sys/mman.h>
+#include <unistd.h>
+#define avl_has_mmap 1
+#else
+#define avl_has_mmap 0
+#endif
+
+#if __cplusplus < 201703L
+#error "The AVL tree library needs C++17 or later."
+#endif
 
-#if __cplusplus >= 201703L
-// invoke_result: as of C++17
-#define avl_invoke_result(T, ...) std::invoke_result<T, __VA_ARGS__>
 // optional: as of C++17
 #include <optional>
-#define avl_optional std::optional
+// memory_resource: as of C++17, but missing from some standard libraries
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define avl_has_pmr 1
 #else
-// result_of: before C++17
-#define avl_invoke_result(T, ...) std::result_of<T(__VA_ARGS__)>
-// optional: as of C++17
-#include <experimental/optional>
-#define avl_optional std::experimental::optional
+#define avl_has_pmr 0
 #endif
 
 //! AVL tree library with an extensible AVL tree class.
@@ -177,1003 +196,7933 @@ const bool merge_count<T, C>::operator()(std::pair<T, C> &to,
   return true;
 }
 
-template <typename _Element, typename _Size = std::size_t,
-          typename _Range_Type_Intermediate = monostate>
-class avl_node;
-
-// forward declarations for helper functions
-
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-_Size avl_node_size(avl_node<_Element, _Size, _Range_Type_Intermediate> *node);
-
-template <typename _Element_2, typename _Size_2, typename _Range_Type_Intermediate_2>
-const _Element_2&
-avl_node_get_at_index(
-    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2>*, _Size_2);
-
-template <typename _Element_2, typename _Size_2,
-          typename _Range_Type_Intermediate_2, typename _Merge,
-          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
-std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, bool>
-avl_node_insert_at_index(
-    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Size_2,
-    _Element_2, const _Merge &, const _Range_Preprocess &,
-    const _Range_Combine &, _Alloc);
-
-template <typename _Element_2, typename _Size_2,
-          typename _Range_Type_Intermediate_2, typename _Compare,
-          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
-          typename _Alloc>
-std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, bool,
-           _Size_2>
-avl_node_insert_ordered(
-    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Element_2,
-    const _Compare &, const _Merge &, const _Range_Preprocess &,
-    const _Range_Combine &, _Alloc);
-
-template <typename _Element_2, typename _Size_2,
-          typename _Range_Type_Intermediate_2, typename _Range_Preprocess,
-          typename _Range_Combine, typename _Alloc>
-std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, bool,
-           _Element_2>
-avl_node_remove_at_index(
-    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Size_2,
-    const _Range_Preprocess &, const _Range_Combine &, _Alloc);
-
-template <typename _Element_2, typename _Size_2,
-          typename _Range_Type_Intermediate_2, typename _Compare,
-          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
-std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, bool,
-           avl_optional<_Size_2>>
-avl_node_remove_ordered(
-    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Element_2,
-    const _Compare &, const _Range_Preprocess &, const _Range_Combine &,
-    _Alloc);
+//! Check if a less than function is transparent, so it can compare elements with other key types.
+/*!
+ * A less than function is transparent if it has a member type is_transparent,
+ * like std::less<> does.
+ * Ordered lookups in a tree with a transparent less than function
+ * accept any key type which the function can compare with the elements,
+ * such as a std::string_view for a tree of std::string,
+ * so no element needs to be constructed just to search for it.
+ */
+template <typename _Compare, typename = void>
+struct is_transparent_compare : std::false_type {};
 
-template <typename _Element_2, typename _Size_2, typename _Range_Type_Intermediate_2,
-          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
-          typename _Alloc>
-std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, bool>
-avl_node_replace_at_index(
-    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Size_2,
-    _Element_2, const _Merge &, const _Range_Preprocess &,
-    const _Range_Combine &, _Alloc);
+template <typename _Compare>
+struct is_transparent_compare<_Compare,
+                              std::void_t<typename _Compare::is_transparent>>
+    : std::true_type {};
 
-template <typename _Element_2, typename _Size_2, typename _Range_Type_Intermediate_2,
-          typename _Compare, typename _Merge,
-          typename _Range_Preprocess, typename _Range_Combine,
-          typename _Alloc>
-std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, bool, avl_optional<std::pair<_Size_2,_Size_2>>>
-avl_node_replace_ordered(
-    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Element_2,
-    _Element_2, const _Compare &,
-    const _Merge &, const _Range_Preprocess &,
-    const _Range_Combine &, _Alloc);
+//! The key type, if the less than function is transparent; for internal use.
+template <typename _Compare, typename _Key>
+using transparent_key_t =
+    typename std::enable_if<is_transparent_compare<_Compare>::value, _Key>::type;
 
-// declaration for avl_node
+//! Which set operation avl_node_set_operation does.
+enum class set_operation {
+  //! Elements in either tree.
+  set_union,
+  //! Elements in both trees.
+  set_intersection,
+  //! Elements in the first tree and not in the second.
+  set_difference,
+  //! Elements in exactly 1 of the trees.
+  set_symmetric_difference
+};
 
-//! AVL tree node; for internal use.
+//! Pooled allocator for fixed size blocks, such as tree nodes.
 /*!
- * Represents a single AVL tree node.
- * Stores left and right child pointers, the actual data element,
- * the subtree's size (number of nodes contained), the balance factor,
- * and the intermediate range value.
- * Designated for internal use; to enforce this,
- * data members are private and only exposed through the helper functions
- * which work on the tree at a higher level.
- * It's intentional that end users can see the class (they need it for type declarations),
- * but those users aren't meant to manipulate the nodes directly.
- * Subtrees are represented as pointers to nodes,
- * with the null pointer being an empty subtree.
+ * An allocator which hands out single objects carved from larger chunks of memory,
+ * and keeps freed objects on an intrusive free list so they can be reused
+ * without going back to the system.
+ * Chunks are only given back to the system all at once, when the pool is destroyed,
+ * which happens when the last allocator sharing the pool is destroyed.
+ * The first chunk is small, and each new chunk is double the size of the previous one,
+ * up to a maximum, so that small trees stay small and large trees do few system allocations.
+ *
+ * Copies of an allocator share the same pool and compare equal.
+ * Each constructed allocator makes a small pool object, which its copies share,
+ * so copying never allocates, throws or changes the allocator being copied.
+ * The pool takes no chunks until the first allocation, so an allocator which is never used,
+ * such as that of a tree which stays inline, costs only that small object, and reserves no memory.
+ * Rebinding to a different type creates a new pool, since the block size is different,
+ * so unlike a standard allocator, a rebound copy cannot free what the original allocated,
+ * and only allocators of the same type can be compared.
+ * Requests for more than 1 object at a time are not pooled, and are passed on to
+ * the default allocator instead.
+ * The pool is not thread safe, same as the tree using it.
+ *
+ * With huge pages turned on, every chunk is instead one or more whole 2 MB pages,
+ * aligned to 2 MB and marked with madvise(MADV_HUGEPAGE), so that the operating system
+ * can back it with transparent huge pages. A tree then needs far fewer TLB entries,
+ * which matters for trees much larger than the TLB reach of ordinary pages.
+ * If transparent huge pages are not available, the chunks simply use ordinary pages.
+ * Where mmap is not available, the chunks are still 2 MB aligned, but nothing is hinted.
+ *
+ * \tparam T the type of object to allocate
+ * \tparam _Max_Chunk_Bytes the largest chunk size which the pool will request at once,
+ * unless huge pages are on
+ * \tparam _Huge_Pages whether to take memory in 2 MB huge page chunks
+ * \sa huge_page_pool_allocator
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-class avl_node {
- private:
-  //! Left child pointer.
-  /*!
-   * Pointer to the left child at this node.
-   */
-  avl_node *left;
- private:
-  //! Value of this node.
-  /*!
-   * The single value of this node.
-   * May also be called the data value or label.
-   */
-  [[no_unique_address]] _Element value;
+template <typename T, std::size_t _Max_Chunk_Bytes = std::size_t(1) << 20,
+          bool _Huge_Pages = false>
+class pool_allocator {
  private:
-  //! Right child pointer.
-  /*!
-   * Pointer to the right child at this node.
-   */
-  avl_node *right;
-  //! Size of the subtree rooted at this node.
-  /*!
-   * The size (number of nodes contained) of the subtree rooted at this node.
-   */
-  [[no_unique_address]] _Size size;
-  //! Balance factor of this node.
-  /*!
-   * The "balance factor" of this node in the AVL tree.
-   * Balance factors are used for memory efficient (better than storing the height) implementations of AVL trees.
-   * The balance factor is always either -1, 0, or 1, equal to the height of the right subtree minus the height of the left subtree.
-   */
-  char balance;
-  //! Range intermediate value for this subtree.
-  /*!
-   * The range intermediate value for this subtree.
-   * Used for range operations.
-   *
-   * \sa avl_tree
-   */
-  [[no_unique_address]] _Range_Type_Intermediate subrange;
+  //! A free block, which stores the link to the next free block in its own memory.
+  struct free_block {
+    free_block *next;
+  };
+  //! Header at the start of each chunk, linking all chunks of a pool together.
+  struct chunk_header {
+    chunk_header *next;
+    std::size_t bytes;
+    //! Link to the next spare chunk, while this chunk is a spare.
+    chunk_header *next_spare;
+    //! Start of the blocks never handed out, while this chunk is a spare.
+    char *spare_bump;
+  };
+  static constexpr std::size_t block_align =
+      std::max(alignof(T), alignof(free_block));
+  static constexpr std::size_t block_size =
+      (std::max(sizeof(T), sizeof(free_block)) + block_align - 1) /
+      block_align * block_align;
+  static constexpr std::size_t header_size =
+      (sizeof(chunk_header) + block_align - 1) / block_align * block_align;
+  static constexpr std::size_t huge_page_size = std::size_t(1) << 21;
+  static constexpr std::size_t huge_chunk_blocks =
+      std::max(std::size_t(1), (huge_page_size - header_size) / block_size);
+  static constexpr std::size_t min_chunk_blocks =
+      _Huge_Pages ? huge_chunk_blocks : 32;
+  static constexpr std::size_t max_chunk_blocks =
+      _Huge_Pages ? huge_chunk_blocks
+                  : std::max(min_chunk_blocks,
+                             (_Max_Chunk_Bytes - header_size) / block_size);
+  static constexpr std::size_t chunk_align =
+      _Huge_Pages ? huge_page_size : block_align;
 
- public:
-  //! Construct from data.
+  static void *allocate_chunk(std::size_t bytes);
+  static void deallocate_chunk(void *chunk, std::size_t bytes) noexcept;
+
+  //! The shared state of the pool.
   /*!
-   * Construct a lone node given an element and range intermediate value.
-   * Other data members are set automatically to match those of a single node with no children.
-   * \param i_value the element value
-   * \param i_subrange the range intermediate value for just this element
+   * The ends of the lists are kept too, so that another pool can be spliced in in O(1) time.
    */
-  avl_node(const _Element &i_value,
-           const _Range_Type_Intermediate &i_subrange) {
-    left = nullptr;
-    value = i_value;
-    right = nullptr;
-    size = _Size(1);
-    balance = char(0);
-    subrange = i_subrange;
-  }
-
-  // these helper functions are friends
-
-  template <typename _Element_2, typename _Size_2,
-            typename _Range_Type_Intermediate_2>
-  friend _Size_2 avl::avl_node_size(
-      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *);
-
-  template <typename _Element_2, typename _Size_2, typename _Range_Type_Intermediate_2>
-  friend const _Element_2&
-  avl::avl_node_get_at_index(
-    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2>*, _Size_2);
-
-  template <typename _Element_2, typename _Size_2,
-            typename _Range_Type_Intermediate_2, typename _Merge,
-            typename _Range_Preprocess, typename _Range_Combine,
-            typename _Alloc>
-  friend std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *,
-                   bool>
-  avl::avl_node_insert_at_index(
-      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Size_2,
-      _Element_2, const _Merge &, const _Range_Preprocess &,
-      const _Range_Combine &, _Alloc);
+  struct pool {
+    free_block *free_list = nullptr;
+    //! Last block of the free list, only valid while the free list is not empty.
+    free_block *free_last = nullptr;
+    chunk_header *chunks = nullptr;
+    chunk_header *last_chunk = nullptr;
+    //! The chunk which the bump range is in.
+    chunk_header *bump_chunk = nullptr;
+    char *bump = nullptr;
+    char *bump_end = nullptr;
+    //! Chunks from spliced pools with blocks never handed out, used up before growing.
+    chunk_header *spares = nullptr;
+    chunk_header *last_spare = nullptr;
+    std::size_t next_chunk_blocks = min_chunk_blocks;
+    //! Total bytes of all chunks.
+    std::size_t reserved = 0;
+    //! Number of blocks handed out and not yet freed.
+    std::size_t live = 0;
 
-  template <typename _Element_2, typename _Size_2,
-            typename _Range_Type_Intermediate_2, typename _Compare,
-            typename _Merge, typename _Range_Preprocess,
-            typename _Range_Combine, typename _Alloc>
-  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *,
-                    bool, _Size_2>
-  avl::avl_node_insert_ordered(
-      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Element_2,
-      const _Compare &, const _Merge &, const _Range_Preprocess &,
-      const _Range_Combine &, _Alloc);
+    pool() = default;
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+    ~pool() { release(); }
+    void release() {
+      while (chunks != nullptr) {
+        chunk_header *next = chunks->next;
+        deallocate_chunk(chunks, chunks->bytes);
+        chunks = next;
+      }
+      forget();
+    }
+    //! Reset to empty without giving back any chunks, once they belong to another pool.
+    void forget() noexcept {
+      free_list = nullptr;
+      chunks = nullptr;
+      bump_chunk = nullptr;
+      bump = nullptr;
+      bump_end = nullptr;
+      spares = nullptr;
+      next_chunk_blocks = min_chunk_blocks;
+      reserved = 0;
+      live = 0;
+    }
+    void *allocate() {
+      if (free_list != nullptr) {
+        free_block *block = free_list;
+        free_list = block->next;
+        ++live;
+        return block;
+      }
+      // only counted once grow has not thrown
+      if (bump == bump_end) grow();
+      void *block = bump;
+      bump += block_size;
+      ++live;
+      return block;
+    }
+    void deallocate(void *p) {
+      --live;
+      free_block *block = static_cast<free_block *>(p);
+      if (free_list == nullptr) free_last = block;
+      block->next = free_list;
+      free_list = block;
+    }
+    static char *blocks_end(chunk_header *chunk) noexcept {
+      return reinterpret_cast<char *>(chunk) + header_size +
+             (chunk->bytes - header_size) / block_size * block_size;
+    }
+    void grow() {
+      if (spares != nullptr) {
+        bump_chunk = spares;
+        spares = spares->next_spare;
+        bump = bump_chunk->spare_bump;
+        bump_end = blocks_end(bump_chunk);
+        return;
+      }
+      std::size_t bytes = header_size + next_chunk_blocks * block_size;
+      // whole chunks only, so that the last page can be a huge page too
+      bytes = (bytes + chunk_align - 1) / chunk_align * chunk_align;
+      chunk_header *chunk = static_cast<chunk_header *>(allocate_chunk(bytes));
+      chunk->next = chunks;
+      chunk->bytes = bytes;
+      if (chunks == nullptr) last_chunk = chunk;
+      chunks = chunk;
+      reserved += bytes;
+      bump_chunk = chunk;
+      bump = reinterpret_cast<char *>(chunk) + header_size;
+      bump_end = blocks_end(chunk);
+      next_chunk_blocks = std::min(max_chunk_blocks, next_chunk_blocks * 2);
+    }
+    //! Put the bump range aside as a spare, or take it if it is the only one.
+    void add_spare(chunk_header *chunk, char *from) noexcept {
+      if (bump == bump_end) {
+        bump_chunk = chunk;
+        bump = from;
+        bump_end = blocks_end(chunk);
+        return;
+      }
+      chunk->spare_bump = from;
+      chunk->next_spare = spares;
+      if (spares == nullptr) last_spare = chunk;
+      spares = chunk;
+    }
+    //! Take over all chunks and blocks of another pool, leaving it empty.
+    void splice(pool &other) noexcept {
+      if (other.free_list != nullptr) {
+        other.free_last->next = free_list;
+        if (free_list == nullptr) free_last = other.free_last;
+        free_list = other.free_list;
+      }
+      if (other.chunks != nullptr) {
+        other.last_chunk->next = chunks;
+        if (chunks == nullptr) last_chunk = other.last_chunk;
+        chunks = other.chunks;
+      }
+      if (other.bump != other.bump_end) add_spare(other.bump_chunk, other.bump);
+      if (other.spares != nullptr) {
+        other.last_spare->next_spare = spares;
+        if (spares == nullptr) last_spare = other.last_spare;
+        spares = other.spares;
+      }
+      next_chunk_blocks = std::max(next_chunk_blocks, other.next_chunk_blocks);
+      reserved += other.reserved;
+      live += other.live;
+      other.forget();
+    }
+  };
 
-  template <typename _Element_2, typename _Size_2,
-            typename _Range_Type_Intermediate_2, typename _Range_Preprocess,
-            typename _Range_Combine, typename _Alloc>
-  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *,
-                    bool, _Element_2>
-  avl::avl_node_remove_at_index(
-      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Size_2,
-      const _Range_Preprocess &, const _Range_Combine &, _Alloc);
+  //! The pool shared by all copies.
+  std::shared_ptr<pool> _pool;
 
-  template <typename _Element_2, typename _Size_2,
-            typename _Range_Type_Intermediate_2, typename _Compare,
-            typename _Range_Preprocess, typename _Range_Combine,
-            typename _Alloc>
-  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *,
-                    bool, avl_optional<_Size_2>>
-  avl::avl_node_remove_ordered(
-      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2> *, _Element_2,
-      const _Compare &, const _Range_Preprocess &, const _Range_Combine &,
-      _Alloc);
+  template <typename U, std::size_t _Max_Chunk_Bytes_2, bool _Huge_Pages_2>
+  friend class pool_allocator;
 
-  // avl_node_replace_at_index does not need friend
-  // avl_node_replace_ordered does not need friend
+ public:
+  typedef T value_type;
+  template <typename U>
+  struct rebind {
+    typedef pool_allocator<U, _Max_Chunk_Bytes, _Huge_Pages> other;
+  };
 
-  // these are our methods
+  pool_allocator();
+  pool_allocator(const pool_allocator &) noexcept = default;
+  template <typename U>
+  pool_allocator(const pool_allocator<U, _Max_Chunk_Bytes, _Huge_Pages> &);
+  pool_allocator &operator=(const pool_allocator &) noexcept = default;
+  T *allocate(std::size_t n);
+  void deallocate(T *p, std::size_t n);
+  template <typename U, typename... _Args>
+  void construct(U *p, _Args &&... args);
+  template <typename U>
+  void destroy(U *p);
+  bool unshared() const noexcept;
+  void release();
+  bool absorb(pool_allocator &other) noexcept;
+  std::size_t reserved_bytes() const noexcept;
+  std::size_t used_bytes() const noexcept;
 
-  template <typename _Range_Preprocess, typename _Range_Combine>
-  void update(const _Range_Preprocess &, const _Range_Combine &);
-  template <typename _Range_Preprocess, typename _Range_Combine>
-  avl_node *rotate_left(const _Range_Preprocess &_rpre,
-                        const _Range_Combine &_rcomb);
-  template <typename _Range_Preprocess, typename _Range_Combine>
-  avl_node *rotate_right(const _Range_Preprocess &_rpre,
-                         const _Range_Combine &_rcomb);
-  template <typename _Range_Preprocess, typename _Range_Combine>
-  avl_node *ensure_not_right_heavy(const _Range_Preprocess &_rpre,
-                                   const _Range_Combine &_rcomb);
-  template <typename _Range_Preprocess, typename _Range_Combine>
-  avl_node *ensure_not_left_heavy(const _Range_Preprocess &_rpre,
-                                  const _Range_Combine &_rcomb);
-  template <typename _Range_Preprocess, typename _Range_Combine>
-  avl_node *rebalance_right_heavy(const _Range_Preprocess &_rpre,
-                                  const _Range_Combine &_rcomb);
-  template <typename _Range_Preprocess, typename _Range_Combine>
-  avl_node *rebalance_left_heavy(const _Range_Preprocess &_rpre,
-                                 const _Range_Combine &_rcomb);
+  bool operator==(const pool_allocator &other) const noexcept {
+    return _pool == other._pool;
+  }
+  bool operator!=(const pool_allocator &other) const noexcept {
+    return !(*this == other);
+  }
 };
 
-//! Get the size of the subtree.
+//! Get memory for a chunk, aligned to the chunk alignment.
 /*!
- * Get the number of nodes in a subtree.
- * A subtree represented by the null pointer is an empty tree, so its size is 0.
- *
- * \param node the node to get the size of
- * \return how many nodes are in the subtree
+ * \param bytes the size of the chunk, a multiple of the chunk alignment
+ * \return pointer to the chunk
+ * \exception std::bad_alloc If there is not enough memory
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-_Size avl_node_size(avl_node<_Element, _Size, _Range_Type_Intermediate> *node) {
-  if (node == nullptr) return 0;
-  return node->size;
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+void *pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::allocate_chunk(
+    std::size_t bytes) {
+#if avl_has_mmap
+  if constexpr (_Huge_Pages) {
+    // reserve an extra huge page, so that an aligned range fits, then trim the ends
+    std::size_t reserved = bytes + huge_page_size;
+    void *p = ::mmap(nullptr, reserved, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    char *start = static_cast<char *>(p);
+    char *aligned = reinterpret_cast<char *>(
+        (reinterpret_cast<std::uintptr_t>(start) + huge_page_size - 1) /
+        huge_page_size * huge_page_size);
+    if (aligned != start) ::munmap(start, std::size_t(aligned - start));
+    std::size_t tail = std::size_t(start + reserved - (aligned + bytes));
+    if (tail != 0) ::munmap(aligned + bytes, tail);
+#ifdef MADV_HUGEPAGE
+    // only a hint; without transparent huge pages, ordinary pages are used
+    ::madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+    return aligned;
+  }
+#endif
+  return ::operator new(bytes, std::align_val_t(chunk_align));
 }
 
-//! Update size and range intermediate values at this node.
-/*!
- * Updates size and range intermediate values at this node. Assumes its children
- * (if they exist) already have correct values.
- *
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \sa avl_tree
- */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-template <typename _Range_Preprocess, typename _Range_Combine>
-void avl_node<_Element, _Size, _Range_Type_Intermediate>::update(
-    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
-  size = _Size(1);
-  subrange = _rpre(value);
-  if (left != nullptr) {
-    size = left->size + size;
-    subrange = _rcomb(left->subrange, subrange);
-  }
-  if (right != nullptr) {
-    size = size + right->size;
-    subrange = _rcomb(subrange, right->subrange);
+//! Give the memory of a chunk back to the system.
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+void pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::deallocate_chunk(
+    void *chunk, std::size_t bytes) noexcept {
+#if avl_has_mmap
+  if constexpr (_Huge_Pages) {
+    ::munmap(chunk, bytes);
+    return;
   }
+#endif
+  ::operator delete(chunk, std::align_val_t(chunk_align));
 }
 
-//! Perform a left rotation on this subtree, and return the new root.
+//! Construct an allocator with a new, empty pool, which takes no chunks until it is first used.
 /*!
- * Performs a left rotation on this subtree.
- * Will also update the sizes and range intermediate values, so if you know a
- * tree rotation is needed, you can avoid explicitly calling update (the freshly
- * updated values would have been discarded anyway, and this method will make
- * the correct updates after performing the rotation)
- *
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \return the new subtree root
- * \sa avl_tree
+ * \exception std::bad_alloc If there is not enough memory for the pool object
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-template <typename _Range_Preprocess, typename _Range_Combine>
-avl_node<_Element, _Size, _Range_Type_Intermediate>
-    *avl_node<_Element, _Size, _Range_Type_Intermediate>::rotate_left(
-        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
-  avl_node *pivot = this->right;
-  this->right = pivot->left;
-  pivot->left = this;
-  this->balance -= 1 + std::max(char(0), pivot->balance);
-  pivot->balance -= 1 - std::min(char(0), this->balance);
-  this->update(_rpre, _rcomb);
-  pivot->update(_rpre, _rcomb);
-  return pivot;
-}
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::pool_allocator()
+    : _pool(std::make_shared<pool>()) {}
 
-//! Perform a right rotation on this subtree, and return the new root.
+//! Construct an allocator for a different type, which gets its own new, empty pool.
 /*!
- * The mirrored version of rotate_left. See docs for rotate_left.
+ * \exception std::bad_alloc If there is not enough memory for the pool object
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-template <typename _Range_Preprocess, typename _Range_Combine>
-avl_node<_Element, _Size, _Range_Type_Intermediate>
-    *avl_node<_Element, _Size, _Range_Type_Intermediate>::rotate_right(
-        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
-  avl_node *pivot = this->left;
-  this->left = pivot->right;
-  pivot->right = this;
-  this->balance += 1 - std::min(char(0), pivot->balance);
-  pivot->balance += 1 + std::max(char(0), this->balance);
-  this->update(_rpre, _rcomb);
-  pivot->update(_rpre, _rcomb);
-  return pivot;
-}
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+template <typename U>
+pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::pool_allocator(
+    const pool_allocator<U, _Max_Chunk_Bytes, _Huge_Pages> &)
+    : pool_allocator() {}
 
-//! Ensure this subtree is not right heavy, and rotates if needed. Returns the new root.
+//! Allocate memory for n objects.
 /*!
- * If the subtree is right heavy (right subtree is taller than left), does a
- * left rotation to make it not right heavy anymore.
+ * Single objects are taken from the pool, while larger requests
+ * go to the default allocator.
  *
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \return the new subtree root
- * \sa avl_tree
+ * \param n the number of objects
+ * \return pointer to the uninitialized memory
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-template <typename _Range_Preprocess, typename _Range_Combine>
-avl_node<_Element, _Size, _Range_Type_Intermediate> *
-avl_node<_Element, _Size, _Range_Type_Intermediate>::ensure_not_right_heavy(
-    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
-  if (this->balance <= 0) return this;
-  return this->rotate_left(_rpre, _rcomb);
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+T *pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::allocate(std::size_t n) {
+  if (n != 1) [[unlikely]] {
+    return std::allocator<T>().allocate(n);
+  }
+  return static_cast<T *>(_pool->allocate());
 }
 
-//! Ensure this subtree is not left heavy, and rotates if needed. Returns the new root.
+//! Deallocate memory for n objects, which was allocated by this pool.
 /*!
- * Mirrored version of ensure_not_right_heavy.
+ * Single objects are put back on the free list, and are not returned
+ * to the system until the pool is destroyed.
+ *
+ * \param p pointer to the memory
+ * \param n the number of objects, which must be the same as when it was allocated
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-template <typename _Range_Preprocess, typename _Range_Combine>
-avl_node<_Element, _Size, _Range_Type_Intermediate>
-    *avl_node<_Element, _Size, _Range_Type_Intermediate>::ensure_not_left_heavy(
-        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
-  if (this->balance >= 0) return this;
-  return this->rotate_right(_rpre, _rcomb);
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+void pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::deallocate(T *p, std::size_t n) {
+  if (n != 1) [[unlikely]] {
+    std::allocator<T>().deallocate(p, n);
+    return;
+  }
+  _pool->deallocate(p);
 }
 
-//! Knowing that this node's balance factor is 2 (very right heavy), rotate to correct the imbalance, and return the new root.
+//! Construct an object in place.
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+template <typename U, typename... _Args>
+void pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::construct(U *p, _Args &&... args) {
+  ::new (static_cast<void *>(p)) U(std::forward<_Args>(args)...);
+}
+
+//! Destroy an object in place, without releasing its memory.
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+template <typename U>
+void pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::destroy(U *p) {
+  p->~U();
+}
+
+//! Allocator which places all objects in a single contiguous region of memory.
 /*!
- * Rebalances the tree when the only imbalance is at this node and its balance
- * factor is 2. (overly right heavy)
+ * An allocator which reserves one contiguous range of addresses,
+ * large enough for a fixed maximum number of objects,
+ * and hands out objects from it in order.
+ * Freed objects are kept on an intrusive free list for reuse.
+ * Objects are always placed a whole number of object sizes apart,
+ * which is what relative_layout relies on.
  *
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \sa avl_tree
+ * Nothing is reserved until the first object is allocated, so an empty arena costs nothing.
+ * Where the operating system allows it, the addresses are then only reserved,
+ * and memory is actually committed in growing steps as the arena fills up,
+ * so a large capacity costs only address space until it is used.
+ * Elsewhere, the full capacity is allocated at once, so choose it carefully.
+ * Since the arena can not move once it is reserved, it can never hold more than its capacity,
+ * and allocating past it throws std::length_error.
+ * The default capacity is a modest 2^20 objects, so that many trees with nodes fit in the address space;
+ * larger trees need a larger capacity given to the constructor.
+ *
+ * Copies of an allocator share the same arena and compare equal.
+ * Rebinding to a different type creates a new arena.
+ * Requests for more than 1 object at a time are not placed in the arena, and are passed on to
+ * the default allocator instead.
+ *
+ * \tparam T the type of object to allocate
+ * \sa relative_layout
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-template <typename _Range_Preprocess, typename _Range_Combine>
-avl_node<_Element, _Size, _Range_Type_Intermediate>
-    *avl_node<_Element, _Size, _Range_Type_Intermediate>::rebalance_right_heavy(
-        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
-  if (this->right != nullptr)
-    this->right = this->right->ensure_not_left_heavy(_rpre, _rcomb);
-  return this->rotate_left(_rpre, _rcomb);
-}
+template <typename T, std::size_t _Default_Capacity = std::size_t(1) << 20>
+class contiguous_arena_allocator {
+ private:
+  static constexpr std::size_t block_size =
+      sizeof(T) >= sizeof(void *)
+          ? sizeof(T)
+          : (sizeof(void *) + alignof(T) - 1) / alignof(T) * alignof(T);
 
-//! Knowing that this node's balance factor is -2 (very left heavy), rotate to correct the imbalance, and return the new root.
+  //! The shared state of the arena.
+  struct arena {
+    //! Start of the reserved addresses, or null until the first allocation.
+    char *base = nullptr;
+    std::size_t reserved_bytes = 0;
+    std::size_t committed_bytes = 0;
+    std::size_t used_bytes = 0;
+    //! Head of the free list. Each free block stores the next one in its first bytes.
+    void *free_list = nullptr;
+    //! Number of blocks handed out and not yet freed.
+    std::size_t live = 0;
+
+    explicit arena(std::size_t capacity);
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+    ~arena();
+    void *allocate();
+    void deallocate(void *p);
+    void reserve();
+    void commit(std::size_t bytes);
+    void release();
+  };
+
+  std::shared_ptr<arena> _arena;
+
+  template <typename U, std::size_t _Default_Capacity_2>
+  friend class contiguous_arena_allocator;
+
+ public:
+  typedef T value_type;
+  template <typename U>
+  struct rebind {
+    typedef contiguous_arena_allocator<U, _Default_Capacity> other;
+  };
+  //! Default capacity, in number of objects.
+  static constexpr std::size_t default_capacity = _Default_Capacity;
+
+  explicit contiguous_arena_allocator(std::size_t capacity = default_capacity);
+  contiguous_arena_allocator(const contiguous_arena_allocator &) = default;
+  template <typename U>
+  contiguous_arena_allocator(const contiguous_arena_allocator<U, _Default_Capacity> &);
+  T *allocate(std::size_t n);
+  void deallocate(T *p, std::size_t n);
+  template <typename U, typename... _Args>
+  void construct(U *p, _Args &&... args);
+  template <typename U>
+  void destroy(U *p);
+  bool unshared() const noexcept;
+  void release();
+  std::size_t capacity() const noexcept;
+  std::size_t reserved_bytes() const noexcept;
+  std::size_t used_bytes() const noexcept;
+
+  template <typename U>
+  bool operator==(const contiguous_arena_allocator<U, _Default_Capacity> &other) const noexcept {
+    return static_cast<const void *>(_arena.get()) == other._arena.get();
+  }
+  template <typename U>
+  bool operator!=(const contiguous_arena_allocator<U, _Default_Capacity> &other) const noexcept {
+    return !(*this == other);
+  }
+};
+
+//! Set up an arena of the given capacity, without reserving anything yet.
+template <typename T, std::size_t _Default_Capacity>
+contiguous_arena_allocator<T, _Default_Capacity>::arena::arena(std::size_t capacity) {
+  std::size_t max_capacity = (std::numeric_limits<std::size_t>::max() / 2) / block_size;
+  reserved_bytes = std::min(capacity, max_capacity) * block_size;
+}
+
+//! Reserve the addresses of the arena, which is done on the first allocation.
+template <typename T, std::size_t _Default_Capacity>
+void contiguous_arena_allocator<T, _Default_Capacity>::arena::reserve() {
+#if avl_has_mmap
+  void *p = ::mmap(nullptr, reserved_bytes, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) throw std::bad_alloc();
+  base = static_cast<char *>(p);
+#else
+  base = static_cast<char *>(::operator new(reserved_bytes, std::align_val_t(alignof(T))));
+  committed_bytes = reserved_bytes;
+#endif
+}
+
+//! Release the whole arena at once.
+template <typename T, std::size_t _Default_Capacity>
+contiguous_arena_allocator<T, _Default_Capacity>::arena::~arena() {
+  if (base == nullptr) return;
+#if avl_has_mmap
+  ::munmap(base, reserved_bytes);
+#else
+  ::operator delete(base, std::align_val_t(alignof(T)));
+#endif
+}
+
+//! Make sure at least the given number of bytes at the start of the arena are usable.
+/*!
+ * \exception std::length_error If that is more than the capacity
+ * \exception std::bad_alloc If the memory can not be reserved or committed
+ */
+template <typename T, std::size_t _Default_Capacity>
+void contiguous_arena_allocator<T, _Default_Capacity>::arena::commit(std::size_t bytes) {
+  if (bytes <= committed_bytes) return;
+  if (bytes > reserved_bytes) [[unlikely]] {
+    throw std::length_error(
+        "AVL tree contiguous arena is full; construct the allocator with a "
+        "larger capacity.");
+  }
+  if (base == nullptr) {
+    reserve();
+    if (bytes <= committed_bytes) return;
+  }
+#if avl_has_mmap
+  // grow geometrically, in whole pages
+  std::size_t page = std::size_t(::sysconf(_SC_PAGESIZE));
+  std::size_t target = std::max(bytes, std::max(committed_bytes * 2, std::size_t(1) << 16));
+  target = std::min(reserved_bytes, (target + page - 1) / page * page);
+  if (::mprotect(base, target, PROT_READ | PROT_WRITE) != 0) throw std::bad_alloc();
+  committed_bytes = target;
+#endif
+}
+
+//! Forget every block and give the committed memory back, keeping the reserved addresses.
+template <typename T, std::size_t _Default_Capacity>
+void contiguous_arena_allocator<T, _Default_Capacity>::arena::release() {
+#if avl_has_mmap
+  if (committed_bytes != 0) {
+    ::madvise(base, committed_bytes, MADV_DONTNEED);
+    ::mprotect(base, committed_bytes, PROT_NONE);
+    committed_bytes = 0;
+  }
+#endif
+  used_bytes = 0;
+  free_list = nullptr;
+  live = 0;
+}
+
+//! Take a block from the free list, or else the next unused block.
+template <typename T, std::size_t _Default_Capacity>
+void *contiguous_arena_allocator<T, _Default_Capacity>::arena::allocate() {
+  if (free_list != nullptr) {
+    void *block = free_list;
+    std::memcpy(&free_list, block, sizeof(void *));
+    ++live;
+    return block;
+  }
+  commit(used_bytes + block_size);
+  void *block = base + used_bytes;
+  used_bytes += block_size;
+  ++live;
+  return block;
+}
+
+//! Put a block on the free list.
+template <typename T, std::size_t _Default_Capacity>
+void contiguous_arena_allocator<T, _Default_Capacity>::arena::deallocate(void *p) {
+  --live;
+  std::memcpy(p, &free_list, sizeof(void *));
+  free_list = p;
+}
+
+//! Construct an allocator with a new, empty arena.
+/*!
+ * \param capacity the maximum number of objects the arena can hold
+ */
+template <typename T, std::size_t _Default_Capacity>
+contiguous_arena_allocator<T, _Default_Capacity>::contiguous_arena_allocator(std::size_t capacity)
+    : _arena(std::make_shared<arena>(capacity)) {}
+
+//! Construct an allocator for a different type, which gets its own new, empty arena of the same capacity, reserved when first used.
+template <typename T, std::size_t _Default_Capacity>
+template <typename U>
+contiguous_arena_allocator<T, _Default_Capacity>::contiguous_arena_allocator(
+    const contiguous_arena_allocator<U, _Default_Capacity> &other)
+    : _arena(std::make_shared<arena>(other._arena->reserved_bytes /
+                                     contiguous_arena_allocator<U, _Default_Capacity>::block_size)) {}
+
+//! Allocate memory for n objects.
+/*!
+ * Single objects are taken from the arena, while larger requests
+ * go to the default allocator.
+ *
+ * \param n the number of objects
+ * \return pointer to the uninitialized memory
+ * \exception std::length_error If the arena is full
+ * \exception std::bad_alloc If there is not enough memory
+ */
+template <typename T, std::size_t _Default_Capacity>
+T *contiguous_arena_allocator<T, _Default_Capacity>::allocate(std::size_t n) {
+  if (n != 1) [[unlikely]] {
+    return std::allocator<T>().allocate(n);
+  }
+  return static_cast<T *>(_arena->allocate());
+}
+
+//! Deallocate memory for n objects, which was allocated by this arena.
+template <typename T, std::size_t _Default_Capacity>
+void contiguous_arena_allocator<T, _Default_Capacity>::deallocate(T *p, std::size_t n) {
+  if (n != 1) [[unlikely]] {
+    std::allocator<T>().deallocate(p, n);
+    return;
+  }
+  _arena->deallocate(p);
+}
+
+//! Construct an object in place.
+template <typename T, std::size_t _Default_Capacity>
+template <typename U, typename... _Args>
+void contiguous_arena_allocator<T, _Default_Capacity>::construct(U *p, _Args &&... args) {
+  ::new (static_cast<void *>(p)) U(std::forward<_Args>(args)...);
+}
+
+//! Destroy an object in place, without releasing its memory.
+template <typename T, std::size_t _Default_Capacity>
+template <typename U>
+void contiguous_arena_allocator<T, _Default_Capacity>::destroy(U *p) {
+  p->~U();
+}
+
+//! Check if no other allocator shares this pool.
+/*!
+ * \return true if this is the only allocator using the pool
+ * \sa release
+ */
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+bool pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::unshared() const noexcept {
+  return _pool.use_count() == 1;
+}
+
+//! Give all of the pool's memory back to the system at once.
+/*!
+ * Every object ever allocated from the pool is deallocated, without being destroyed,
+ * and the pool starts over from empty.
+ * Only do this when nothing allocated from the pool is in use anymore.
+ */
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+void pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::release() {
+  _pool->release();
+}
+
+//! Take over the memory of another allocator's pool, so that this allocator can free what it allocated.
+/*!
+ * The chunks, free blocks and never used blocks of the other pool are spliced into this pool
+ * in O(1) time, and the other allocator is left with an empty pool, as if it was just constructed.
+ * Afterwards, the 2 allocators still do not compare equal, unless they did before.
+ * This is only done if no other allocator shares the other pool,
+ * since those could no longer free what they allocated.
+ *
+ * \param other the allocator to take the memory of
+ * \return true if this allocator can now free everything which the other allocator allocated,
+ * or false if the other pool is shared, in which case nothing is changed
+ */
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+bool pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::absorb(pool_allocator &other) noexcept {
+  if (other._pool == _pool || other._pool->chunks == nullptr) return true;
+  if (other._pool.use_count() != 1) return false;
+  _pool->splice(*other._pool);
+  return true;
+}
+
+//! Get the number of bytes the pool has taken from the system, which is the total size of its chunks.
+/*!
+ * This is shared by all allocators using the same pool. Takes O(1) time.
+ *
+ * \return the number of bytes
+ * \sa used_bytes
+ */
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+std::size_t pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::reserved_bytes() const noexcept {
+  return _pool->reserved;
+}
+
+//! Get the number of bytes in blocks which are currently allocated from the pool.
+/*!
+ * This is shared by all allocators using the same pool. Takes O(1) time.
+ *
+ * \return the number of bytes
+ * \sa reserved_bytes
+ */
+template <typename T, std::size_t _Max_Chunk_Bytes, bool _Huge_Pages>
+std::size_t pool_allocator<T, _Max_Chunk_Bytes, _Huge_Pages>::used_bytes() const noexcept {
+  return _pool->live * block_size;
+}
+
+//! Pooled allocator which takes memory in 2 MB chunks backed by transparent huge pages.
+/*!
+ * For very large trees, where following links misses the TLB at nearly every level.
+ *
+ * \tparam T the type of object to allocate
+ * \sa pool_allocator
+ */
+template <typename T>
+using huge_page_pool_allocator = pool_allocator<T, std::size_t(1) << 21, true>;
+
+//! Check if no other allocator shares this arena.
+/*!
+ * \return true if this is the only allocator using the arena
+ * \sa release
+ */
+template <typename T, std::size_t _Default_Capacity>
+bool contiguous_arena_allocator<T, _Default_Capacity>::unshared() const noexcept {
+  return _arena.use_count() == 1;
+}
+
+//! Give all of the arena's memory back to the system at once.
+/*!
+ * Every object ever allocated from the arena is deallocated, without being destroyed,
+ * and the arena starts over from empty. The addresses stay reserved for reuse.
+ * Only do this when nothing allocated from the arena is in use anymore.
+ */
+template <typename T, std::size_t _Default_Capacity>
+void contiguous_arena_allocator<T, _Default_Capacity>::release() {
+  _arena->release();
+}
+
+//! Get the most objects which the arena can hold, whether or not it is reserved yet.
+template <typename T, std::size_t _Default_Capacity>
+std::size_t contiguous_arena_allocator<T, _Default_Capacity>::capacity() const noexcept {
+  return _arena->reserved_bytes / block_size;
+}
+
+//! Get the number of bytes of the arena which are backed by memory.
+/*!
+ * This counts committed memory, not addresses which are only reserved.
+ * It is shared by all allocators using the same arena. Takes O(1) time.
+ *
+ * \return the number of bytes
+ * \sa used_bytes
+ */
+template <typename T, std::size_t _Default_Capacity>
+std::size_t contiguous_arena_allocator<T, _Default_Capacity>::reserved_bytes() const noexcept {
+  return _arena->committed_bytes;
+}
+
+//! Get the number of bytes in blocks which are currently allocated from the arena.
+/*!
+ * This is shared by all allocators using the same arena. Takes O(1) time.
+ *
+ * \return the number of bytes
+ * \sa reserved_bytes
+ */
+template <typename T, std::size_t _Default_Capacity>
+std::size_t contiguous_arena_allocator<T, _Default_Capacity>::used_bytes() const noexcept {
+  return _arena->live * block_size;
+}
+
+//! Pooled allocator for nodes which keep their payload apart; used by split_layout.
+/*!
+ * Each chunk of the pool is an aligned block of a fixed power of 2 size,
+ * holding two parallel arrays: the nodes themselves, and after them
+ * the payloads (value and range intermediate value) of those nodes, in the same order.
+ * Since chunks are aligned to their size, the payload of a node is found from
+ * the node's address alone, by masking it down to the chunk and indexing the second array.
+ * Navigating the tree only touches the dense node array,
+ * and the payloads are only touched when they are needed.
+ *
+ * Otherwise the same as pool_allocator: freed nodes are reused through a free list,
+ * chunks are only given back all at once, and copies share the same pool.
+ * The payload is constructed by the node, and destroyed by destroy along with the node.
+ * T must be an avl_node whose layout keeps payloads apart,
+ * and requests for more than 1 object at a time are not supported.
+ *
+ * \tparam T the type of node to allocate
+ * \sa split_layout
+ */
+template <typename T>
+class split_pool_allocator {
+ private:
+  //! A free node slot, which stores the link to the next free slot in its own memory.
+  struct free_block {
+    free_block *next;
+  };
+  //! Header at the start of each chunk, linking all chunks of a pool together.
+  struct chunk_header {
+    chunk_header *next;
+  };
+  typedef typename T::payload_type payload_type;
+
+ public:
+  //! Size and alignment of each chunk, which must be a power of 2.
+  static constexpr std::size_t chunk_bytes = std::size_t(1) << 16;
+
+ private:
+  static constexpr std::size_t node_align = std::max(alignof(T), alignof(free_block));
+  static constexpr std::size_t node_size =
+      (std::max(sizeof(T), sizeof(free_block)) + node_align - 1) / node_align * node_align;
+  static constexpr std::size_t payload_size = sizeof(payload_type);
+  static constexpr std::size_t nodes_offset =
+      (sizeof(chunk_header) + node_align - 1) / node_align * node_align;
+  static constexpr std::size_t nodes_per_chunk =
+      (chunk_bytes - nodes_offset - alignof(payload_type)) / (node_size + payload_size);
+  static constexpr std::size_t payloads_offset =
+      (nodes_offset + nodes_per_chunk * node_size + alignof(payload_type) - 1) /
+      alignof(payload_type) * alignof(payload_type);
+  static_assert(nodes_per_chunk >= 1,
+                "split_pool_allocator chunks are too small for this payload");
+  static_assert(alignof(payload_type) <= chunk_bytes && node_align <= chunk_bytes,
+                "split_pool_allocator chunks are less aligned than the nodes");
+
+  //! The shared state of the pool.
+  struct pool {
+    free_block *free_list = nullptr;
+    chunk_header *chunks = nullptr;
+    char *bump = nullptr;
+    char *bump_end = nullptr;
+    //! Number of chunks.
+    std::size_t chunk_count = 0;
+    //! Number of nodes handed out and not yet freed.
+    std::size_t live = 0;
+
+    pool() = default;
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+    ~pool() { release(); }
+    void release() {
+      while (chunks != nullptr) {
+        chunk_header *next = chunks->next;
+        ::operator delete(static_cast<void *>(chunks), std::align_val_t(chunk_bytes));
+        chunks = next;
+      }
+      free_list = nullptr;
+      bump = nullptr;
+      bump_end = nullptr;
+      chunk_count = 0;
+      live = 0;
+    }
+    void *allocate() {
+      if (free_list != nullptr) {
+        free_block *block = free_list;
+        free_list = block->next;
+        ++live;
+        return block;
+      }
+      // only counted once grow has not thrown
+      if (bump == bump_end) grow();
+      void *block = bump;
+      bump += node_size;
+      ++live;
+      return block;
+    }
+    void deallocate(void *p) {
+      --live;
+      free_block *block = static_cast<free_block *>(p);
+      block->next = free_list;
+      free_list = block;
+    }
+    void grow() {
+      chunk_header *chunk = static_cast<chunk_header *>(
+          ::operator new(chunk_bytes, std::align_val_t(chunk_bytes)));
+      chunk->next = chunks;
+      chunks = chunk;
+      ++chunk_count;
+      bump = reinterpret_cast<char *>(chunk) + nodes_offset;
+      bump_end = bump + nodes_per_chunk * node_size;
+    }
+  };
+
+  std::shared_ptr<pool> _pool;
+
+ public:
+  typedef T value_type;
+  template <typename U>
+  struct rebind {
+    typedef split_pool_allocator<U> other;
+  };
+
+  split_pool_allocator();
+  split_pool_allocator(const split_pool_allocator &) = default;
+  T *allocate(std::size_t n);
+  void deallocate(T *p, std::size_t n);
+  template <typename U, typename... _Args>
+  void construct(U *p, _Args &&... args);
+  template <typename U>
+  void destroy(U *p);
+  bool unshared() const noexcept;
+  void release();
+  std::size_t reserved_bytes() const noexcept;
+  std::size_t used_bytes() const noexcept;
+  static void *payload_of(const T *);
+
+  bool operator==(const split_pool_allocator &other) const noexcept {
+    return _pool == other._pool;
+  }
+  bool operator!=(const split_pool_allocator &other) const noexcept {
+    return _pool != other._pool;
+  }
+};
+
+//! Construct an allocator with a new, empty pool.
+template <typename T>
+split_pool_allocator<T>::split_pool_allocator() : _pool(std::make_shared<pool>()) {}
+
+//! Allocate memory for 1 node, without its payload.
+/*!
+ * \param n the number of objects, which must be 1
+ * \return pointer to the uninitialized memory, whose payload slot is also uninitialized
+ */
+template <typename T>
+T *split_pool_allocator<T>::allocate(std::size_t n) {
+  if (n != 1) [[unlikely]] {
+    throw std::bad_alloc();
+  }
+  return static_cast<T *>(_pool->allocate());
+}
+
+//! Deallocate memory for 1 node, which was allocated by this pool.
+/*!
+ * \param p pointer to the memory
+ * \param n the number of objects, which must be 1
+ */
+template <typename T>
+void split_pool_allocator<T>::deallocate(T *p, std::size_t) {
+  _pool->deallocate(p);
+}
+
+//! Construct a node in place, which constructs its own payload.
+template <typename T>
+template <typename U, typename... _Args>
+void split_pool_allocator<T>::construct(U *p, _Args &&... args) {
+  ::new (static_cast<void *>(p)) U(std::forward<_Args>(args)...);
+}
+
+//! Destroy a node and its payload in place, without releasing their memory.
+template <typename T>
+template <typename U>
+void split_pool_allocator<T>::destroy(U *p) {
+  static_cast<payload_type *>(payload_of(p))->~payload_type();
+  p->~U();
+}
+
+//! Check if no other allocator shares this pool.
+/*!
+ * \return true if this is the only allocator using the pool
+ * \sa release
+ */
+template <typename T>
+bool split_pool_allocator<T>::unshared() const noexcept {
+  return _pool.use_count() == 1;
+}
+
+//! Give all of the pool's memory back to the system at once.
+/*!
+ * Every node ever allocated from the pool is deallocated, without being destroyed,
+ * and the pool starts over from empty.
+ * Only do this when nothing allocated from the pool is in use anymore.
+ */
+template <typename T>
+void split_pool_allocator<T>::release() {
+  _pool->release();
+}
+
+//! Get the number of bytes the pool has taken from the system, which is the total size of its chunks.
+/*!
+ * This is shared by all allocators using the same pool. Takes O(1) time.
+ *
+ * \return the number of bytes
+ * \sa used_bytes
+ */
+template <typename T>
+std::size_t split_pool_allocator<T>::reserved_bytes() const noexcept {
+  return _pool->chunk_count * chunk_bytes;
+}
+
+//! Get the number of bytes in nodes and their payloads which are currently allocated from the pool.
+/*!
+ * This is shared by all allocators using the same pool. Takes O(1) time.
+ *
+ * \return the number of bytes
+ * \sa reserved_bytes
+ */
+template <typename T>
+std::size_t split_pool_allocator<T>::used_bytes() const noexcept {
+  return _pool->live * (node_size + payload_size);
+}
+
+//! Find the payload slot of a node allocated by any split pool of this type.
+/*!
+ * \param node pointer to the node
+ * \return pointer to its payload slot, in the parallel array of the same chunk
+ */
+template <typename T>
+void *split_pool_allocator<T>::payload_of(const T *node) {
+  std::uintptr_t address = reinterpret_cast<std::uintptr_t>(node);
+  std::uintptr_t chunk = address & ~std::uintptr_t(chunk_bytes - 1);
+  std::size_t index = std::size_t(address - chunk - nodes_offset) / node_size;
+  return reinterpret_cast<void *>(chunk + payloads_offset + index * payload_size);
+}
+
+//! Check if an allocator can release all of its memory at once.
+/*!
+ * An allocator can release in bulk if it has the methods
+ * unshared(), which says if no other allocator shares its memory,
+ * and release(), which deallocates everything it ever allocated at once.
+ * Trees use this to skip deallocating nodes one by one when they are cleared.
+ *
+ * \sa pool_allocator
+ * \sa contiguous_arena_allocator
+ * \sa split_pool_allocator
+ */
+template <typename _Alloc, typename = void>
+struct can_release_in_bulk : std::false_type {};
+
+template <typename _Alloc>
+struct can_release_in_bulk<
+    _Alloc, std::void_t<decltype(std::declval<const _Alloc &>().unshared()),
+                        decltype(std::declval<_Alloc &>().release())>>
+    : std::true_type {};
+
+//! Check if an allocator can take over the memory of another allocator of the same type.
+/*!
+ * An allocator can absorb another if it has the method absorb(other),
+ * which makes it able to free everything the other allocator allocated, if it returns true.
+ * Trees use this to take the nodes of a tree with an unequal allocator as they are,
+ * such as when joining trees which were each default constructed.
+ *
+ * \sa pool_allocator::absorb
+ */
+template <typename _Alloc, typename = void>
+struct can_absorb : std::false_type {};
+
+template <typename _Alloc>
+struct can_absorb<
+    _Alloc, std::void_t<decltype(std::declval<_Alloc &>().absorb(std::declval<_Alloc &>()))>>
+    : std::true_type {};
+
+//! Check if an allocator can say how much memory it uses.
+/*!
+ * An allocator can report its memory if it has the methods
+ * reserved_bytes(), which says how many bytes it has taken from the system,
+ * and used_bytes(), which says how many of those are in objects which are currently allocated.
+ * Both should take O(1) time.
+ *
+ * \sa avl_tree::footprint
+ */
+template <typename _Alloc, typename = void>
+struct can_report_memory : std::false_type {};
+
+template <typename _Alloc>
+struct can_report_memory<
+    _Alloc, std::void_t<decltype(std::declval<const _Alloc &>().reserved_bytes()),
+                        decltype(std::declval<const _Alloc &>().used_bytes())>>
+    : std::true_type {};
+
+//! Allocator wrapper which holds on to 1 deallocated object and hands it out again; for internal use.
+/*!
+ * Wraps another allocator by reference.
+ * The first single object deallocated is kept instead of being freed,
+ * and the next single object allocated reuses it.
+ * Anything still kept is freed when the wrapper is destroyed.
+ * Used to move a node from one place in a tree to another without going through the allocator.
+ *
+ * \tparam _Alloc the wrapped allocator
+ */
+template <typename _Alloc>
+class node_recycler {
+ public:
+  typedef typename _Alloc::value_type value_type;
+
+ private:
+  _Alloc &_alloc;
+  value_type *spare;
+
+ public:
+  explicit node_recycler(_Alloc &i_alloc) : _alloc(i_alloc), spare(nullptr) {}
+  node_recycler(const node_recycler &) = delete;
+  node_recycler &operator=(const node_recycler &) = delete;
+  ~node_recycler() {
+    if (spare != nullptr) std::allocator_traits<_Alloc>::deallocate(_alloc, spare, 1);
+  }
+  value_type *allocate(std::size_t n) {
+    if (n == 1 && spare != nullptr) {
+      value_type *p = spare;
+      spare = nullptr;
+      return p;
+    }
+    return std::allocator_traits<_Alloc>::allocate(_alloc, n);
+  }
+  void deallocate(value_type *p, std::size_t n) {
+    if (n == 1 && spare == nullptr) {
+      spare = p;
+      return;
+    }
+    std::allocator_traits<_Alloc>::deallocate(_alloc, p, n);
+  }
+  template <typename U, typename... _Args>
+  void construct(U *p, _Args &&... args) {
+    std::allocator_traits<_Alloc>::construct(_alloc, p, std::forward<_Args>(args)...);
+  }
+  template <typename U>
+  void destroy(U *p) {
+    std::allocator_traits<_Alloc>::destroy(_alloc, p);
+  }
+};
+
+//! Allocator wrapper which never deallocates single objects; for internal use.
+/*!
+ * Wraps another allocator by reference.
+ * Used while a tree is being compacted, when a node being removed may belong either to
+ * the old allocator or the new one, so it must not be given to the new one's free list.
+ * Nodes are still destroyed, and their memory is given back when their allocator releases it all at once.
+ *
+ * \tparam _Alloc the wrapped allocator
+ * \sa avl_tree::compact
+ */
+template <typename _Alloc>
+class node_dropper {
+ private:
+  _Alloc &_alloc;
+
+ public:
+  typedef typename _Alloc::value_type value_type;
+
+  explicit node_dropper(_Alloc &i_alloc) : _alloc(i_alloc) {}
+  node_dropper(const node_dropper &) = delete;
+  node_dropper &operator=(const node_dropper &) = delete;
+  value_type *allocate(std::size_t n) { return std::allocator_traits<_Alloc>::allocate(_alloc, n); }
+  void deallocate(value_type *p, std::size_t n) {
+    if (n != 1) std::allocator_traits<_Alloc>::deallocate(_alloc, p, n);
+  }
+  template <typename U, typename... _Args>
+  void construct(U *p, _Args &&... args) {
+    std::allocator_traits<_Alloc>::construct(_alloc, p, std::forward<_Args>(args)...);
+  }
+  template <typename U>
+  void destroy(U *p) {
+    std::allocator_traits<_Alloc>::destroy(_alloc, p);
+  }
+};
+
+//! Node layout where child links are plain pointers.
+/*!
+ * The default node layout.
+ * Nodes may be anywhere in memory, so it works with any allocator.
+ * A layout provides the links class, which stores a node's left and right children
+ * and its balance factor, and the allocator which the tree uses by default with this layout.
+ * A new links object has no children and a balance factor of 0.
+ *
+ * \sa avl_node
+ */
+struct pointer_layout {
+  template <typename _Node>
+  class links {
+   private:
+    _Node *left;
+    _Node *right;
+    char balance;
+
+   public:
+    links() : left(nullptr), right(nullptr), balance(0) {}
+    _Node *get_left(const _Node *) const { return left; }
+    _Node *get_right(const _Node *) const { return right; }
+    char get_balance() const { return balance; }
+    void set_left(const _Node *, _Node *child) { left = child; }
+    void set_right(const _Node *, _Node *child) { right = child; }
+    void set_balance(char i_balance) { balance = i_balance; }
+  };
+  template <typename _Node>
+  using default_allocator = pool_allocator<_Node>;
+};
+
+//! Node layout where child links are plain pointers, and the balance factor is hidden in the left pointer.
+/*!
+ * Same as pointer_layout, except the balance factor is kept in the low 3 bits
+ * of the left child pointer, which are always 0 since nodes are aligned to at least 8 bytes.
+ * This saves the byte for the balance factor, and more importantly the padding after it,
+ * which is usually 16 to 25 percent of a node with a small element.
+ * 3 bits are used because the balance factor is briefly 2 or -2 while rebalancing.
+ *
+ * \sa pointer_layout
+ */
+struct packed_pointer_layout {
+  template <typename _Node>
+  class links {
+   private:
+    static constexpr std::uintptr_t balance_mask = 7;
+    std::uintptr_t left_and_balance;
+    _Node *right;
+
+   public:
+    links() : left_and_balance(2), right(nullptr) {
+      static_assert(alignof(_Node) >= 8,
+                    "packed_pointer_layout needs 3 free bits in node pointers");
+    }
+    _Node *get_left(const _Node *) const {
+      return reinterpret_cast<_Node *>(left_and_balance & ~balance_mask);
+    }
+    _Node *get_right(const _Node *) const { return right; }
+    char get_balance() const {
+      return char(int(left_and_balance & balance_mask) - 2);
+    }
+    void set_left(const _Node *, _Node *child) {
+      left_and_balance = reinterpret_cast<std::uintptr_t>(child) |
+                         (left_and_balance & balance_mask);
+    }
+    void set_right(const _Node *, _Node *child) { right = child; }
+    void set_balance(char i_balance) {
+      left_and_balance = (left_and_balance & ~balance_mask) |
+                         std::uintptr_t(i_balance + 2);
+    }
+  };
+  template <typename _Node>
+  using default_allocator = pool_allocator<_Node>;
+};
+
+//! Node layout where child links are 32 bit offsets relative to the node itself.
+/*!
+ * A compact node layout for large trees of small elements.
+ * Each child link is stored as the signed distance from the node to its child,
+ * counted in nodes, with 0 meaning there is no child.
+ * Links are half the size of pointers, and since they are relative,
+ * no arena base address is needed to follow them.
+ *
+ * This requires that all nodes of a tree are in one contiguous array,
+ * which is what contiguous_arena_allocator provides,
+ * and that array can hold at most 2^31 nodes.
+ * Trees with this layout refuse an arena which could hold more.
+ * The default arena holds 2^20 nodes, so larger trees need an arena of a larger capacity.
+ * Using this layout with any other allocator is undefined behaviour.
+ *
+ * \sa contiguous_arena_allocator
+ */
+struct relative_layout {
+  //! The most nodes which one arena can hold, so that every offset fits in a link.
+  static constexpr std::size_t max_nodes = std::size_t(1) << 31;
+  template <typename _Node>
+  class links {
+   private:
+    std::int32_t left;
+    std::int32_t right;
+    char balance;
+
+   public:
+    links() : left(0), right(0), balance(0) {}
+    _Node *get_left(const _Node *self) const { return resolve(self, left); }
+    _Node *get_right(const _Node *self) const { return resolve(self, right); }
+    char get_balance() const { return balance; }
+    void set_left(const _Node *self, _Node *child) { left = offset_of(self, child); }
+    void set_right(const _Node *self, _Node *child) { right = offset_of(self, child); }
+    void set_balance(char i_balance) { balance = i_balance; }
+  };
+  template <typename _Node>
+  using default_allocator = contiguous_arena_allocator<_Node>;
+
+  //! Follow a relative link, which is a distance in nodes.
+  template <typename _Node>
+  static _Node *resolve(const _Node *self, std::int32_t offset) {
+    if (offset == 0) return nullptr;
+    return reinterpret_cast<_Node *>(
+        reinterpret_cast<std::intptr_t>(self) +
+        std::intptr_t(offset) * std::intptr_t(sizeof(_Node)));
+  }
+  //! Make a relative link, which is a distance in nodes.
+  template <typename _Node>
+  static std::int32_t offset_of(const _Node *self, const _Node *child) {
+    if (child == nullptr) return 0;
+    return std::int32_t((reinterpret_cast<std::intptr_t>(child) -
+                         reinterpret_cast<std::intptr_t>(self)) /
+                        std::intptr_t(sizeof(_Node)));
+  }
+};
+
+//! Node layout where child links are relative offsets, and the balance factor is hidden in the left offset.
+/*!
+ * Same as relative_layout, except the balance factor is kept in the low 3 bits
+ * of the left child offset, which saves the balance factor byte and its padding.
+ * The offsets have 29 bits left, so one arena can hold at most 2^28 nodes,
+ * and trees with this layout refuse an arena which could hold more.
+ *
+ * \sa relative_layout
+ * \sa packed_pointer_layout
+ */
+struct packed_relative_layout {
+  //! The most nodes which one arena can hold, so that every offset fits in a link beside the balance factor.
+  static constexpr std::size_t max_nodes = std::size_t(1) << 28;
+  template <typename _Node>
+  class links {
+   private:
+    static constexpr std::int32_t balance_mask = 7;
+    std::int32_t left_and_balance;
+    std::int32_t right;
+
+   public:
+    links() : left_and_balance(2), right(0) {}
+    _Node *get_left(const _Node *self) const {
+      return relative_layout::resolve(
+          self, (left_and_balance - (left_and_balance & balance_mask)) / 8);
+    }
+    _Node *get_right(const _Node *self) const {
+      return relative_layout::resolve(self, right);
+    }
+    char get_balance() const {
+      return char((left_and_balance & balance_mask) - 2);
+    }
+    void set_left(const _Node *self, _Node *child) {
+      left_and_balance = relative_layout::offset_of(self, child) * 8 +
+                         (left_and_balance & balance_mask);
+    }
+    void set_right(const _Node *self, _Node *child) {
+      right = relative_layout::offset_of(self, child);
+    }
+    void set_balance(char i_balance) {
+      left_and_balance = left_and_balance - (left_and_balance & balance_mask) +
+                         std::int32_t(i_balance + 2);
+    }
+  };
+  template <typename _Node>
+  using default_allocator = contiguous_arena_allocator<_Node>;
+};
+
+//! Node layout which keeps the value and range intermediate value apart from the node.
+/*!
+ * For trees of large elements, where positional operations such as getting or inserting at an index
+ * only need the links, sizes and balance factors on the way down, but each node would otherwise
+ * also carry its whole element and range value, spreading one step over several cache lines.
+ * With this layout a node holds only the pointer links, balance factor and size,
+ * which is 32 bytes with the default size type, so 2 fit in a cache line.
+ * The value and range intermediate value (the payload) are kept in a parallel array,
+ * and only touched when the node's element or range value is actually needed.
+ *
+ * This requires split_pool_allocator, which lays out the parallel arrays.
+ * Using this layout with any other allocator is undefined behaviour.
+ *
+ * \sa split_pool_allocator
+ */
+struct split_layout {
+  template <typename _Node>
+  using links = pointer_layout::links<_Node>;
+  template <typename _Node>
+  using default_allocator = split_pool_allocator<_Node>;
+  //! This layout keeps payloads apart from the nodes.
+  static constexpr bool payload_apart = true;
+
+  //! Find where the payload of a node is kept.
+  template <typename _Node>
+  static void *payload_of(const _Node *node) {
+    return split_pool_allocator<_Node>::payload_of(node);
+  }
+};
+
+//! The value and range intermediate value of a node, for layouts which keep them apart; for internal use.
+/*!
+ * \sa split_layout
+ */
+template <typename _Element, typename _Range_Type_Intermediate>
+struct avl_node_payload {
+  //! Value of the node.
+  _Element value;
+  //! Range intermediate value for the node's subtree.
+  [[no_unique_address]] _Range_Type_Intermediate subrange;
+
+  //! Construct from an element, which is moved in if it is an rvalue, and its range intermediate value.
+  template <typename _Value>
+  avl_node_payload(_Value &&i_value, const _Range_Type_Intermediate &i_subrange)
+      : value(std::forward<_Value>(i_value)), subrange(i_subrange) {}
+  //! Construct the element in place from arguments for its constructor, computing its range intermediate value.
+  template <typename _Range_Preprocess, typename... _Args>
+  avl_node_payload(std::in_place_t, const _Range_Preprocess &_rpre,
+                   _Args &&... args)
+      : value(std::forward<_Args>(args)...), subrange(_rpre(value)) {}
+};
+
+//! Check if a node layout keeps the value and range intermediate value apart from the node.
+/*!
+ * A layout does this if it has a static constant payload_apart which is true,
+ * and then it must also have a static function payload_of, which finds where the payload of a node is.
+ * Other layouts keep them inside the node.
+ *
+ * \sa split_layout
+ */
+template <typename _Layout, typename = void>
+struct layout_keeps_payload_apart : std::false_type {};
+
+template <typename _Layout>
+struct layout_keeps_payload_apart<_Layout,
+                                  std::void_t<decltype(_Layout::payload_apart)>>
+    : std::integral_constant<bool, _Layout::payload_apart> {};
+
+//! Get the most nodes which one arena can hold for a node layout.
+/*!
+ * A layout whose links are offsets between nodes has a static constant max_nodes,
+ * so that every offset fits in a link. Other layouts have no limit.
+ *
+ * \sa relative_layout
+ */
+template <typename _Layout, typename = void>
+struct layout_max_nodes
+    : std::integral_constant<std::size_t, std::numeric_limits<std::size_t>::max()> {};
+
+template <typename _Layout>
+struct layout_max_nodes<_Layout, std::void_t<decltype(_Layout::max_nodes)>>
+    : std::integral_constant<std::size_t, _Layout::max_nodes> {};
+
+template <typename _Element, typename _Size = std::size_t,
+          typename _Range_Type_Intermediate = monostate,
+          typename _Layout = pointer_layout>
+class avl_node;
+
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Alloc>
+class avl_node_handle;
+
+//! One node of a frozen tree; for internal use.
+/*!
+ * A copy of the data of an AVL tree node, stored in an array instead of allocated on its own.
+ * Children are given as positions in that array, with a maximum value of the size type meaning no child.
+ *
+ * \sa frozen_avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
+struct frozen_node {
+  //! Value of this node.
+  _Element value;
+  //! Size of the subtree rooted at this node.
+  _Size size;
+  //! Range intermediate value for this subtree.
+  [[no_unique_address]] _Range_Type_Intermediate subrange;
+  //! Position of the left child, or the maximum value if there is none.
+  _Size left;
+  //! Position of the right child, or the maximum value if there is none.
+  _Size right;
+  //! Balance factor of the original node, kept so that thawing restores the same shape.
+  char balance;
+};
+
+// forward declarations for helper functions
+
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+_Size avl_node_size(avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node);
+
+template <typename _Element_2, typename _Size_2, typename _Range_Type_Intermediate_2,
+          typename _Layout_2>
+const _Element_2&
+avl_node_get_at_index(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2>*, _Size_2);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Go_Left, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Make_Leaf>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool,
+           _Size_2>
+avl_node_insert_walk(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    const _Element_2 &, const _Go_Left &, const _Merge &, const _Range_Preprocess &,
+    const _Range_Combine &, const _Make_Leaf &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc,
+          typename _Value>
+std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool>
+avl_node_insert_at_index(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    _Value &&, const _Merge &, const _Range_Preprocess &,
+    const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Compare,
+          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
+          typename _Alloc, typename _Value>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool,
+           _Size_2>
+avl_node_insert_ordered(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Value &&,
+    const _Compare &, const _Merge &, const _Range_Preprocess &,
+    const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool>
+avl_node_link_at_index(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Merge &, const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Compare,
+          typename _Merge, typename _Range_Preprocess, typename _Range_Combine>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool,
+           _Size_2>
+avl_node_link_ordered(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Compare &, const _Merge &, const _Range_Preprocess &,
+    const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Range_Preprocess,
+          typename _Range_Combine>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool,
+           avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *>
+avl_node_unlink_at_index(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Alloc>
+_Element_2 avl_node_take_element(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Function, typename _Alloc>
+void avl_node_take_elements(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Function &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Range_Preprocess,
+          typename _Range_Combine, typename _Alloc>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool,
+           _Element_2>
+avl_node_remove_at_index(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    const _Range_Preprocess &, const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Compare,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc,
+          typename _Key>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool,
+           std::optional<_Size_2>>
+avl_node_remove_ordered(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Key &, const _Compare &, const _Range_Preprocess &,
+    const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
+          typename _Alloc, typename _Value>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool,
+           bool>
+avl_node_overwrite_at_index(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    _Value &&, std::optional<_Element_2> &, const _Merge &,
+    const _Range_Preprocess &, const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2, typename _Range_Type_Intermediate_2,
+          typename _Layout_2,
+          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
+          typename _Alloc, typename _Value>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool,
+           _Element_2>
+avl_node_replace_at_index(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    _Value &&, const _Merge &, const _Range_Preprocess &,
+    const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2, typename _Range_Type_Intermediate_2,
+          typename _Layout_2,
+          typename _Compare, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine,
+          typename _Alloc, typename _Value, typename _Key>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, bool, std::optional<std::pair<_Size_2,_Size_2>>>
+avl_node_replace_ordered(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, const _Key &,
+    _Value &&, const _Compare &,
+    const _Merge &, const _Range_Preprocess &,
+    const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2>
+int avl_node_height(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int>
+avl_node_join_with_heights(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+    const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *avl_node_join(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *avl_node_join(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Range_Preprocess, typename _Range_Combine>
+std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+           avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int>
+avl_node_split_with_heights(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int, _Size_2,
+    const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+          avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *>
+avl_node_split_at_index(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Compare, typename _Merge, typename _Range_Preprocess,
+          typename _Range_Combine>
+std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int>
+avl_node_set_operation_with_heights(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+    set_operation, const _Compare &, const _Merge &,
+    const _Range_Preprocess &, const _Range_Combine &, unsigned,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *&);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Compare, typename _Merge, typename _Range_Preprocess,
+          typename _Range_Combine>
+avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *avl_node_set_operation(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    set_operation, const _Compare &, const _Merge &,
+    const _Range_Preprocess &, const _Range_Combine &, unsigned,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *&);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2, typename _Alloc>
+void avl_node_destroy_list(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Range_Preprocess,
+          typename _Range_Combine>
+_Range_Type_Intermediate_2 avl_node_get_range(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    _Size_2, const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Range_Preprocess>
+std::tuple<_Size_2, const _Element_2 *, _Range_Type_Intermediate_2>
+avl_node_find_weighted(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    _Range_Type_Intermediate_2, const _Range_Preprocess &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Modify,
+          typename _Range_Preprocess, typename _Range_Combine>
+void avl_node_modify_at_index(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    const _Modify &, const _Range_Preprocess &, const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Function>
+void avl_node_for_each(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Function &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Compare, typename _Key>
+std::pair<_Size_2, bool> avl_node_lower_bound(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Key &, const _Compare &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Compare, typename _Key>
+_Size_2 avl_node_upper_bound(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Key &, const _Compare &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2>
+void avl_node_freeze(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    std::vector<frozen_node<_Element_2, _Size_2, _Range_Type_Intermediate_2>> &);
+
+template <typename _Node, typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Alloc>
+_Node *avl_node_thaw(
+    const std::vector<frozen_node<_Element_2, _Size_2, _Range_Type_Intermediate_2>> &,
+    _Size_2, _Alloc &);
+
+template <typename _Node, typename _Iterator, typename _Size_2,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+_Node *avl_node_build(_Iterator &, _Size_2, const _Range_Preprocess &,
+                      const _Range_Combine &, _Alloc &);
+
+template <typename _Node, typename _Iterator, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+_Node *avl_node_build_merged(_Iterator, _Iterator, const _Merge &,
+                             const _Range_Preprocess &, const _Range_Combine &,
+                             _Alloc &);
+
+template <typename _Node, typename _Size_2, typename _Range_Preprocess,
+          typename _Range_Combine>
+_Node *avl_node_relink(_Node *&, _Size_2, const _Range_Preprocess &,
+                       const _Range_Combine &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Compare, typename _Merge, typename _Range_Preprocess,
+          typename _Range_Combine, typename _Alloc>
+avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *avl_node_merge_rebuild(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    const _Compare &, const _Merge &, const _Range_Preprocess &,
+    const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2, typename _Layout_2,
+          typename _Compare, typename _Merge, typename _Range_Preprocess,
+          typename _Range_Combine, typename _Alloc>
+avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *avl_node_insert_sorted_batch(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+    std::vector<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *> &,
+    const _Compare &, const _Merge &, const _Range_Preprocess &,
+    const _Range_Combine &, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Alloc>
+void avl_node_destroy(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Alloc>
+void avl_node_destroy_elements(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Alloc &);
+
+template <typename _Element_2, typename _Size_2,
+          typename _Range_Type_Intermediate_2,
+          typename _Layout_2, typename _Alloc>
+avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *
+avl_node_relocate(
+    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+    _Size_2, _Alloc &);
+
+// declaration for avl_node
+
+//! AVL tree node; for internal use.
+/*!
+ * Represents a single AVL tree node.
+ * Stores left and right child pointers, the actual data element,
+ * the subtree's size (number of nodes contained), the balance factor,
+ * and the intermediate range value.
+ * Designated for internal use; to enforce this,
+ * data members are private and only exposed through the helper functions
+ * which work on the tree at a higher level.
+ * It's intentional that end users can see the class (they need it for type declarations),
+ * but those users aren't meant to manipulate the nodes directly.
+ * Subtrees are represented as pointers to nodes,
+ * with the null pointer being an empty subtree.
+ * How the child links are stored in memory is decided by the node layout,
+ * but the helper functions only ever see pointers.
+ * The layout also decides whether the value and range intermediate value are stored in the node,
+ * or kept apart from it, so the helper functions reach them through element and range.
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+class avl_node {
+ public:
+  //! Whether the layout keeps the value and range intermediate value apart from the node.
+  static constexpr bool payload_apart = layout_keeps_payload_apart<_Layout>::value;
+  //! The value and range intermediate value, as kept apart from the node.
+  typedef avl_node_payload<_Element, _Range_Type_Intermediate> payload_type;
+
+ private:
+  //! Left and right child links, and the balance factor.
+  /*!
+   * The links to the left and right children of this node,
+   * and the "balance factor" of this node in the AVL tree.
+   * Balance factors are used for memory efficient (better than storing the height) implementations of AVL trees.
+   * The balance factor is always either -1, 0, or 1, equal to the height of the right subtree minus the height of the left subtree.
+   * How these are stored depends on the node layout.
+   *
+   * \sa pointer_layout
+   */
+  typename _Layout::template links<avl_node> children;
+  //! Stands in for the value, when the layout keeps it apart from the node.
+  struct value_apart {
+    //! Ignore the arguments for the value, which go to the payload instead.
+    template <typename... _Args>
+    explicit value_apart(_Args &&...) {}
+  };
+  //! Stands in for the range intermediate value, when the layout keeps it apart from the node.
+  struct subrange_apart {};
+  //! Value of this node.
+  /*!
+   * The single value of this node.
+   * May also be called the data value or label.
+   * If the layout keeps payloads apart, it is in the payload instead.
+   *
+   * \sa element
+   */
+  [[no_unique_address]] typename std::conditional<payload_apart, value_apart,
+                                                  _Element>::type value;
+  //! Size of the subtree rooted at this node.
+  /*!
+   * The size (number of nodes contained) of the subtree rooted at this node.
+   */
+  [[no_unique_address]] _Size size;
+  //! Range intermediate value for this subtree.
+  /*!
+   * The range intermediate value for this subtree.
+   * Used for range operations.
+   * If the layout keeps payloads apart, it is in the payload instead.
+   *
+   * \sa avl_tree
+   * \sa range
+   */
+  [[no_unique_address]] typename std::conditional<
+      payload_apart, subrange_apart, _Range_Type_Intermediate>::type subrange;
+
+  //! Get the payload, when the layout keeps it apart from the node.
+  payload_type *payload() const {
+    return static_cast<payload_type *>(_Layout::payload_of(this));
+  }
+  //! Get the value of this node, wherever the layout keeps it.
+  _Element &element() {
+    if constexpr (payload_apart) {
+      return payload()->value;
+    } else {
+      return value;
+    }
+  }
+  //! Get the value of this node, wherever the layout keeps it.
+  const _Element &element() const {
+    if constexpr (payload_apart) {
+      return payload()->value;
+    } else {
+      return value;
+    }
+  }
+  //! Get the range intermediate value for this subtree, wherever the layout keeps it.
+  _Range_Type_Intermediate &range() {
+    if constexpr (payload_apart) {
+      return payload()->subrange;
+    } else {
+      return subrange;
+    }
+  }
+  //! Get the range intermediate value for this subtree, wherever the layout keeps it.
+  const _Range_Type_Intermediate &range() const {
+    if constexpr (payload_apart) {
+      return payload()->subrange;
+    } else {
+      return subrange;
+    }
+  }
+
+  //! Get the left child, or null if there is none.
+  avl_node *left() const { return children.get_left(this); }
+  //! Get the right child, or null if there is none.
+  avl_node *right() const { return children.get_right(this); }
+  //! Set the left child, which may be null.
+  void set_left(avl_node *child) { children.set_left(this, child); }
+  //! Set the right child, which may be null.
+  void set_right(avl_node *child) { children.set_right(this, child); }
+  //! Get the balance factor.
+  char balance() const { return children.get_balance(); }
+  //! Set the balance factor.
+  void set_balance(char i_balance) { children.set_balance(i_balance); }
+  //! Make the range intermediate value member, or its stand in if the layout keeps it apart.
+  template <typename _Range_Preprocess, typename _Value>
+  static typename std::conditional<payload_apart, subrange_apart,
+                                   _Range_Type_Intermediate>::type
+  own_subrange(const _Range_Preprocess &_rpre, const _Value &i_value) {
+    if constexpr (payload_apart) {
+      return subrange_apart();
+    } else {
+      return _rpre(i_value);
+    }
+  }
+
+ public:
+  //! Construct from data.
+  /*!
+   * Construct a lone node given an element and range intermediate value.
+   * Other data members are set automatically to match those of a single node with no children.
+   * \param i_value the element value, which is moved in if it is an rvalue
+   * \param i_subrange the range intermediate value for just this element
+   */
+  template <typename _Value>
+  avl_node(_Value &&i_value, const _Range_Type_Intermediate &i_subrange)
+      : value(std::forward<_Value>(i_value)),
+        subrange(own_subrange(identity<_Range_Type_Intermediate>(), i_subrange)) {
+    if constexpr (payload_apart) {
+      // the node's allocator destroys the payload along with the node
+      ::new (static_cast<void *>(payload()))
+          payload_type(std::forward<_Value>(i_value), i_subrange);
+    }
+    size = _Size(1);
+  }
+  //! Construct the element in place, and compute its range intermediate value in place.
+  /*!
+   * The arguments are passed to the element's constructor, so given an element,
+   * it is moved in if it is an rvalue, and is not copied or moved anywhere else,
+   * so move-only elements work.
+   * \param _rpre range preprocess function
+   * \param args the arguments for the element's constructor
+   */
+  template <typename _Range_Preprocess, typename... _Args>
+  avl_node(std::in_place_t, const _Range_Preprocess &_rpre, _Args &&... args)
+      : value(std::forward<_Args>(args)...),
+        subrange(own_subrange(_rpre, value)) {
+    if constexpr (payload_apart) {
+      ::new (static_cast<void *>(payload()))
+          payload_type(std::in_place, _rpre, std::forward<_Args>(args)...);
+    }
+    size = _Size(1);
+  }
+
+  // these helper functions are friends
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2>
+  friend _Size_2 avl::avl_node_size(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *);
+
+  template <typename _Element_2, typename _Size_2, typename _Range_Type_Intermediate_2,
+          typename _Layout_2>
+  friend const _Element_2&
+  avl::avl_node_get_at_index(
+    const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2>*, _Size_2);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Go_Left, typename _Merge,
+            typename _Range_Preprocess, typename _Range_Combine, typename _Make_Leaf>
+  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                    bool, _Size_2>
+  avl::avl_node_insert_walk(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+      const _Element_2 &, const _Go_Left &, const _Merge &, const _Range_Preprocess &,
+      const _Range_Combine &, const _Make_Leaf &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Merge,
+            typename _Range_Preprocess, typename _Range_Combine,
+            typename _Alloc, typename _Value>
+  friend std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                   bool>
+  avl::avl_node_insert_at_index(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+      _Value &&, const _Merge &, const _Range_Preprocess &,
+      const _Range_Combine &, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Compare,
+            typename _Merge, typename _Range_Preprocess,
+            typename _Range_Combine, typename _Alloc, typename _Value>
+  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                    bool, _Size_2>
+  avl::avl_node_insert_ordered(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Value &&,
+      const _Compare &, const _Merge &, const _Range_Preprocess &,
+      const _Range_Combine &, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Merge,
+            typename _Range_Preprocess, typename _Range_Combine>
+  friend std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                   bool>
+  avl::avl_node_link_at_index(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      const _Merge &, const _Range_Preprocess &, const _Range_Combine &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Compare,
+            typename _Merge, typename _Range_Preprocess,
+            typename _Range_Combine>
+  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                    bool, _Size_2>
+  avl::avl_node_link_ordered(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      const _Compare &, const _Merge &, const _Range_Preprocess &,
+      const _Range_Combine &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Range_Preprocess,
+            typename _Range_Combine>
+  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                    bool,
+                    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *>
+  avl::avl_node_unlink_at_index(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+      const _Range_Preprocess &, const _Range_Combine &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Alloc>
+  friend _Element_2 avl::avl_node_take_element(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Function, typename _Alloc>
+  friend void avl::avl_node_take_elements(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      const _Function &, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Range_Preprocess,
+            typename _Range_Combine, typename _Alloc>
+  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                    bool, _Element_2>
+  avl::avl_node_remove_at_index(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+      const _Range_Preprocess &, const _Range_Combine &, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Compare,
+            typename _Range_Preprocess, typename _Range_Combine,
+            typename _Alloc, typename _Key>
+  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                    bool, std::optional<_Size_2>>
+  avl::avl_node_remove_ordered(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      const _Key &, const _Compare &, const _Range_Preprocess &,
+      const _Range_Combine &, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Range_Preprocess,
+            typename _Range_Combine>
+  friend _Range_Type_Intermediate_2 avl::avl_node_get_range(
+      const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      _Size_2, _Size_2, const _Range_Preprocess &, const _Range_Combine &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Range_Preprocess>
+  friend std::tuple<_Size_2, const _Element_2 *, _Range_Type_Intermediate_2>
+  avl::avl_node_find_weighted(
+      const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      _Range_Type_Intermediate_2, const _Range_Preprocess &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Modify,
+            typename _Range_Preprocess, typename _Range_Combine>
+  friend void avl::avl_node_modify_at_index(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+      const _Modify &, const _Range_Preprocess &, const _Range_Combine &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Function>
+  friend void avl::avl_node_for_each(
+      const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      const _Function &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Compare, typename _Key>
+  friend std::pair<_Size_2, bool> avl::avl_node_lower_bound(
+      const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      const _Key &, const _Compare &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Compare, typename _Key>
+  friend _Size_2 avl::avl_node_upper_bound(
+      const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      const _Key &, const _Compare &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2>
+  friend void avl::avl_node_freeze(
+      const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      std::vector<frozen_node<_Element_2, _Size_2, _Range_Type_Intermediate_2>> &);
+
+  template <typename _Node, typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Alloc>
+  friend _Node *avl::avl_node_thaw(
+      const std::vector<frozen_node<_Element_2, _Size_2, _Range_Type_Intermediate_2>> &,
+      _Size_2, _Alloc &);
+
+  template <typename _Node, typename _Iterator, typename _Size_2,
+            typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+  friend _Node *avl::avl_node_build(_Iterator &, _Size_2,
+                                    const _Range_Preprocess &,
+                                    const _Range_Combine &, _Alloc &);
+
+  template <typename _Node, typename _Iterator, typename _Merge,
+            typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+  friend _Node *avl::avl_node_build_merged(_Iterator, _Iterator, const _Merge &,
+                                           const _Range_Preprocess &,
+                                           const _Range_Combine &, _Alloc &);
+
+  template <typename _Node, typename _Size_2, typename _Range_Preprocess,
+            typename _Range_Combine>
+  friend _Node *avl::avl_node_relink(_Node *&, _Size_2, const _Range_Preprocess &,
+                                     const _Range_Combine &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2,
+            typename _Compare, typename _Merge, typename _Range_Preprocess,
+            typename _Range_Combine, typename _Alloc>
+  friend avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *
+  avl::avl_node_merge_rebuild(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      const _Compare &, const _Merge &, const _Range_Preprocess &,
+      const _Range_Combine &, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2,
+            typename _Compare, typename _Merge, typename _Range_Preprocess,
+            typename _Range_Combine, typename _Alloc>
+  friend avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *
+  avl::avl_node_insert_sorted_batch(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      std::vector<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *> &,
+      const _Compare &, const _Merge &, const _Range_Preprocess &,
+      const _Range_Combine &, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Alloc>
+  friend void avl::avl_node_destroy(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Alloc>
+  friend void avl::avl_node_destroy_elements(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2,
+            typename _Layout_2, typename _Alloc>
+  friend avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *
+  avl::avl_node_relocate(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+      _Size_2, _Alloc &);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2,
+            typename _Merge, typename _Range_Preprocess,
+            typename _Range_Combine, typename _Alloc, typename _Value>
+  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+                    bool, bool>
+  avl::avl_node_overwrite_at_index(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Size_2,
+      _Value &&, std::optional<_Element_2> &, const _Merge &,
+      const _Range_Preprocess &, const _Range_Combine &, _Alloc &);
+
+  // avl_node_replace_at_index does not need friend
+  // avl_node_replace_ordered does not need friend
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2>
+  friend int avl::avl_node_height(
+      const avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *);
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2,
+            typename _Range_Preprocess, typename _Range_Combine>
+  friend std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int>
+  avl::avl_node_join_with_heights(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *,
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+      const _Range_Preprocess &, const _Range_Combine &);
+
+  // avl_node_join does not need friend
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2,
+            typename _Range_Preprocess, typename _Range_Combine>
+  friend std::tuple<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+                    avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int>
+  avl::avl_node_split_with_heights(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int, _Size_2,
+      const _Range_Preprocess &, const _Range_Combine &);
+
+  // avl_node_split_at_index does not need friend
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2,
+            typename _Compare, typename _Merge, typename _Range_Preprocess,
+            typename _Range_Combine>
+  friend std::pair<avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int>
+  avl::avl_node_set_operation_with_heights(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, int,
+      set_operation, const _Compare &, const _Merge &,
+      const _Range_Preprocess &, const _Range_Combine &, unsigned,
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *&);
+
+  // avl_node_set_operation does not need friend
+
+  template <typename _Element_2, typename _Size_2,
+            typename _Range_Type_Intermediate_2, typename _Layout_2, typename _Alloc>
+  friend void avl::avl_node_destroy_list(
+      avl_node<_Element_2, _Size_2, _Range_Type_Intermediate_2, _Layout_2> *, _Alloc &);
+
+  template <typename, typename, typename, typename, typename>
+  friend class avl_node_handle;
+
+  // these are our methods
+
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  void update(const _Range_Preprocess &, const _Range_Combine &);
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  avl_node *rotate_left(const _Range_Preprocess &_rpre,
+                        const _Range_Combine &_rcomb);
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  avl_node *rotate_right(const _Range_Preprocess &_rpre,
+                         const _Range_Combine &_rcomb);
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  avl_node *ensure_not_right_heavy(const _Range_Preprocess &_rpre,
+                                   const _Range_Combine &_rcomb);
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  avl_node *ensure_not_left_heavy(const _Range_Preprocess &_rpre,
+                                  const _Range_Combine &_rcomb);
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  avl_node *rebalance_right_heavy(const _Range_Preprocess &_rpre,
+                                  const _Range_Combine &_rcomb);
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  avl_node *rebalance_left_heavy(const _Range_Preprocess &_rpre,
+                                 const _Range_Combine &_rcomb);
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  std::pair<avl_node *, bool> rebalance_left_shorter(
+      bool shorter, const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb);
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  std::pair<avl_node *, bool> rebalance_right_shorter(
+      bool shorter, const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb);
+};
+
+//! Get the size of the subtree.
+/*!
+ * Get the number of nodes in a subtree.
+ * A subtree represented by the null pointer is an empty tree, so its size is 0.
+ *
+ * \param node the node to get the size of
+ * \return how many nodes are in the subtree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+_Size avl_node_size(avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node) {
+  if (node == nullptr) return 0;
+  return node->size;
+}
+
+//! Update size and range intermediate values at this node.
+/*!
+ * Updates size and range intermediate values at this node. Assumes its children
+ * (if they exist) already have correct values.
+ *
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \sa avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+void avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::update(
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  size = _Size(1);
+  _Range_Type_Intermediate &own_range = range();
+  own_range = _rpre(element());
+  avl_node *left_child = left();
+  avl_node *right_child = right();
+  if (left_child != nullptr) {
+    size = left_child->size + size;
+    own_range = _rcomb(left_child->range(), own_range);
+  }
+  if (right_child != nullptr) {
+    size = size + right_child->size;
+    own_range = _rcomb(own_range, right_child->range());
+  }
+}
+
+//! Perform a left rotation on this subtree, and return the new root.
+/*!
+ * Performs a left rotation on this subtree.
+ * Will also update the sizes and range intermediate values, so if you know a
+ * tree rotation is needed, you can avoid explicitly calling update (the freshly
+ * updated values would have been discarded anyway, and this method will make
+ * the correct updates after performing the rotation)
+ *
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return the new subtree root
+ * \sa avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>
+    *avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::rotate_left(
+        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  avl_node *pivot = this->right();
+  this->set_right(pivot->left());
+  pivot->set_left(this);
+  this->set_balance(this->balance() - (1 + std::max(char(0), pivot->balance())));
+  pivot->set_balance(pivot->balance() - (1 - std::min(char(0), this->balance())));
+  this->update(_rpre, _rcomb);
+  pivot->update(_rpre, _rcomb);
+  return pivot;
+}
+
+//! Perform a right rotation on this subtree, and return the new root.
+/*!
+ * The mirrored version of rotate_left. See docs for rotate_left.
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>
+    *avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::rotate_right(
+        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  avl_node *pivot = this->left();
+  this->set_left(pivot->right());
+  pivot->set_right(this);
+  this->set_balance(this->balance() + (1 - std::min(char(0), pivot->balance())));
+  pivot->set_balance(pivot->balance() + (1 + std::max(char(0), this->balance())));
+  this->update(_rpre, _rcomb);
+  pivot->update(_rpre, _rcomb);
+  return pivot;
+}
+
+//! Ensure this subtree is not right heavy, and rotates if needed. Returns the new root.
+/*!
+ * If the subtree is right heavy (right subtree is taller than left), does a
+ * left rotation to make it not right heavy anymore.
+ *
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return the new subtree root
+ * \sa avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::ensure_not_right_heavy(
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  if (this->balance() <= 0) return this;
+  return this->rotate_left(_rpre, _rcomb);
+}
+
+//! Ensure this subtree is not left heavy, and rotates if needed. Returns the new root.
+/*!
+ * Mirrored version of ensure_not_right_heavy.
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>
+    *avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::ensure_not_left_heavy(
+        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  if (this->balance() >= 0) return this;
+  return this->rotate_right(_rpre, _rcomb);
+}
+
+//! Knowing that this node's balance factor is 2 (very right heavy), rotate to correct the imbalance, and return the new root.
+/*!
+ * Rebalances the tree when the only imbalance is at this node and its balance
+ * factor is 2. (overly right heavy)
+ *
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \sa avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>
+    *avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::rebalance_right_heavy(
+        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  if (this->right() != nullptr)
+    this->set_right(this->right()->ensure_not_left_heavy(_rpre, _rcomb));
+  return this->rotate_left(_rpre, _rcomb);
+}
+
+//! Knowing that this node's balance factor is -2 (very left heavy), rotate to correct the imbalance, and return the new root.
+/*!
+ * Mirrored version of rebalance_right_heavy.
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>
+    *avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::rebalance_left_heavy(
+        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  if (this->left() != nullptr)
+    this->set_left(this->left()->ensure_not_right_heavy(_rpre, _rcomb));
+  return this->rotate_right(_rpre, _rcomb);
+}
+
+//! After the left subtree may have gotten shorter, fix this subtree, and return the new root and whether it got shorter.
+/*!
+ * Used after removing from the left subtree.
+ * Adjusts the balance factor, rotates if needed, and updates the sizes and range intermediate values.
+ *
+ * \param shorter whether the left subtree got shorter
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return pair: (new subtree root, whether this subtree got shorter)
+ * \sa avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::rebalance_left_shorter(
+    bool shorter, const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  this->set_balance(this->balance() + shorter);
+  if (!shorter || this->balance() == 1) {
+    this->update(_rpre, _rcomb);
+    return std::make_pair(this, false);
+  } else if (this->balance() == 0) {
+    this->update(_rpre, _rcomb);
+    return std::make_pair(this, true);
+  }
+  avl_node *root = this->rebalance_right_heavy(_rpre, _rcomb);
+  return std::make_pair(root, root->balance() == 0);
+}
+
+//! After the right subtree may have gotten shorter, fix this subtree, and return the new root and whether it got shorter.
+/*!
+ * Mirrored version of rebalance_left_shorter.
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+template <typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>::rebalance_right_shorter(
+    bool shorter, const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  this->set_balance(this->balance() - shorter);
+  if (!shorter || this->balance() == -1) {
+    this->update(_rpre, _rcomb);
+    return std::make_pair(this, false);
+  } else if (this->balance() == 0) {
+    this->update(_rpre, _rcomb);
+    return std::make_pair(this, true);
+  }
+  avl_node *root = this->rebalance_left_heavy(_rpre, _rcomb);
+  return std::make_pair(root, root->balance() == 0);
+}
+
+//! Get the element at a specific index in the subtree.
+/*!
+ * Get (a const reference to) the element at a specific index.
+ *
+ * \param node root of the subtree, which must not be null
+ * \param node index to get the element of, in range [0, size of tree)
+ * \return (a const reference to) the element at that index
+ * \exception std::out_of_range If the requested index is outside the range [0, size of subtree)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+const _Element&
+avl_node_get_at_index(
+    const avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index) {
+  if (node == nullptr) [[unlikely]] {
+    throw std::out_of_range(
+      "AVL tree operation get at index tried to get from an empty "
+      "subtree. This happens when the index is outside of the range of "
+      "valid indices for this tree.");
+  }
+  _Size left_size = avl_node_size(node->left());
+  if (index == left_size) {
+    // at this node
+    return node->element();
+  } else if (index < left_size) {
+    // on the left
+    return avl_node_get_at_index(node->left(), index);
+  } else {
+    // on the right
+    return avl_node_get_at_index(node->right(), index - (left_size + _Size(1)));
+  }
+}
+
+//! Walk down the subtree to where a new element goes, and rebalance on the way back up.
+/*!
+ * The one walk shared by inserting and linking, whether by index or in order.
+ * At each node, a merge of the new element into the node's element is tried first,
+ * and otherwise the walk goes left or right as the direction function says.
+ * At the empty subtree where the element goes, the leaf function makes its node,
+ * such as by allocating and constructing one, or by handing over a lone node,
+ * and may throw, in which case nothing has been changed.
+ *
+ * The index is only kept up to date for the direction and leaf functions,
+ * as the index to insert at within the current subtree,
+ * for walks by index; other walks may pass anything.
+ *
+ * \param node the root of the subtree
+ * \param index the index to insert at, for walks by index
+ * \param value the new element, which merges are tried with
+ * \param _go_left direction function, which takes a node and the index, and says whether to go left
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _make_leaf leaf function, which takes the index and returns a new node with no children
+ * \return tuple: (new subtree root, whether it got taller, index of the inserted or merged element)
+ * \sa avl_node_insert_at_index
+ * \sa avl_node_insert_ordered
+ * \sa avl_node_link_at_index
+ * \sa avl_node_link_ordered
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Go_Left, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Make_Leaf>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool, _Size>
+avl_node_insert_walk(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    const _Element &value, const _Go_Left &_go_left, const _Merge &_merge,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb,
+    const _Make_Leaf &_make_leaf) {
+  // empty node special case
+  if (node == nullptr) {
+    return std::make_tuple(_make_leaf(index), true, _Size(0));
+  }
+  _Size left_size = avl_node_size(node->left());
+  // attempt merge
+  if (_merge(node->element(), value)) {
+    node->update(_rpre, _rcomb);
+    return std::make_tuple(node, false, left_size);
+  }
+  // insert normally
+  if (_go_left(node, index)) {
+    auto partial = avl_node_insert_walk(node->left(), index, value, _go_left, _merge,
+                                        _rpre, _rcomb, _make_leaf);
+    node->set_left(std::get<0>(partial));
+    bool taller = std::get<1>(partial);
+    _Size inserted = std::get<2>(partial);
+    node->set_balance(node->balance() - taller);
+    if (!taller || node->balance() == 0) {
+      node->update(_rpre, _rcomb);
+      return std::make_tuple(node, false, inserted);
+    } else if (node->balance() == -1) {
+      node->update(_rpre, _rcomb);
+      return std::make_tuple(node, true, inserted);
+    }
+    return std::make_tuple(node->rebalance_left_heavy(_rpre, _rcomb), false, inserted);
+  } else {
+    auto partial = avl_node_insert_walk(node->right(), _Size(index - (left_size + _Size(1))),
+                                        value, _go_left, _merge, _rpre, _rcomb,
+                                        _make_leaf);
+    node->set_right(std::get<0>(partial));
+    bool taller = std::get<1>(partial);
+    _Size inserted = left_size + _Size(1) + std::get<2>(partial);
+    node->set_balance(node->balance() + taller);
+    if (!taller || node->balance() == 0) {
+      node->update(_rpre, _rcomb);
+      return std::make_tuple(node, false, inserted);
+    } else if (node->balance() == 1) {
+      node->update(_rpre, _rcomb);
+      return std::make_tuple(node, true, inserted);
+    }
+    return std::make_tuple(node->rebalance_right_heavy(_rpre, _rcomb), false, inserted);
+  }
+}
+
+//! Insert an element just before the given index in the subtree.
+/**
+ * Inserts the new element just at the given index.
+ * To be specific, if there is some element already at that index,
+ * then the new element will be directly before that other element.
+ * To insert after the current last element, use (the size of the subtree)
+ * as the index.
+ *
+ * The size of the subtree increases, unless a merge occurs,
+ * in which case the size of the subtree stays the same.
+ *
+ * The new element is only passed down by reference, and is moved into the new node
+ * if it is an rvalue, so it is not copied at every level, and move-only elements work.
+ *
+ * \param node the root of the subtree
+ * \param index the index to insert at
+ * \param value the value to be inserted at that index
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return tuple: (new subtree root, whether it got taller)
+ * \sa avl_tree
+ * \sa avl_node_insert_walk
+ * \exception std::out_of_range If the requested insertion index is outside the range [0, size of subtree + 1)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
+          typename _Alloc, typename _Value>
+std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool>
+avl_node_insert_at_index(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    _Value &&value, const _Merge &_merge, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  if constexpr (!std::is_same<typename std::decay<_Value>::type, _Element>::value) {
+    // convert once, rather than at every level
+    return avl_node_insert_at_index(node, index, _Element(std::forward<_Value>(value)),
+                                    _merge, _rpre, _rcomb, _alloc);
+  } else {
+    auto result = avl_node_insert_walk(
+        node, index, static_cast<const _Element &>(value),
+        [](const node_type *at, _Size at_index) {
+          return at_index <= avl_node_size(at->left());
+        },
+        _merge, _rpre, _rcomb, [&](_Size leaf_index) {
+          // only valid index for empty tree is 0
+          if (leaf_index != _Size(0)) [[unlikely]] {
+            throw std::out_of_range(
+              "AVL tree operation insert at index tried to insert before the"
+              "first valid index or after the last valid index.");
+          }
+          node_type *leaf = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+          try {
+            std::allocator_traits<_Alloc>::construct(_alloc, leaf, std::in_place, _rpre,
+                                                     std::forward<_Value>(value));
+          } catch (...) {
+            std::allocator_traits<_Alloc>::deallocate(_alloc, leaf, 1);
+            throw;
+          }
+          return leaf;
+        });
+    return std::make_pair(std::get<0>(result), std::get<1>(result));
+  }
+}
+
+//! Insert a new element in the subtree just after all elements that are less than it.
+/*!
+ * Insert a new element in the subtree just after all elements that are less than it.
+ * As currently implemented, elements which are equivalent or incomparable are considered
+ * greater than the new element being inserted
+ * for purposes of determining where to insert,
+ * though it is only required that the new value is inserted after all elements less than it
+ * and before all elements greater than it.
+ * It is required as a precondition that the subtree is already sorted in ascending order,
+ * that is, for all pairs of elements, the left element is not greater than the right element.
+ *
+ * The size of the subtree increases, unless a merge occurs,
+ * in which case the size of the subtree stays the same.
+ *
+ * One of the return values is the insertion index,
+ * which is the index of the newly inserted value,
+ * or if it was merged, the index of the merged value.
+ *
+ * The new element is only passed down by reference, and is moved into the new node
+ * if it is an rvalue, so it is not copied at every level, and move-only elements work.
+ *
+ * \param node the root of the subtree
+ * \param value the value to be inserted
+ * \param _less less than function
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return tuple: (new subtree root, whether it got taller, index of the inserted value)
+ * \sa avl_tree
+ * \sa avl_node_insert_walk
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Compare, typename _Merge, typename _Range_Preprocess,
+          typename _Range_Combine, typename _Alloc, typename _Value>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool, _Size>
+avl_node_insert_ordered(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Value &&value,
+    const _Compare &_less, const _Merge &_merge, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  if constexpr (!std::is_same<typename std::decay<_Value>::type, _Element>::value) {
+    // convert once, rather than at every level
+    return avl_node_insert_ordered(node, _Element(std::forward<_Value>(value)),
+                                   _less, _merge, _rpre, _rcomb, _alloc);
+  } else {
+    const _Element &key = value;
+    return avl_node_insert_walk(
+        node, _Size(0), key,
+        [&](const node_type *at, _Size) { return !_less(at->element(), key); }, _merge,
+        _rpre, _rcomb, [&](_Size) {
+          node_type *leaf = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+          try {
+            std::allocator_traits<_Alloc>::construct(_alloc, leaf, std::in_place, _rpre,
+                                                     std::forward<_Value>(value));
+          } catch (...) {
+            std::allocator_traits<_Alloc>::deallocate(_alloc, leaf, 1);
+            throw;
+          }
+          return leaf;
+        });
+  }
+}
+
+//! Link a lone node into the subtree just before an index, unless its element merges.
+/*!
+ * The same as avl_node_insert_at_index, except that the new element is already in a node,
+ * such as one whose element was constructed in place, which is linked in as it is.
+ * If the element merges into another element, the node is not linked,
+ * so the size of the subtree stays the same, and the caller still owns the node.
+ *
+ * \param node the root of the subtree
+ * \param index the index to insert at
+ * \param lone the node to link, which must have no children
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return tuple: (new subtree root, whether it got taller)
+ * \sa avl_node_insert_at_index
+ * \sa avl_node_insert_walk
+ * \exception std::out_of_range If the requested insertion index is outside the range [0, size of subtree + 1)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Merge, typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool>
+avl_node_link_at_index(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *lone,
+    const _Merge &_merge, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  auto result = avl_node_insert_walk(
+      node, index, static_cast<const _Element &>(lone->element()),
+      [](const node_type *at, _Size at_index) {
+        return at_index <= avl_node_size(at->left());
+      },
+      _merge, _rpre, _rcomb, [&](_Size leaf_index) {
+        // only valid index for empty tree is 0
+        if (leaf_index != _Size(0)) [[unlikely]] {
+          throw std::out_of_range(
+            "AVL tree operation insert at index tried to insert before the"
+            "first valid index or after the last valid index.");
+        }
+        return lone;
+      });
+  return std::make_pair(std::get<0>(result), std::get<1>(result));
+}
+
+//! Link a lone node into the subtree just after all elements that are less than its element, unless it merges.
+/*!
+ * The same as avl_node_insert_ordered, except that the new element is already in a node,
+ * which is linked in as it is.
+ * If the element merges into another element, the node is not linked,
+ * so the size of the subtree stays the same, and the caller still owns the node.
+ *
+ * \param node the root of the subtree
+ * \param lone the node to link, which must have no children
+ * \param _less less than function
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return tuple: (new subtree root, whether it got taller, index of the inserted or merged element)
+ * \sa avl_node_insert_ordered
+ * \sa avl_node_insert_walk
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Compare, typename _Merge, typename _Range_Preprocess,
+          typename _Range_Combine>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool, _Size>
+avl_node_link_ordered(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *lone,
+    const _Compare &_less, const _Merge &_merge, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  const _Element &key = lone->element();
+  return avl_node_insert_walk(
+      node, _Size(0), key,
+      [&](const node_type *at, _Size) { return !_less(at->element(), key); }, _merge,
+      _rpre, _rcomb, [&](_Size) { return lone; });
+}
+
+//! Unlink the node at a specific index from the subtree, without destroying it.
+/*!
+ * Nothing is copied or moved: if the node has two children, its in-order successor
+ * is unlinked from the right subtree and relinked in its place,
+ * rather than moving the successor's element into the node.
+ * The unlinked node keeps its element, and is left with no children,
+ * a balance factor of 0 and a size of 1, but its range intermediate value is not updated.
+ * The caller owns the node afterwards.
+ *
+ * \param node the root of the subtree
+ * \param index the index of the node to unlink
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return tuple: (new subtree root, whether it got shorter, the unlinked node)
+ * \sa avl_node_remove_at_index
+ * \exception std::out_of_range If the requested removal index is outside the range [0, size of subtree)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Range_Preprocess, typename _Range_Combine>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool,
+           avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *>
+avl_node_unlink_at_index(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  if (node == nullptr) [[unlikely]] {
+      throw std::out_of_range(
+          "AVL tree operation remove at index tried to remove from an empty "
+          "subtree. This happens when the index is outside of the range of "
+          "valid indices for this tree.");
+    }
+  _Size left_size = avl_node_size(node->left());
+  if (index == left_size) {
+    // we must unlink this node
+    node_type *replacement;
+    bool shorter;
+    if (node->left() == nullptr || node->right() == nullptr) {
+      // the only child, if there is one, takes its place
+      replacement = node->left() == nullptr ? node->right() : node->left();
+      shorter = true;
+    } else {
+      // the successor takes its place
+      auto partial =
+          avl_node_unlink_at_index(node->right(), _Size(0), _rpre, _rcomb);
+      node_type *successor = std::get<2>(partial);
+      successor->set_left(node->left());
+      successor->set_right(std::get<0>(partial));
+      successor->set_balance(node->balance());
+      auto fixed =
+          successor->rebalance_right_shorter(std::get<1>(partial), _rpre, _rcomb);
+      replacement = fixed.first;
+      shorter = fixed.second;
+    }
+    node->set_left(nullptr);
+    node->set_right(nullptr);
+    node->set_balance(0);
+    node->size = _Size(1);
+    return std::make_tuple(replacement, shorter, node);
+  } else if (index < left_size) {
+    // it's on the left
+    auto partial = avl_node_unlink_at_index(node->left(), index, _rpre, _rcomb);
+    node->set_left(std::get<0>(partial));
+    auto fixed = node->rebalance_left_shorter(std::get<1>(partial), _rpre, _rcomb);
+    return std::make_tuple(fixed.first, fixed.second, std::get<2>(partial));
+  } else {
+    // it's on the right
+    auto partial = avl_node_unlink_at_index(
+        node->right(), index - (left_size + _Size(1)), _rpre, _rcomb);
+    node->set_right(std::get<0>(partial));
+    auto fixed = node->rebalance_right_shorter(std::get<1>(partial), _rpre, _rcomb);
+    return std::make_tuple(fixed.first, fixed.second, std::get<2>(partial));
+  }
+}
+
+//! Move the element out of an unlinked node, then destroy the node and give back its memory.
+/*!
+ * \param node the node, which must not be in a tree
+ * \param _alloc allocator object
+ * \return the element, which is moved exactly once
+ * \sa avl_node_unlink_at_index
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Alloc>
+_Element avl_node_take_element(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    _Alloc &_alloc) {
+  _Element value(std::move(node->element()));
+  std::allocator_traits<_Alloc>::destroy(_alloc, node);
+  std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+  return value;
+}
+
+//! Move every element out of an unlinked subtree, in order, then destroy its nodes and give back their memory.
+/*!
+ * Each node is destroyed right after its element is moved out, so this takes O(N) time
+ * and the subtree is not kept valid along the way.
+ * If the function throws, the nodes not visited yet are destroyed too, and the exception is passed on.
+ *
+ * \param node the root of the subtree, which must not be in a tree, and may be null
+ * \param _function function which takes an rvalue reference to an element
+ * \param _alloc allocator object
+ * \sa avl_node_take_element
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Function, typename _Alloc>
+void avl_node_take_elements(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    const _Function &_function, _Alloc &_alloc) {
+  while (node != nullptr) {
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *right = node->right();
+    try {
+      // on a throw, the left subtree is already gone
+      avl_node_take_elements(node->left(), _function, _alloc);
+      _function(std::move(node->element()));
+    } catch (...) {
+      std::allocator_traits<_Alloc>::destroy(_alloc, node);
+      std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+      avl_node_destroy(right, _alloc);
+      throw;
+    }
+    std::allocator_traits<_Alloc>::destroy(_alloc, node);
+    std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+    // loop instead of recursing on the right
+    node = right;
+  }
+}
+
+//! Remove a node at a specific index in the subtree.
+/*!
+ * Remove an element at a specific index, and return the element that was removed.
+ * The node is unlinked by avl_node_unlink_at_index, so no other element is moved,
+ * and the removed element is moved once, into the returned tuple, so move-only elements work.
+ *
+ * \param node the root of the subtree
+ * \param index the index of the element to remove
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return tuple: (new subtree root, whether it got shorter, the removed element)
+ * \sa avl_tree
+ * \exception std::out_of_range If the requested removal index is outside the range [0, size of subtree)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool,
+           _Element>
+avl_node_remove_at_index(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb,
+    _Alloc &_alloc) {
+  auto unlinked = avl_node_unlink_at_index(node, index, _rpre, _rcomb);
+  auto removed = std::get<2>(unlinked);
+  std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool,
+             _Element>
+      result(std::get<0>(unlinked), std::get<1>(unlinked),
+             std::move(removed->element()));
+  std::allocator_traits<_Alloc>::destroy(_alloc, removed);
+  std::allocator_traits<_Alloc>::deallocate(_alloc, removed, 1);
+  return result;
+}
+
+//! Attempt to remove 1 instance of an element from a sorted subtree.
+/*!
+ * Searches for 1 instance of an element within a sorted (non-decreasing) subtree,
+ * and if it is found, removes it.
+ * Exact equality using the == operator is required.
+ * Note that if the search value is within a contiguous subrange of at least 2
+ * incomparable elements, the search may be unable to locate it.
+ * This is because the search assumes a total ordering, and will not bother
+ * searching in an incomparable subrange.
+ *
+ * If you instead want to find and possibly remove an incomparable element which may
+ * not be exactly equal, try using the search methods instead, which are meant for searching
+ * rather than removing a very specific value.
+ *
+ * The value does not have to be an element, as long as it can be compared with elements
+ * by both the == operator and the less than function.
+ *
+ * One of the return values is the index of the element (before it was removed).
+ * If the remove was successful, that value will be the actual index,
+ * otherwise, it will be the empty optional.
+ *
+ * \param node the root of the subtree
+ * \param value the value to search for and remove
+ * \param _less less than function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return tuple: (new subtree root, whether it got shorter, optional: the index of the removed element)
+ * \sa avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Compare, typename _Range_Preprocess,
+          typename _Range_Combine, typename _Alloc, typename _Key>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool,
+           std::optional<_Size>>
+avl_node_remove_ordered(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    const _Key &value, const _Compare &_less, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  std::optional<_Size> index;
+  // empty node -> do nothing, report nothing to delete
+  if (node == nullptr) {
+    return std::make_tuple(node, false, index);
+  }
+  if (node->element() == value) {
+    index = avl_node_size(node->left());
+    // we must delete this node, and its successor takes its place
+    auto unlinked = avl_node_unlink_at_index(node, *index, _rpre, _rcomb);
+    std::allocator_traits<_Alloc>::destroy(_alloc, node);
+    std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+    return std::make_tuple(std::get<0>(unlinked), std::get<1>(unlinked), index);
+  } else if (_less(value, node->element())) {
+    // it's on the left
+    auto partial = avl_node_remove_ordered(node->left(), value, _less, _rpre,
+                                           _rcomb, _alloc);
+    node->set_left(std::get<0>(partial));
+    bool shorter = std::get<1>(partial);
+    index = std::get<2>(partial);
+    if (!index) {
+      // remove did nothing
+      return std::make_tuple(node, false, index);
+    }
+    auto fixed = node->rebalance_left_shorter(shorter, _rpre, _rcomb);
+    return std::make_tuple(fixed.first, fixed.second, index);
+  } else {
+    // it's on the right
+    auto partial = avl_node_remove_ordered(node->right(), value, _less, _rpre,
+                                           _rcomb, _alloc);
+    node->set_right(std::get<0>(partial));
+    bool shorter = std::get<1>(partial);
+    index = std::get<2>(partial);
+    if (!index) {
+      // remove did nothing
+      return std::make_tuple(node, false, index);
+    }
+    index = avl_node_size(node->left()) + _Size(1) + index.value();
+    auto fixed = node->rebalance_right_shorter(shorter, _rpre, _rcomb);
+    return std::make_tuple(fixed.first, fixed.second, index);
+  }
+}
+
+//! Overwrite the element at a specific index in the subtree, merging into an ancestor if possible.
+/*!
+ * The recursive part of avl_node_replace_at_index.
+ * On the way down to the index, tries to merge the new element into each node passed.
+ * If a merge succeeds, the element at the index is removed instead.
+ * Otherwise, the new element is moved, if it is an rvalue, over the element at the index in place.
+ * Either way, the old element is moved out once, into old_value.
+ * Assumes the index is valid.
+ *
+ * \param node the root of the subtree
+ * \param index the index to replace at
+ * \param new_value the new value for that index
+ * \param old_value empty optional, which the old element is put in
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return tuple: (new subtree root, whether it got shorter, whether a merge occurred)
+ * \sa avl_node_replace_at_index
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Merge, typename _Range_Preprocess,
+          typename _Range_Combine, typename _Alloc, typename _Value>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool, bool>
+avl_node_overwrite_at_index(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    _Value &&new_value, std::optional<_Element> &old_value, const _Merge &_merge,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  _Size left_size = avl_node_size(node->left());
+  if (index == left_size) {
+    // overwrite this node
+    old_value.emplace(std::move(node->element()));
+    node->element() = std::forward<_Value>(new_value);
+    node->update(_rpre, _rcomb);
+    return std::make_tuple(node, false, false);
+  }
+  bool merged = _merge(node->element(), new_value);
+  if (index < left_size) {
+    // it's on the left
+    bool shorter;
+    if (merged) {
+      auto partial = avl_node_unlink_at_index(node->left(), index, _rpre, _rcomb);
+      node->set_left(std::get<0>(partial));
+      shorter = std::get<1>(partial);
+      auto removed = std::get<2>(partial);
+      old_value.emplace(std::move(removed->element()));
+      std::allocator_traits<_Alloc>::destroy(_alloc, removed);
+      std::allocator_traits<_Alloc>::deallocate(_alloc, removed, 1);
+    } else {
+      auto partial = avl_node_overwrite_at_index(
+          node->left(), index, std::forward<_Value>(new_value), old_value,
+          _merge, _rpre, _rcomb, _alloc);
+      node->set_left(std::get<0>(partial));
+      shorter = std::get<1>(partial);
+      merged = std::get<2>(partial);
+    }
+    auto fixed = node->rebalance_left_shorter(shorter, _rpre, _rcomb);
+    return std::make_tuple(fixed.first, fixed.second, merged);
+  } else {
+    // it's on the right
+    bool shorter;
+    if (merged) {
+      auto partial = avl_node_unlink_at_index(
+          node->right(), index - (left_size + _Size(1)), _rpre, _rcomb);
+      node->set_right(std::get<0>(partial));
+      shorter = std::get<1>(partial);
+      auto removed = std::get<2>(partial);
+      old_value.emplace(std::move(removed->element()));
+      std::allocator_traits<_Alloc>::destroy(_alloc, removed);
+      std::allocator_traits<_Alloc>::deallocate(_alloc, removed, 1);
+    } else {
+      auto partial = avl_node_overwrite_at_index(
+          node->right(), index - (left_size + _Size(1)),
+          std::forward<_Value>(new_value), old_value, _merge, _rpre, _rcomb,
+          _alloc);
+      node->set_right(std::get<0>(partial));
+      shorter = std::get<1>(partial);
+      merged = std::get<2>(partial);
+    }
+    auto fixed = node->rebalance_right_shorter(shorter, _rpre, _rcomb);
+    return std::make_tuple(fixed.first, fixed.second, merged);
+  }
+}
+
+//! Replace the element at the specified index in the subtree.
+/*!
+ * Replaces the element at the specified index, in a single pass down the tree
+ * and without allocating.
+ * Like an insert, the new element may be merged into another element on the way down,
+ * in which case the element at the index is removed instead.
+ * Otherwise, the new element overwrites the old element in place.
+ *
+ * The size of the subtree stays the same, unless a merge occurs, in which case
+ * the size of the subtree decreases by 1.
+ *
+ * The new element is moved in if it is an rvalue, and the old element is moved out,
+ * so neither is copied, and move-only elements work.
+ *
+ * \param node the root of the subtree
+ * \param index the index to replace at
+ * \param new_value the new value to insert at that index
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return tuple: (new subtree root, whether it got smaller, the old element)
+ * \sa avl_tree
+ * \exception std::out_of_range If the requested insertion index is outside the range [0, size of subtree)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
+          typename _Alloc, typename _Value>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool,
+           _Element>
+avl_node_replace_at_index(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    _Value &&new_value, const _Merge &_merge, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  if constexpr (!std::is_same<typename std::decay<_Value>::type, _Element>::value) {
+    // convert once, rather than at every level
+    return avl_node_replace_at_index(node, index, _Element(std::forward<_Value>(new_value)),
+                                     _merge, _rpre, _rcomb, _alloc);
+  } else {
+    if (!(index < avl_node_size(node))) [[unlikely]] {
+      throw std::out_of_range(
+          "AVL tree operation replace at index tried to replace outside of the "
+          "range of valid indices for this tree.");
+    }
+    std::optional<_Element> old_value;
+    auto result = avl_node_overwrite_at_index(node, index, std::forward<_Value>(new_value),
+                                              old_value, _merge, _rpre, _rcomb, _alloc);
+    return std::make_tuple(std::get<0>(result), std::get<2>(result),
+                           std::move(*old_value));
+  }
+}
+
+/**
+ * If the requested old value exists in the tree, replace it by the
+ * new value, otherwise, do nothing.
+ * The re-insertion may cause a merge, in which case the tree size decreasees by 1.
+ * Return tuple is (new subtree root, whether a replacement was made,
+ * whether the merge was successful).
+ */
+//! Make a single replacement in the subtree if the value exists, otherwise do nothing.
+/**
+ * Search for the old element within the subtree, assuming sorted order,
+ * and remove it if it exists. If the removal was successful, then inserts the new element
+ * in the subtree according to the order. The removal index and insertion index are not necessarily the same.
+ * The node freed by the removal is reused for the insertion, so no allocation happens.
+ * Size of the subtree remains the same, unless replacement occurs and merge occurs.
+ *
+ * One of the return values is an optional tuple of the removal index and the insertion index.
+ * It exists if the replacement is successful.
+ * Note that if the insertion index is less than or equal to the removal index and no merge occurs,
+ * the actual location where the removal occured is shifted to the right by 1.
+ * This function includes correction for this shifting, and reports this actual location, instead of
+ * where in the original subtree the removal occurred.
+ *
+ * \param node the root of the subtree
+ * \param old_value the old value to search for and replace
+ * \param new_value the new value to insert at that index
+ * \param _less less than function
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return tuple: (new subtree root, whether it got smaller, optional: (removal index, insertion index))
+ * \sa avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Compare, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine,
+          typename _Alloc, typename _Value, typename _Key>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, bool, std::optional<std::pair<_Size,_Size>>>
+avl_node_replace_ordered(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, const _Key &old_value,
+    _Value &&new_value, const _Compare &_less,
+    const _Merge &_merge, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb, _Alloc &_alloc) {
+    // the removed node is kept and reused for the insert
+    node_recycler<_Alloc> recycler(_alloc);
+    auto old_size = avl_node_size(node);
+    auto remove_result = avl_node_remove_ordered(node, old_value, _less, _rpre, _rcomb, recycler);
+    std::optional<_Size> remove_index = std::get<2>(remove_result);
+    std::optional<std::pair<_Size,_Size>> index_result;
+    // if remove failed, do nothing
+    if(!remove_index){
+      return std::make_tuple(node, false, index_result);
+    }
+    node = std::get<0>(remove_result);
+    auto insert_result = avl_node_insert_ordered(node, std::forward<_Value>(new_value), _less, _merge, _rpre, _rcomb, recycler);
+    node = std::get<0>(insert_result);
+    auto new_size = avl_node_size(node);
+    bool did_merge = old_size != new_size;
+    _Size corrected_remove_index = *remove_index;
+    _Size insert_index = std::get<2>(insert_result);
+    corrected_remove_index += _Size(insert_index <= corrected_remove_index && !did_merge);
+    index_result = std::make_pair(corrected_remove_index, insert_index);
+    return std::make_tuple(node, did_merge, index_result);
+}
+
+//! Get the height of the subtree.
+/*!
+ * Follows the taller child at each level, as told by the balance factors,
+ * so it takes O(log N) time.
+ *
+ * \param node the root of the subtree, which may be null
+ * \return the height, which is 0 for an empty subtree and 1 for a single node
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+int avl_node_height(
+    const avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node) {
+  int height = 0;
+  while (node != nullptr) {
+    ++height;
+    node = node->balance() < 0 ? node->left() : node->right();
+  }
+  return height;
+}
+
+//! Join 2 subtrees of known heights with a node in between, so that their elements are in order.
+/*!
+ * Makes a tree with the elements of the left subtree, then the pivot, then the right subtree.
+ * Walks down the inner spine of the taller subtree until it reaches a subtree
+ * of about the same height as the shorter one, puts the pivot there with the 2 of them as its children,
+ * then rebalances on the way back up, the same way as after an insert,
+ * fixing the sizes and range intermediate values along the spine.
+ * Takes O(|difference in height| + 1) time.
+ * No nodes are allocated, copied or moved, and merges are not tried.
+ *
+ * \param left the root of the left subtree, which may be null
+ * \param left_height the height of the left subtree
+ * \param pivot the node to put between them, whose old links are ignored
+ * \param right the root of the right subtree, which may be null
+ * \param right_height the height of the right subtree
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return the root of the joined tree, and its height
+ * \sa avl_node_join
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, int>
+avl_node_join_with_heights(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *left, int left_height,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *pivot,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *right, int right_height,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  // where the heights are close enough, the pivot becomes the parent of both
+  auto make_parent = [&](node_type *low, int low_height, node_type *high,
+                         int high_height) {
+    pivot->set_left(low);
+    pivot->set_right(high);
+    pivot->set_balance(char(high_height - low_height));
+    pivot->update(_rpre, _rcomb);
+    return std::make_pair(pivot, std::max(low_height, high_height) + 1);
+  };
+  // returns the new root and its height
+  auto join_right = [&](auto &self, node_type *node,
+                        int height) -> std::pair<node_type *, int> {
+    if (height <= right_height + 1) {
+      return make_parent(node, height, right, right_height);
+    }
+    int child_left_height = height - 1 - (node->balance() > 0);
+    int child_right_height = height - 1 - (node->balance() < 0);
+    auto partial = self(self, node->right(), child_right_height);
+    node->set_right(partial.first);
+    int balance = partial.second - child_left_height;
+    if (balance <= 1) {
+      node->set_balance(char(balance));
+      node->update(_rpre, _rcomb);
+      return std::make_pair(node, std::max(child_left_height, partial.second) + 1);
+    }
+    node->set_balance(2);
+    node_type *root = node->rebalance_right_heavy(_rpre, _rcomb);
+    // only unbalanced if the right child was balanced, in which case it did not get shorter
+    return std::make_pair(root, child_left_height + 2 + (root->balance() != 0));
+  };
+  auto join_left = [&](auto &self, node_type *node,
+                       int height) -> std::pair<node_type *, int> {
+    if (height <= left_height + 1) {
+      return make_parent(left, left_height, node, height);
+    }
+    int child_left_height = height - 1 - (node->balance() > 0);
+    int child_right_height = height - 1 - (node->balance() < 0);
+    auto partial = self(self, node->left(), child_left_height);
+    node->set_left(partial.first);
+    int balance = child_right_height - partial.second;
+    if (balance >= -1) {
+      node->set_balance(char(balance));
+      node->update(_rpre, _rcomb);
+      return std::make_pair(node, std::max(child_right_height, partial.second) + 1);
+    }
+    node->set_balance(-2);
+    node_type *root = node->rebalance_left_heavy(_rpre, _rcomb);
+    return std::make_pair(root, child_right_height + 2 + (root->balance() != 0));
+  };
+  if (left_height >= right_height) {
+    return join_right(join_right, left, left_height);
+  }
+  return join_left(join_left, right, right_height);
+}
+
+//! Join 2 subtrees with a node in between, so that their elements are in order.
+/*!
+ * Makes a tree with the elements of the left subtree, then the pivot, then the right subtree.
+ * Takes O(log N) time to find the heights, and O(|difference in height| + 1) for the rest.
+ * No nodes are allocated, copied or moved, and merges are not tried.
+ *
+ * \param left the root of the left subtree, which may be null
+ * \param pivot the node to put between them, whose old links are ignored
+ * \param right the root of the right subtree, which may be null
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return the root of the joined tree
+ * \sa avl_node_join_with_heights
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *avl_node_join(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *left,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *pivot,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *right,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  return avl_node_join_with_heights(left, avl_node_height(left), pivot, right,
+                                    avl_node_height(right), _rpre, _rcomb)
+      .first;
+}
+
+//! Join 2 subtrees, so that their elements are in order.
+/*!
+ * Makes a tree with the elements of the left subtree, then the right subtree.
+ * The last node of the left subtree is unlinked and used as the pivot for avl_node_join.
+ * Takes O(log N) time.
+ * No nodes are allocated, copied or moved, and merges are not tried.
+ *
+ * \param left the root of the left subtree, which may be null
+ * \param right the root of the right subtree, which may be null
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return the root of the joined tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *avl_node_join(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *left,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *right,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  if (left == nullptr) return right;
+  if (right == nullptr) return left;
+  auto unlinked = avl_node_unlink_at_index(left, avl_node_size(left) - _Size(1),
+                                           _rpre, _rcomb);
+  return avl_node_join(std::get<0>(unlinked), std::get<2>(unlinked), right,
+                       _rpre, _rcomb);
+}
+
+//! Split a subtree of known height into the elements before an index and the elements from that index on.
+/*!
+ * Walks down to the index, and on the way back up joins each node on the path
+ * with the subtree on its far side and the part of the split below it which belongs on that side.
+ * The heights of the subtrees are known from the walk down, and the joins along the way
+ * take O(log N) time all together, so the split takes O(log N) time.
+ * The original nodes are reused, with their sizes and range intermediate values updated,
+ * and no nodes are allocated, copied or moved.
+ *
+ * \param node the root of the subtree, which may be null
+ * \param height the height of the subtree
+ * \param index the index to split at, in range [0, size of subtree]
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return tuple: (root of the subtree of the elements before the index, its height,
+ * root of the subtree of the rest, its height), where either root may be null
+ * \sa avl_node_split_at_index
+ * \sa avl_node_join_with_heights
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Range_Preprocess, typename _Range_Combine>
+std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, int,
+           avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, int>
+avl_node_split_with_heights(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, int height,
+    _Size index, const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  node_type *none = nullptr;
+  // nothing to join at the ends
+  if (index == _Size(0)) return std::make_tuple(none, 0, node, height);
+  if (index == avl_node_size(node)) return std::make_tuple(node, height, none, 0);
+  node_type *left = node->left();
+  node_type *right = node->right();
+  int left_height = height - 1 - (node->balance() > 0);
+  int right_height = height - 1 - (node->balance() < 0);
+  _Size left_size = avl_node_size(left);
+  if (index <= left_size) {
+    auto parts = avl_node_split_with_heights(left, left_height, index, _rpre, _rcomb);
+    auto joined = avl_node_join_with_heights(std::get<2>(parts), std::get<3>(parts),
+                                             node, right, right_height, _rpre, _rcomb);
+    return std::make_tuple(std::get<0>(parts), std::get<1>(parts), joined.first,
+                           joined.second);
+  }
+  auto parts = avl_node_split_with_heights(right, right_height,
+                                           _Size(index - left_size - _Size(1)), _rpre, _rcomb);
+  auto joined = avl_node_join_with_heights(left, left_height, node, std::get<0>(parts),
+                                           std::get<1>(parts), _rpre, _rcomb);
+  return std::make_tuple(joined.first, joined.second, std::get<2>(parts),
+                         std::get<3>(parts));
+}
+
+//! Split a subtree into the elements before an index and the elements from that index on.
+/*!
+ * Takes O(log N) time, and reuses the original nodes, with no nodes allocated, copied or moved.
+ *
+ * \param node the root of the subtree, which may be null
+ * \param index the index to split at, which may be the size of the subtree
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return the roots of the subtree of the elements before the index, and of the rest, either of which may be null
+ * \exception std::out_of_range If the index is more than the size of the subtree, in which case nothing is changed
+ * \sa avl_node_split_with_heights
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *,
+          avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *>
+avl_node_split_at_index(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
+  if (avl_node_size(node) < index) [[unlikely]] {
+    throw std::out_of_range(
+        "AVL tree operation split at index tried to split outside of the "
+        "range of valid indices for this tree.");
+  }
+  auto parts = avl_node_split_with_heights(node, avl_node_height(node), index, _rpre, _rcomb);
+  return std::make_pair(std::get<0>(parts), std::get<2>(parts));
+}
+
+//! Combine 2 sorted subtrees of known heights with a set operation, reusing their nodes.
+/*!
+ * Assumes both subtrees are sorted.
+ * Takes the root of the second subtree, splits the first subtree into the elements
+ * less than, equivalent to, and greater than it, combines the less and greater parts
+ * with the left and right subtrees of the root recursively, and joins the results,
+ * with the root and the equivalent elements in between if the operation keeps them.
+ * The heights of all the parts are kept track of, so every join takes O(|difference in height| + 1).
+ * This takes O(M log(N / M + 1)) time for subtrees of sizes M <= N,
+ * instead of O(M + N) for merging them in order, or O(M log N) for one at a time.
+ *
+ * Elements of the second subtree which are equivalent to elements of the first subtree
+ * are tried as merges into the last of those, for union and intersection.
+ * A union keeps them after those elements if the merge fails, and an intersection always discards them.
+ * A difference drops every element of the first subtree which is equivalent to an element of the second,
+ * and a symmetric difference drops every element of either subtree which is equivalent to an element
+ * of the other, however many of them there are on either side, so it does not depend on the order.
+ * Otherwise the operations are meant for subtrees which do not have equivalent elements in them, such as sets;
+ * with them, the result is still sorted, but which equivalent elements are matched with which is unspecified.
+ *
+ * The 2 recursive combines are independent, and where they have enough elements between them
+ * and there are threads to spare, the left one is done on a new thread.
+ * Each thread gets half the threads left to use, so no more than the given number run at once.
+ * The less than, merge and range functions are then called from several threads at once,
+ * so they must be safe to call that way, and none of them should throw.
+ * If the less than or merge function does anyway, the exception is passed on once the thread
+ * started here has finished, even if it was thrown on that thread, and every node of both subtrees
+ * is then on the list of dropped nodes, so the caller can still destroy them all.
+ * No nodes are allocated or deallocated, so the allocator is only used by the calling thread.
+ * If a thread can not be started, its work is done on the current thread instead.
+ *
+ * Nodes which are not in the result are put on a list, linked by their left links,
+ * for the caller to destroy and deallocate.
+ *
+ * \param first the root of the first subtree, which may be null
+ * \param first_height the height of the first subtree
+ * \param second the root of the second subtree, which may be null
+ * \param second_height the height of the second subtree
+ * \param operation the set operation to do
+ * \param _less less than function
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param threads the most threads to use, including the current thread
+ * \param dropped the head of the list of nodes not in the result, which nodes are added to the front of
+ * \return the root of the result, and its height
+ * \sa avl_node_set_operation
+ * \sa avl_node_split_with_heights
+ * \sa avl_node_join_with_heights
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Compare, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine>
+std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *, int>
+avl_node_set_operation_with_heights(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *first, int first_height,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *second, int second_height,
+    set_operation operation, const _Compare &_less, const _Merge &_merge,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb, unsigned threads,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *&dropped) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  typedef std::pair<node_type *, int> part_type;
+  // fewer elements than this are not worth starting a thread for
+  constexpr std::size_t fork_cutoff = std::size_t(1) << 14;
+  auto drop = [&](node_type *node) {
+    node->set_left(dropped);
+    dropped = node;
+  };
+  auto drop_all = [&](auto &self, node_type *node) -> void {
+    while (node != nullptr) {
+      node_type *right = node->right();
+      self(self, node->left());
+      drop(node);
+      node = right;
+    }
+  };
+  // joins without a node in between, by unlinking the last node on the left
+  auto join = [&](part_type left, part_type right) -> part_type {
+    if (left.first == nullptr) return right;
+    if (right.first == nullptr) return left;
+    auto unlinked = avl_node_unlink_at_index(
+        left.first, _Size(avl_node_size(left.first) - _Size(1)), _rpre, _rcomb);
+    return avl_node_join_with_heights(std::get<0>(unlinked), left.second - std::get<1>(unlinked),
+                                      std::get<2>(unlinked), right.first, right.second,
+                                      _rpre, _rcomb);
+  };
+  if (second == nullptr) {
+    if (operation != set_operation::set_intersection) return part_type(first, first_height);
+    drop_all(drop_all, first);
+    return part_type(nullptr, 0);
+  }
+  if (first == nullptr) {
+    if (operation == set_operation::set_union ||
+        operation == set_operation::set_symmetric_difference) {
+      return part_type(second, second_height);
+    }
+    drop_all(drop_all, second);
+    return part_type(nullptr, 0);
+  }
+  std::size_t total = std::size_t(avl_node_size(first)) + std::size_t(avl_node_size(second));
+  node_type *pivot = second;
+  part_type second_left(pivot->left(), second_height - 1 - (pivot->balance() > 0));
+  part_type second_right(pivot->right(), second_height - 1 - (pivot->balance() < 0));
+  // the pieces this call holds, each of which is null once it has been passed on or put back together
+  part_type below, equal, above, left, right;
+  std::thread worker;
+  node_type *worker_dropped = nullptr;
+  std::exception_ptr worker_error;
+  auto take = [](part_type &part) { return std::exchange(part, part_type(nullptr, 0)); };
+  auto take_worker_dropped = [&] {
+    if (worker_dropped == nullptr) return;
+    node_type *last = worker_dropped;
+    while (last->left() != nullptr) last = last->left();
+    last->set_left(dropped);
+    dropped = std::exchange(worker_dropped, nullptr);
+  };
+  auto combine_parts = [&](part_type first_part, part_type second_part, unsigned part_threads,
+                           node_type *&part_dropped) {
+    return avl_node_set_operation_with_heights(
+        first_part.first, first_part.second, second_part.first, second_part.second, operation,
+        _less, _merge, _rpre, _rcomb, part_threads, part_dropped);
+  };
+  auto merge_into_equal = [&] {
+    bool merged = false;
+    avl_node_modify_at_index(
+        equal.first, _Size(avl_node_size(equal.first) - _Size(1)),
+        [&](_Element &target) { merged = _merge(target, pivot->element()); }, _rpre,
+        _rcomb);
+    return merged;
+  };
+  bool merged = false;
+  try {
+    auto lower = avl_node_lower_bound(static_cast<const node_type *>(first),
+                                      pivot->element(), _less);
+    _Size upper = lower.second ? avl_node_upper_bound(static_cast<const node_type *>(first),
+                                                      pivot->element(), _less)
+                               : lower.first;
+    auto below_parts =
+        avl_node_split_with_heights(first, first_height, lower.first, _rpre, _rcomb);
+    auto above_parts = avl_node_split_with_heights(std::get<2>(below_parts),
+                                                   std::get<3>(below_parts),
+                                                   _Size(upper - lower.first), _rpre, _rcomb);
+    first = nullptr;
+    below = part_type(std::get<0>(below_parts), std::get<1>(below_parts));
+    equal = part_type(std::get<0>(above_parts), std::get<1>(above_parts));
+    above = part_type(std::get<2>(above_parts), std::get<3>(above_parts));
+    if (operation == set_operation::set_symmetric_difference && equal.first != nullptr) {
+      // the pivot's equivalents in the second subtree are in both, so they are dropped too,
+      // as the parts of the first subtree they would be combined with have none
+      auto left_lower = avl_node_lower_bound(static_cast<const node_type *>(second_left.first),
+                                             pivot->element(), _less);
+      auto left_parts = avl_node_split_with_heights(second_left.first, second_left.second,
+                                                    left_lower.first, _rpre, _rcomb);
+      second_left = part_type(std::get<0>(left_parts), std::get<1>(left_parts));
+      drop_all(drop_all, std::get<2>(left_parts));
+      _Size right_upper = avl_node_upper_bound(
+          static_cast<const node_type *>(second_right.first), pivot->element(), _less);
+      auto right_parts = avl_node_split_with_heights(second_right.first, second_right.second,
+                                                     right_upper, _rpre, _rcomb);
+      drop_all(drop_all, std::get<0>(right_parts));
+      second_right = part_type(std::get<2>(right_parts), std::get<3>(right_parts));
+    }
+    if (threads > 1 && total >= fork_cutoff) {
+      try {
+        worker = std::thread([&, worker_threads = threads / 2, worker_first = below,
+                              worker_second = second_left] {
+          try {
+            left = combine_parts(worker_first, worker_second, worker_threads, worker_dropped);
+          } catch (...) {
+            // passed on after the join, instead of ending the program
+            worker_error = std::current_exception();
+          }
+        });
+        // the worker has its own copies of these now
+        take(below);
+        take(second_left);
+        threads -= threads / 2;
+      } catch (const std::system_error &) {
+        // do both here
+      }
+    }
+    if (!worker.joinable()) left = combine_parts(take(below), take(second_left), threads, dropped);
+    right = combine_parts(take(above), take(second_right), threads, dropped);
+    if (worker.joinable()) {
+      worker.join();
+      take_worker_dropped();
+      if (worker_error != nullptr) std::rethrow_exception(worker_error);
+    }
+    if (equal.first != nullptr && (operation == set_operation::set_union ||
+                                   operation == set_operation::set_intersection)) {
+      merged = merge_into_equal();
+    }
+  } catch (...) {
+    // the worker still uses this frame, and destroying it unjoined would end the program
+    if (worker.joinable()) worker.join();
+    take_worker_dropped();
+    // a recursive combine which threw has already dropped its own pieces,
+    // so dropping the rest keeps every node of both subtrees on the list
+    for (node_type *piece : {first, below.first, equal.first, above.first, second_left.first,
+                             second_right.first, left.first, right.first}) {
+      drop_all(drop_all, piece);
+    }
+    drop(pivot);
+    throw;
+  }
+  switch (operation) {
+    case set_operation::set_union:
+      left = join(left, equal);
+      if (merged) break;
+      return avl_node_join_with_heights(left.first, left.second, pivot, right.first,
+                                        right.second, _rpre, _rcomb);
+    case set_operation::set_intersection:
+      left = join(left, equal);
+      break;
+    case set_operation::set_difference:
+      drop_all(drop_all, equal.first);
+      break;
+    case set_operation::set_symmetric_difference:
+      if (equal.first == nullptr) {
+        return avl_node_join_with_heights(left.first, left.second, pivot, right.first,
+                                          right.second, _rpre, _rcomb);
+      }
+      drop_all(drop_all, equal.first);
+      break;
+  }
+  drop(pivot);
+  return join(left, right);
+}
+
+//! Combine 2 sorted subtrees with a set operation, reusing their nodes.
+/*!
+ * Finds the heights of the subtrees in O(log N) time,
+ * and then does the same as avl_node_set_operation_with_heights.
+ *
+ * \param first the root of the first subtree, which may be null
+ * \param second the root of the second subtree, which may be null
+ * \param operation the set operation to do
+ * \param _less less than function
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param threads the most threads to use, including the current thread
+ * \param dropped the head of the list of nodes not in the result, which nodes are added to the front of
+ * \return the root of the result
+ * \sa avl_node_set_operation_with_heights
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Compare, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *avl_node_set_operation(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *first,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *second,
+    set_operation operation, const _Compare &_less, const _Merge &_merge,
+    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb, unsigned threads,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *&dropped) {
+  return avl_node_set_operation_with_heights(first, avl_node_height(first), second,
+                                             avl_node_height(second), operation, _less,
+                                             _merge, _rpre, _rcomb, threads, dropped)
+      .first;
+}
+
+//! Destroy and deallocate a list of nodes linked by their left links.
+/*!
+ * \param node the head of the list, which may be null
+ * \param _alloc allocator object
+ * \sa avl_node_set_operation
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Alloc>
+void avl_node_destroy_list(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Alloc &_alloc) {
+  while (node != nullptr) {
+    auto next = node->left();
+    std::allocator_traits<_Alloc>::destroy(_alloc, node);
+    std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+    node = next;
+  }
+}
+
+//! Merge the nodes of a sorted subtree and a sorted chain of nodes in order, and rebuild them into 1 perfectly balanced subtree.
+/*!
+ * Assumes the subtree and the chain are sorted.
+ * Elements of the chain which are equivalent to an element of the subtree
+ * are tried as merges into it, and otherwise go after it.
+ * The subtree is flattened into a chain, the 2 chains are merged like sorted lists,
+ * and the result is relinked with avl_node_relink, so it takes O(M + N) time.
+ * The nodes are reused, and nodes whose elements merged are destroyed and deallocated.
+ * The less than and merge functions must not throw.
+ *
+ * \param node the root of the subtree, which may be null
+ * \param chain the first node of the chain, linked through the right links and ending with a null link
+ * \param _less less than function
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return the root of the merged subtree
+ * \sa avl_node_insert_sorted_batch
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Compare, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *avl_node_merge_rebuild(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *chain,
+    const _Compare &_less, const _Merge &_merge, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  // flatten a subtree into a chain through the right links, in order, in front of the rest
+  auto flatten = [](auto &self, node_type *subtree, node_type *rest) -> node_type * {
+    while (subtree != nullptr) {
+      node_type *left = subtree->left();
+      subtree->set_right(self(self, subtree->right(), rest));
+      rest = subtree;
+      subtree = left;
+    }
+    return rest;
+  };
+  node_type *existing = flatten(flatten, node, nullptr);
+  node_type *head = nullptr;
+  node_type *tail = nullptr;
+  _Size count = _Size(0);
+  auto append = [&](node_type *next) {
+    if (tail == nullptr) {
+      head = next;
+    } else {
+      tail->set_right(next);
+    }
+    tail = next;
+    ++count;
+  };
+  while (chain != nullptr) {
+    if (existing != nullptr && !_less(chain->element(), existing->element())) {
+      node_type *next = existing;
+      existing = next->right();
+      append(next);
+      continue;
+    }
+    node_type *next = chain;
+    chain = next->right();
+    // the last node taken is not greater, so if it is not less, it is equivalent
+    if (tail != nullptr && !_less(tail->element(), next->element()) &&
+        _merge(tail->element(), next->element())) {
+      std::allocator_traits<_Alloc>::destroy(_alloc, next);
+      std::allocator_traits<_Alloc>::deallocate(_alloc, next, 1);
+      continue;
+    }
+    append(next);
+  }
+  // the rest of the subtree's chain stays linked as it is
+  for (; existing != nullptr; existing = existing->right()) append(existing);
+  return avl_node_relink(head, count, _rpre, _rcomb);
+}
+
+//! Insert the nodes of a sorted subtree into another sorted subtree.
+/*!
+ * Assumes both subtrees are sorted.
+ * Walks down the subtree, splitting the sorted nodes to insert between the left and right
+ * subtree of each node by binary search, and joins each node with its new left and right subtrees
+ * on the way back up with avl_node_join_with_heights, so only the paths to where nodes are inserted
+ * are visited and changed, and subtrees with nothing to insert are left as they are.
+ * Where a subtree would get many nodes compared to its size, merging and rebuilding it
+ * with avl_node_merge_rebuild is cheaper, which is done instead,
+ * and where a subtree gets just 1 node, it is linked in the way a plain insert would,
+ * which saves the splitting and joining at each level below.
+ * This takes O(M log(N / M + 1)) time, and O(M + N) at most.
+ *
+ * Inserted elements which are equivalent to an element of the subtree
+ * are tried as merges into it, and otherwise go after it.
+ * The nodes are reused, and nodes whose elements merged are destroyed and deallocated.
+ * Nothing is allocated, as the caller reserves room for the batch's nodes beforehand.
+ * The less than and merge functions must not throw,
+ * as the nodes are then partly inserted and can not be told apart from the rest.
+ *
+ * \param node the root of the subtree, which may be null
+ * \param batch the root of the subtree of nodes to insert, which may be null
+ * \param nodes an empty vector with capacity for every node of the batch, which is used to put them in order
+ * \param _less less than function
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return the root of the subtree with the nodes inserted
+ * \sa avl_node_build_merged
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Compare, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *avl_node_insert_sorted_batch(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *batch,
+    std::vector<avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *> &nodes,
+    const _Compare &_less, const _Merge &_merge, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  typedef typename std::vector<node_type *>::iterator iterator;
+  auto collect = [&](auto &self, node_type *subtree) -> void {
+    while (subtree != nullptr) {
+      self(self, subtree->left());
+      nodes.push_back(subtree);
+      subtree = subtree->right();
+    }
+  };
+  collect(collect, batch);
+  // a perfectly balanced subtree of this many nodes has this height
+  auto balanced_height = [](std::size_t count) {
+    int height = 0;
+    for (; count != 0; count >>= 1) ++height;
+    return height;
+  };
+  auto chain = [](iterator first, iterator last) {
+    for (iterator it = first; it != last; ++it) {
+      (*it)->set_right(it + 1 != last ? *(it + 1) : nullptr);
+    }
+    return *first;
+  };
+  // a lone node is linked after its equivalents, as a plain insert does,
+  // without the splitting and joining at every level, and only merges into its equivalents
+  auto merge_equivalent = [&](_Element &target, const _Element &source) {
+    return !_less(target, source) && !_less(source, target) && _merge(target, source);
+  };
+  auto insert = [&](auto &self, node_type *subtree, int height, iterator first,
+                    iterator last) -> std::pair<node_type *, int> {
+    if (first == last) return std::make_pair(subtree, height);
+    std::size_t count = std::size_t(last - first);
+    if (subtree == nullptr) {
+      node_type *next = chain(first, last);
+      return std::make_pair(avl_node_relink(next, _Size(count), _rpre, _rcomb),
+                            balanced_height(count));
+    }
+    if (count == 1) {
+      node_type *lone = chain(first, last);
+      lone = avl_node_relink(lone, _Size(1), _rpre, _rcomb);
+      const _Element &lone_key = lone->element();
+      bool linked = false;
+      auto result = avl_node_insert_walk(
+          subtree, _Size(0), lone_key,
+          [&](const node_type *at, _Size) { return _less(lone_key, at->element()); },
+          merge_equivalent, _rpre, _rcomb, [&](_Size) {
+            linked = true;
+            return lone;
+          });
+      if (!linked) {
+        std::allocator_traits<_Alloc>::destroy(_alloc, lone);
+        std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+      }
+      return std::make_pair(std::get<0>(result), height + int(std::get<1>(result)));
+    }
+    // each step down costs several times as much as a step of the merge
+    constexpr double descend_cost = 4.0;
+    double size = double(avl_node_size(subtree));
+    if (descend_cost * double(count) * std::log2(size / double(count) + 1.0) >=
+        size + double(count)) {
+      node_type *merged = avl_node_merge_rebuild(subtree, chain(first, last), _less,
+                                                 _merge, _rpre, _rcomb, _alloc);
+      return std::make_pair(merged, balanced_height(std::size_t(avl_node_size(merged))));
+    }
+    const _Element &key = subtree->element();
+    iterator equal_first = std::partition_point(
+        first, last, [&](node_type *next) { return _less(next->element(), key); });
+    iterator equal_last = std::partition_point(
+        equal_first, last, [&](node_type *next) { return !_less(key, next->element()); });
+    // try merging the equivalent ones into this node, and move the rest next to the greater ones
+    iterator kept = equal_first;
+    for (iterator it = equal_first; it != equal_last; ++it) {
+      if (_merge(subtree->element(), (*it)->element())) {
+        std::allocator_traits<_Alloc>::destroy(_alloc, *it);
+        std::allocator_traits<_Alloc>::deallocate(_alloc, *it, 1);
+      } else {
+        *kept++ = *it;
+      }
+    }
+    iterator greater_first = std::move_backward(equal_first, kept, equal_last);
+    int left_height = height - 1 - (subtree->balance() > 0);
+    int right_height = height - 1 - (subtree->balance() < 0);
+    auto left = self(self, subtree->left(), left_height, first, equal_first);
+    auto right = self(self, subtree->right(), right_height, greater_first, last);
+    return avl_node_join_with_heights(left.first, left.second, subtree, right.first,
+                                      right.second, _rpre, _rcomb);
+  };
+  return insert(insert, node, avl_node_height(node), nodes.begin(), nodes.end()).first;
+}
+
+//! Get the combined range intermediate value over an index range in the subtree.
+/*!
+ * Combines the range intermediate values of all elements with indices in [begin, end),
+ * left to right, using the stored values for whole subtrees where possible.
+ * The range must not be empty, as there is no general identity value to return.
+ *
+ * \param node the root of the subtree
+ * \param begin the first index in the range
+ * \param end one past the last index in the range
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return the range intermediate value for that range
+ * \sa avl_tree
+ * \exception std::out_of_range If the range is empty or not within [0, size of subtree)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Range_Preprocess, typename _Range_Combine>
+_Range_Type_Intermediate avl_node_get_range(
+    const avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    _Size begin, _Size end, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb) {
+  if (node == nullptr || !(begin < end) || node->size < end) [[unlikely]] {
+    throw std::out_of_range(
+        "AVL tree operation get range was given an empty range or a range "
+        "which is outside of the range of valid indices for this tree.");
+  }
+  if (begin == _Size(0) && end == node->size) {
+    // the whole subtree
+    return node->range();
+  }
+  _Size left_size = avl_node_size(node->left());
+  if (end <= left_size) {
+    // entirely on the left
+    return avl_node_get_range(node->left(), begin, end, _rpre, _rcomb);
+  }
+  if (left_size < begin) {
+    // entirely on the right
+    return avl_node_get_range(node->right(), begin - (left_size + _Size(1)),
+                              end - (left_size + _Size(1)), _rpre, _rcomb);
+  }
+  // includes this node
+  _Range_Type_Intermediate result = _rpre(node->element());
+  if (begin < left_size) {
+    result = _rcomb(
+        avl_node_get_range(node->left(), begin, left_size, _rpre, _rcomb),
+        result);
+  }
+  if (left_size + _Size(1) < end) {
+    result = _rcomb(result, avl_node_get_range(node->right(), _Size(0),
+                                               end - (left_size + _Size(1)),
+                                               _rpre, _rcomb));
+  }
+  return result;
+}
+
+//! Find the element covering a position, where each element stands for several positions.
+/*!
+ * For trees where the range intermediate value of an element is its weight,
+ * the number of positions it stands for, and the range combine function adds weights.
+ * For example, an unrolled list stores a block of several list items in each element,
+ * so its weight is the number of items in the block.
+ * The stored range values are then the total weight of each subtree,
+ * which allows finding the element which covers a given position in O(log N),
+ * in the same way as finding the element at an index.
+ * Elements with weight 0 are never found.
+ *
+ * \param node the root of the subtree
+ * \param position the position to find, in range [0, total weight of subtree)
+ * \param _rpre range preprocess function, which gives the weight of an element
+ * \return tuple: (index of the element, pointer to the element, position within the element)
+ * \sa avl_tree::find_weighted
+ * \exception std::out_of_range If the position is outside the range [0, total weight of subtree)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Range_Preprocess>
+std::tuple<_Size, const _Element *, _Range_Type_Intermediate>
+avl_node_find_weighted(
+    const avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    _Range_Type_Intermediate position, const _Range_Preprocess &_rpre) {
+  _Size index = _Size(0);
+  while (node != nullptr) {
+    auto left = node->left();
+    if (left != nullptr) {
+      if (position < left->range()) {
+        // on the left
+        node = left;
+        continue;
+      }
+      position = position - left->range();
+      index += left->size;
+    }
+    _Range_Type_Intermediate weight = _rpre(node->element());
+    if (position < weight) {
+      // at this node
+      return std::make_tuple(index, &node->element(), position);
+    }
+    // on the right
+    position = position - weight;
+    index += _Size(1);
+    node = node->right();
+  }
+  throw std::out_of_range(
+      "AVL tree operation find weighted tried to find a position which is "
+      "outside of the total weight of this tree.");
+}
+
+//! Modify the element at an index in place.
+/*!
+ * Calls the modify function on the element at the given index,
+ * then recomputes the range values of the nodes on the path to it.
+ * Unlike replace, no copy of the element is made,
+ * which matters when the element is large.
+ * The tree structure does not change, so no rebalancing is needed.
+ *
+ * \param node the root of the subtree
+ * \param index the index of the element to modify, in range [0, size of subtree)
+ * \param _modify function which takes a reference to the element and changes it
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \sa avl_tree::modify
+ * \exception std::out_of_range If the requested index is outside the range [0, size of subtree)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Modify,
+          typename _Range_Preprocess, typename _Range_Combine>
+void avl_node_modify_at_index(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size index,
+    const _Modify &_modify, const _Range_Preprocess &_rpre,
+    const _Range_Combine &_rcomb) {
+  if (node == nullptr) [[unlikely]] {
+    throw std::out_of_range(
+        "AVL tree operation modify at index tried to modify outside of the "
+        "range of valid indices for this tree.");
+  }
+  _Size left_size = avl_node_size(node->left());
+  if (index == left_size) {
+    // at this node
+    _modify(node->element());
+  } else if (index < left_size) {
+    // on the left
+    avl_node_modify_at_index(node->left(), index, _modify, _rpre, _rcomb);
+  } else {
+    // on the right
+    avl_node_modify_at_index(node->right(), index - (left_size + _Size(1)),
+                             _modify, _rpre, _rcomb);
+  }
+  node->update(_rpre, _rcomb);
+}
+
+//! Call a function on every element in the subtree, in order.
+/*!
+ * \param node the root of the subtree, which may be null
+ * \param _function function which takes a const reference to an element
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Function>
+void avl_node_for_each(
+    const avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    const _Function &_function) {
+  while (node != nullptr) {
+    avl_node_for_each(node->left(), _function);
+    _function(node->element());
+    // loop instead of recursing on the right
+    node = node->right();
+  }
+}
+
+//! Find the index of the first element in the subtree which is not less than a value.
+/*!
+ * Assumes sorted order.
+ * The value may be of any type which the less than function can compare with elements
+ * in both orders.
+ *
+ * \param node the root of the subtree, which may be null
+ * \param value the value to search for
+ * \param _less less than function
+ * \return pair: (index of the first element not less than the value, or size of subtree if there is none,
+ * whether that element is equivalent to the value)
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Compare, typename _Key>
+std::pair<_Size, bool> avl_node_lower_bound(
+    const avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    const _Key &value, const _Compare &_less) {
+  _Size index = _Size(0);
+  const _Element *found = nullptr;
+  while (node != nullptr) {
+    if (_less(node->element(), value)) {
+      // on the right
+      index += avl_node_size(node->left()) + _Size(1);
+      node = node->right();
+    } else {
+      // here or on the left
+      found = &node->element();
+      node = node->left();
+    }
+  }
+  return std::make_pair(index, found != nullptr && !_less(value, *found));
+}
+
+//! Find the index of the first element in the subtree which is greater than a value.
+/*!
+ * Assumes sorted order.
+ * The value may be of any type which the less than function can compare with elements.
+ *
+ * \param node the root of the subtree, which may be null
+ * \param value the value to search for
+ * \param _less less than function
+ * \return index of the first element greater than the value, or size of subtree if there is none
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Compare, typename _Key>
+_Size avl_node_upper_bound(
+    const avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    const _Key &value, const _Compare &_less) {
+  _Size index = _Size(0);
+  while (node != nullptr) {
+    if (_less(value, node->element())) {
+      // here or on the left
+      node = node->left();
+    } else {
+      // on the right
+      index += avl_node_size(node->left()) + _Size(1);
+      node = node->right();
+    }
+  }
+  return index;
+}
+
+//! Copy a tree into an array in van Emde Boas order.
+/*!
+ * The van Emde Boas order is cache oblivious: the top half of the levels of the tree
+ * is laid out first, recursively in the same order, followed by each of the subtrees
+ * hanging below it, each also recursively in the same order.
+ * Whatever the cache line or page size, a path from the root to a leaf
+ * then crosses only O(log N / log B) blocks of B nodes, instead of about one block per level.
+ * The root ends up at position 0.
+ * Takes O(N log log N) time.
+ *
+ * \param node the root of the tree, which may be null
+ * \param frozen array to put the nodes in, which should be empty
+ * \sa frozen_avl_tree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout>
+void avl_node_freeze(
+    const avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    std::vector<frozen_node<_Element, _Size, _Range_Type_Intermediate>> &frozen) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  typedef std::pair<const node_type *, _Size> indexed_node;
+  if (node == nullptr) return;
+  // nodes are identified by their index, which is their position in order
+  auto left_index = [](const node_type *parent, _Size index) {
+    return index - _Size(1) - avl_node_size(parent->left()->right());
+  };
+  auto right_index = [](const node_type *parent, _Size index) {
+    return index + _Size(1) + avl_node_size(parent->right()->left());
+  };
+  // gather the nodes at some depth below a node, left to right
+  auto gather = [&](auto &self, const node_type *below, _Size index,
+                    unsigned depth, std::vector<indexed_node> &out) -> void {
+    if (depth == 0) {
+      out.emplace_back(below, index);
+      return;
+    }
+    if (below->left() != nullptr) {
+      self(self, below->left(), left_index(below, index), depth - 1, out);
+    }
+    if (below->right() != nullptr) {
+      self(self, below->right(), right_index(below, index), depth - 1, out);
+    }
+  };
+  // list the nodes in van Emde Boas order, for the given number of levels below a node
+  std::vector<indexed_node> order;
+  order.reserve(std::size_t(node->size));
+  // the subtrees below each top part wait here, shared by all levels of recursion
+  std::vector<indexed_node> bottoms;
+  auto layout = [&](auto &self, const node_type *top, _Size index,
+                    unsigned levels) -> void {
+    if (levels == 1) {
+      order.emplace_back(top, index);
+      return;
+    }
+    unsigned top_levels = levels / 2;
+    self(self, top, index, top_levels);
+    std::size_t first = bottoms.size();
+    gather(gather, top, index, top_levels, bottoms);
+    std::size_t last = bottoms.size();
+    for (std::size_t i = first; i < last; ++i) {
+      indexed_node bottom = bottoms[i];
+      self(self, bottom.first, bottom.second, levels - top_levels);
+    }
+    bottoms.resize(first);
+  };
+  // the height follows the taller child at each level
+  unsigned height = 0;
+  for (const node_type *n = node; n != nullptr;
+       n = n->balance() > 0 ? n->right() : n->left()) {
+    ++height;
+  }
+  layout(layout, node, avl_node_size(node->left()), height);
+  // now that every node has a position, link them up
+  std::vector<_Size> position(order.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    position[std::size_t(order[i].second)] = _Size(i);
+  }
+  const _Size none = std::numeric_limits<_Size>::max();
+  frozen.reserve(order.size());
+  for (const indexed_node &entry : order) {
+    const node_type *n = entry.first;
+    _Size left = n->left() == nullptr
+                     ? none
+                     : position[std::size_t(left_index(n, entry.second))];
+    _Size right = n->right() == nullptr
+                      ? none
+                      : position[std::size_t(right_index(n, entry.second))];
+    frozen.push_back({n->element(), n->size, n->range(), left, right, n->balance()});
+  }
+}
+
+//! Copy a frozen tree back into nodes.
+/*!
+ * Makes a tree of exactly the same shape, so no rebalancing is needed and it takes O(N) time.
+ * If copying an element throws, the nodes made so far are destroyed.
+ *
+ * \tparam _Node the node type to make
+ * \param frozen the array of frozen nodes
+ * \param position the position of the root of the subtree to copy, or the maximum value for an empty subtree
+ * \param _alloc allocator object
+ * \return the root of the new subtree
+ * \sa frozen_avl_tree
+ */
+template <typename _Node, typename _Element, typename _Size,
+          typename _Range_Type_Intermediate, typename _Alloc>
+_Node *avl_node_thaw(
+    const std::vector<frozen_node<_Element, _Size, _Range_Type_Intermediate>> &frozen,
+    _Size position, _Alloc &_alloc) {
+  if (position == std::numeric_limits<_Size>::max()) return nullptr;
+  const frozen_node<_Element, _Size, _Range_Type_Intermediate> &source =
+      frozen[std::size_t(position)];
+  _Node *node = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+  try {
+    std::allocator_traits<_Alloc>::construct(_alloc, node, source.value, source.subrange);
+  } catch (...) {
+    std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+    throw;
+  }
+  node->size = source.size;
+  node->set_balance(source.balance);
+  try {
+    node->set_left(avl_node_thaw<_Node>(frozen, source.left, _alloc));
+    node->set_right(avl_node_thaw<_Node>(frozen, source.right, _alloc));
+  } catch (...) {
+    // the subtree which threw is already gone, and the other one is linked or still null
+    avl_node_destroy(node, _alloc);
+    throw;
+  }
+  return node;
+}
+
+//! Build a perfectly balanced subtree from the next elements of a range, in order.
+/*!
+ * Each node takes the middle element of its part of the range,
+ * so no rebalancing is needed, and the sizes, balance factors and range intermediate values
+ * are set bottom up, with 1 range preprocess and at most 2 range combines per node.
+ * Takes O(N) time, and allocates the nodes in order, so a fresh pool lays them out in order.
+ * Merges are not tried.
+ * If constructing an element throws, the nodes made so far are destroyed.
+ *
+ * \tparam _Node the node type to make
+ * \param first iterator to the first element, which is advanced past the elements used
+ * \param count the number of elements to use, which the range must have
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return the root of the new subtree
+ * \sa avl_node_build_merged
+ */
+template <typename _Node, typename _Iterator, typename _Size,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+_Node *avl_node_build(_Iterator &first, _Size count,
+                      const _Range_Preprocess &_rpre,
+                      const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  if (count == _Size(0)) return nullptr;
+  _Size left_size = (count - _Size(1)) / _Size(2);
+  _Size right_size = count - _Size(1) - left_size;
+  _Node *left = avl_node_build<_Node>(first, left_size, _rpre, _rcomb, _alloc);
+  _Node *node;
+  try {
+    node = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+    try {
+      std::allocator_traits<_Alloc>::construct(_alloc, node, std::in_place,
+                                               _rpre, *first);
+    } catch (...) {
+      std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+      throw;
+    }
+  } catch (...) {
+    avl_node_destroy(left, _alloc);
+    throw;
+  }
+  ++first;
+  node->set_left(left);
+  try {
+    node->set_right(avl_node_build<_Node>(first, right_size, _rpre, _rcomb, _alloc));
+  } catch (...) {
+    avl_node_destroy(node, _alloc);
+    throw;
+  }
+  node->size = count;
+  // the right subtree has the same size or 1 more, and is only taller if that is a power of 2
+  node->set_balance(char(right_size != left_size &&
+                         (right_size & (right_size - _Size(1))) == _Size(0)));
+  if (left != nullptr) node->range() = _rcomb(left->range(), node->range());
+  if (node->right() != nullptr) {
+    node->range() = _rcomb(node->range(), node->right()->range());
+  }
+  return node;
+}
+
+//! Build a perfectly balanced tree from a range, in order, merging adjacent elements where possible.
+/*!
+ * Each element is constructed in a node, and merged into the previous element if possible,
+ * in which case its node is reused for the next element.
+ * The nodes are chained through their right links as they are made,
+ * so the range only needs to be read once, and its length need not be known,
+ * then the chain is relinked into a perfectly balanced tree and the range intermediate values are
+ * computed bottom up. Takes O(N) time.
+ * If constructing an element throws, the nodes made so far are destroyed.
+ *
+ * \tparam _Node the node type to make
+ * \param first iterator to the first element
+ * \param last iterator to one past the last element
+ * \param _merge merge function
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \param _alloc allocator object
+ * \return the root of the new tree
+ * \sa avl_node_build
+ */
+template <typename _Node, typename _Iterator, typename _Merge,
+          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
+_Node *avl_node_build_merged(_Iterator first, _Iterator last,
+                             const _Merge &_merge,
+                             const _Range_Preprocess &_rpre,
+                             const _Range_Combine &_rcomb, _Alloc &_alloc) {
+  typedef decltype(std::declval<_Node &>().size) size_type;
+  _Node *head = nullptr;
+  _Node *tail = nullptr;
+  size_type count = size_type(0);
+  // memory of a node whose element merged, to use for the next one
+  _Node *spare = nullptr;
+  try {
+    for (; first != last; ++first) {
+      _Node *node = spare != nullptr
+                        ? spare
+                        : std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+      spare = node;
+      std::allocator_traits<_Alloc>::construct(_alloc, node, std::in_place,
+                                               _rpre, *first);
+      if (tail != nullptr && _merge(tail->element(), node->element())) {
+        std::allocator_traits<_Alloc>::destroy(_alloc, node);
+        continue;
+      }
+      spare = nullptr;
+      if (tail == nullptr) {
+        head = node;
+      } else {
+        tail->set_right(node);
+      }
+      tail = node;
+      ++count;
+    }
+  } catch (...) {
+    // a loop, since the chain is as long as the range
+    while (head != nullptr) {
+      _Node *next = head->right();
+      std::allocator_traits<_Alloc>::destroy(_alloc, head);
+      std::allocator_traits<_Alloc>::deallocate(_alloc, head, 1);
+      head = next;
+    }
+    if (spare != nullptr) {
+      std::allocator_traits<_Alloc>::deallocate(_alloc, spare, 1);
+    }
+    throw;
+  }
+  if (spare != nullptr) std::allocator_traits<_Alloc>::deallocate(_alloc, spare, 1);
+  return avl_node_relink(head, count, _rpre, _rcomb);
+}
+
+//! Relink a chain of nodes into a perfectly balanced subtree, in order.
+/*!
+ * The chain is linked through the right links of the nodes.
+ * Each node takes the middle node of its part of the chain as its root,
+ * the same shape as avl_node_build makes,
+ * and the sizes, balance factors and range intermediate values are set bottom up.
+ * The range preprocess is done again for every node, since merges may have changed the elements.
+ * Takes O(N) time.
+ *
+ * \tparam _Node the node type
+ * \param next the first node of the chain, which is advanced past the nodes used
+ * \param count the number of nodes to use, which the chain must have
+ * \param _rpre range preprocess function
+ * \param _rcomb range combine function
+ * \return the root of the subtree
+ * \sa avl_node_build_merged
+ * \sa avl_node_merge_rebuild
+ */
+template <typename _Node, typename _Size, typename _Range_Preprocess,
+          typename _Range_Combine>
+_Node *avl_node_relink(_Node *&next, _Size count, const _Range_Preprocess &_rpre,
+                       const _Range_Combine &_rcomb) {
+  if (count == _Size(0)) return nullptr;
+  _Size left_size = (count - _Size(1)) / _Size(2);
+  _Size right_size = count - _Size(1) - left_size;
+  _Node *left = avl_node_relink(next, left_size, _rpre, _rcomb);
+  _Node *node = next;
+  next = node->right();
+  node->set_left(left);
+  node->set_right(avl_node_relink(next, right_size, _rpre, _rcomb));
+  node->set_balance(char(right_size != left_size &&
+                         (right_size & (right_size - _Size(1))) == _Size(0)));
+  node->update(_rpre, _rcomb);
+  return node;
+}
+
+//! Destroy and deallocate every node in the subtree.
+/*!
+ * \param node the root of the subtree, which may be null
+ * \param _alloc allocator object
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout,
+          typename _Alloc>
+void avl_node_destroy(avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+                      _Alloc &_alloc) {
+  if (node == nullptr) return;
+  avl_node_destroy(node->left(), _alloc);
+  avl_node_destroy(node->right(), _alloc);
+  std::allocator_traits<_Alloc>::destroy(_alloc, node);
+  std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+}
+
+//! Destroy every node in the subtree, without deallocating them.
+/*!
+ * Only useful right before the allocator releases all of its memory at once.
+ *
+ * \param node the root of the subtree, which may be null
+ * \param _alloc allocator object
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Alloc>
+void avl_node_destroy_elements(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    _Alloc &_alloc) {
+  if (node == nullptr) return;
+  avl_node_destroy_elements(node->left(), _alloc);
+  avl_node_destroy_elements(node->right(), _alloc);
+  std::allocator_traits<_Alloc>::destroy(_alloc, node);
+}
+
+//! Destroy and deallocate every node in a tree which owns all of the allocator's memory.
+/*!
+ * Same as avl_node_destroy, except that if the allocator can release in bulk
+ * and is not shared with anything else, the nodes are not deallocated one by one.
+ * Instead, the allocator gives all of its memory back at once.
+ * If the nodes are also trivially destructible, they are not even visited,
+ * so the whole teardown is O(number of chunks) instead of O(number of nodes).
+ *
+ * \param node the root of the tree, which may be null
+ * \param _alloc allocator object, which all of the tree's nodes came from
+ * \sa can_release_in_bulk
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Alloc>
+void avl_node_destroy_all(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node,
+    _Alloc &_alloc) {
+  if (node == nullptr) return;
+  if constexpr (can_release_in_bulk<_Alloc>::value) {
+    if (_alloc.unshared()) {
+      typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+      if (!std::is_trivially_destructible<node_type>::value ||
+          !std::is_trivially_destructible<typename node_type::payload_type>::value) {
+        avl_node_destroy_elements(node, _alloc);
+      }
+      _alloc.release();
+      return;
+    }
+  }
+  avl_node_destroy(node, _alloc);
+}
+
+//! Move the nodes at an index range of the subtree to new memory, in order.
+/*!
+ * Used to compact a tree. Each node in the range is moved into a node newly allocated from the allocator,
+ * with the same children, size, balance factor and range intermediate value,
+ * so the shape of the tree does not change.
+ * The new nodes are allocated in order, so a fresh allocator lays them out in order.
+ * The old nodes are destroyed but not deallocated, since they belong to another allocator,
+ * which gives their memory back all at once.
+ * Elements are only moved if that cannot throw, and copied otherwise.
+ * If copying an element throws, the subtree is left valid, with some of the range moved.
+ *
+ * \param node the root of the subtree, which may be null
+ * \param begin the first index to move
+ * \param end one past the last index to move
+ * \param _alloc allocator object for the new nodes
+ * \return the new root of the subtree
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Alloc>
+avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *avl_node_relocate(
+    avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> *node, _Size begin,
+    _Size end, _Alloc &_alloc) {
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+  if (node == nullptr || !(begin < end)) return node;
+  _Size left_size = avl_node_size(node->left());
+  if (begin < left_size) {
+    node->set_left(avl_node_relocate(node->left(), begin,
+                                     std::min(end, left_size), _alloc));
+  }
+  if (left_size < begin) {
+    // this node stays
+    node->set_right(avl_node_relocate(node->right(), begin - (left_size + _Size(1)),
+                                      end - (left_size + _Size(1)), _alloc));
+    return node;
+  }
+  if (end <= left_size) return node;
+  // take the memory for this node before the right subtree, to keep the order
+  node_type *moved = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+  try {
+    if (left_size + _Size(1) < end) {
+      node->set_right(avl_node_relocate(node->right(), _Size(0),
+                                        end - (left_size + _Size(1)), _alloc));
+    }
+    std::allocator_traits<_Alloc>::construct(
+        _alloc, moved, std::move_if_noexcept(node->element()), node->range());
+  } catch (...) {
+    std::allocator_traits<_Alloc>::deallocate(_alloc, moved, 1);
+    throw;
+  }
+  moved->size = node->size;
+  moved->set_balance(node->balance());
+  moved->set_left(node->left());
+  moved->set_right(node->right());
+  std::allocator_traits<_Alloc>::destroy(_alloc, node);
+  return moved;
+}
+
+// the frozen tree class
+
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+class avl_tree;
+
+//! Immutable copy of an AVL tree, laid out in one array for fast queries.
+/*!
+ * Made by avl_tree::freeze, for read-only phases where a large tree is queried for a long time
+ * without being changed. The nodes, with their sizes and range values,
+ * are stored in one array in van Emde Boas order, which is cache oblivious,
+ * so a lookup crosses far fewer cache lines and pages than following pointers between separately
+ * allocated nodes. Supports the same index and range queries as avl_tree,
+ * plus ordered search if the tree was sorted.
+ * Can be thawed back into a mutable tree in O(N), with the avl_tree constructor that takes a frozen tree.
+ *
+ * The template parameters have the same meaning as for avl_tree.
+ *
+ * \sa avl_node_freeze
+ */
+template <typename _Element, typename _Element_Compare = std::less<_Element>,
+          typename _Size = std::size_t,
+          typename _Range_Preprocess = monostate,
+          typename _Range_Type_Intermediate = typename std::decay<
+              typename std::invoke_result<_Range_Preprocess, _Element>::type>::type,
+          typename _Range_Combine = std::plus<_Range_Type_Intermediate>,
+          typename _Range_Postprocess = identity<_Range_Type_Intermediate>>
+class frozen_avl_tree {
+ private:
+  typedef frozen_node<_Element, _Size, _Range_Type_Intermediate> node_type;
+  static constexpr _Size none = std::numeric_limits<_Size>::max();
+
+  std::vector<node_type> nodes;
+  [[no_unique_address]] _Element_Compare _less;
+  [[no_unique_address]] _Range_Preprocess _rpre;
+  [[no_unique_address]] _Range_Combine _rcomb;
+  [[no_unique_address]] _Range_Postprocess _rpost;
+
+  _Size node_size(_Size) const;
+  _Range_Type_Intermediate get_range_below(_Size, _Size, _Size) const;
+
+  template <typename, typename, typename, typename, typename, typename,
+            typename, typename, typename, typename, std::size_t>
+  friend class avl_tree;
+
+ public:
+  frozen_avl_tree();
+  std::size_t size() const;
+  const _Element &get_item(std::size_t) const;
+  typename std::decay<typename std::invoke_result<
+      _Range_Postprocess, _Range_Type_Intermediate>::type>::type
+  get_range(std::size_t, std::size_t) const;
+  std::size_t lower_bound(const _Element &) const;
+  bool contains(const _Element &) const;
+};
+
+//! Construct an empty frozen tree.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Range_Preprocess, typename _Range_Type_Intermediate,
+          typename _Range_Combine, typename _Range_Postprocess>
+frozen_avl_tree<_Element, _Element_Compare, _Size, _Range_Preprocess,
+                _Range_Type_Intermediate, _Range_Combine,
+                _Range_Postprocess>::frozen_avl_tree() {}
+
+//! Get the size of the subtree at a position, which may be the maximum value for an empty subtree.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Range_Preprocess, typename _Range_Type_Intermediate,
+          typename _Range_Combine, typename _Range_Postprocess>
+_Size frozen_avl_tree<_Element, _Element_Compare, _Size, _Range_Preprocess,
+                      _Range_Type_Intermediate, _Range_Combine,
+                      _Range_Postprocess>::node_size(_Size position) const {
+  return position == none ? _Size(0) : nodes[std::size_t(position)].size;
+}
+
+//! Get the number of elements in the tree.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Range_Preprocess, typename _Range_Type_Intermediate,
+          typename _Range_Combine, typename _Range_Postprocess>
+std::size_t frozen_avl_tree<_Element, _Element_Compare, _Size,
+                            _Range_Preprocess, _Range_Type_Intermediate,
+                            _Range_Combine, _Range_Postprocess>::size() const {
+  return nodes.size();
+}
+
+//! Get the element at an index.
+/*!
+ * \param index the index, in range [0, size)
+ * \return a const reference to the element at that index
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Range_Preprocess, typename _Range_Type_Intermediate,
+          typename _Range_Combine, typename _Range_Postprocess>
+const _Element &
+frozen_avl_tree<_Element, _Element_Compare, _Size, _Range_Preprocess,
+                _Range_Type_Intermediate, _Range_Combine,
+                _Range_Postprocess>::get_item(std::size_t index) const {
+  if (!(index < nodes.size())) [[unlikely]] {
+    throw std::out_of_range(
+        "Frozen AVL tree operation get item tried to get outside of the range "
+        "of valid indices for this tree.");
+  }
+  _Size position = _Size(0);
+  _Size remaining = _Size(index);
+  while (true) {
+    const node_type &node = nodes[std::size_t(position)];
+    _Size left_size = node_size(node.left);
+    if (remaining == left_size) {
+      return node.value;
+    } else if (remaining < left_size) {
+      position = node.left;
+    } else {
+      remaining -= left_size + _Size(1);
+      position = node.right;
+    }
+  }
+}
+
+//! Get the combined range intermediate value over an index range in the subtree at a position.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Range_Preprocess, typename _Range_Type_Intermediate,
+          typename _Range_Combine, typename _Range_Postprocess>
+_Range_Type_Intermediate
+frozen_avl_tree<_Element, _Element_Compare, _Size, _Range_Preprocess,
+                _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess>::
+    get_range_below(_Size position, _Size begin, _Size end) const {
+  const node_type &node = nodes[std::size_t(position)];
+  if (begin == _Size(0) && end == node.size) {
+    // the whole subtree
+    return node.subrange;
+  }
+  _Size left_size = node_size(node.left);
+  if (end <= left_size) {
+    // entirely on the left
+    return get_range_below(node.left, begin, end);
+  }
+  if (left_size < begin) {
+    // entirely on the right
+    return get_range_below(node.right, begin - (left_size + _Size(1)),
+                           end - (left_size + _Size(1)));
+  }
+  // includes this node
+  _Range_Type_Intermediate result = _rpre(node.value);
+  if (begin < left_size) {
+    result = _rcomb(get_range_below(node.left, begin, left_size), result);
+  }
+  if (left_size + _Size(1) < end) {
+    result = _rcomb(result, get_range_below(node.right, _Size(0),
+                                            end - (left_size + _Size(1))));
+  }
+  return result;
+}
+
+//! Get the result of the range query over the index range [begin, end).
+/*!
+ * \param begin the first index in the range
+ * \param end one past the last index in the range
+ * \return the postprocessed result of the range query
+ * \exception std::out_of_range If the range is empty or not within [0, size)
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Range_Preprocess, typename _Range_Type_Intermediate,
+          typename _Range_Combine, typename _Range_Postprocess>
+typename std::decay<typename std::invoke_result<
+    _Range_Postprocess, _Range_Type_Intermediate>::type>::type
+frozen_avl_tree<_Element, _Element_Compare, _Size, _Range_Preprocess,
+                _Range_Type_Intermediate, _Range_Combine,
+                _Range_Postprocess>::get_range(std::size_t begin,
+                                               std::size_t end) const {
+  if (!(begin < end) || nodes.size() < end) [[unlikely]] {
+    throw std::out_of_range(
+        "Frozen AVL tree operation get range was given an empty range or a "
+        "range which is outside of the range of valid indices for this tree.");
+  }
+  return _rpost(get_range_below(_Size(0), _Size(begin), _Size(end)));
+}
+
+//! Find the index of the first element which is not less than a value.
+/*!
+ * Assumes the elements are in sorted order.
+ *
+ * \param value the value to search for
+ * \return the index of the first element not less than the value, or size if there is none
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Range_Preprocess, typename _Range_Type_Intermediate,
+          typename _Range_Combine, typename _Range_Postprocess>
+std::size_t
+frozen_avl_tree<_Element, _Element_Compare, _Size, _Range_Preprocess,
+                _Range_Type_Intermediate, _Range_Combine,
+                _Range_Postprocess>::lower_bound(const _Element &value) const {
+  _Size position = nodes.empty() ? none : _Size(0);
+  _Size index = _Size(0);
+  while (position != none) {
+    const node_type &node = nodes[std::size_t(position)];
+    if (_less(node.value, value)) {
+      // on the right
+      index += node_size(node.left) + _Size(1);
+      position = node.right;
+    } else {
+      // here or on the left
+      position = node.left;
+    }
+  }
+  return std::size_t(index);
+}
+
+//! Check if an element equivalent to a value is in the tree.
+/*!
+ * Assumes the elements are in sorted order.
+ *
+ * \param value the value to search for
+ * \return whether there is an element which is neither less nor greater than the value
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Range_Preprocess, typename _Range_Type_Intermediate,
+          typename _Range_Combine, typename _Range_Postprocess>
+bool frozen_avl_tree<_Element, _Element_Compare, _Size, _Range_Preprocess,
+                     _Range_Type_Intermediate, _Range_Combine,
+                     _Range_Postprocess>::contains(const _Element &value) const {
+  _Size position = nodes.empty() ? none : _Size(0);
+  while (position != none) {
+    const node_type &node = nodes[std::size_t(position)];
+    if (_less(node.value, value)) {
+      position = node.right;
+    } else if (_less(value, node.value)) {
+      position = node.left;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the eytzinger snapshot class
+
+//! Allocator which aligns every allocation to a cache line; for internal use.
+/*!
+ * \tparam T the type of object to allocate
+ */
+template <typename T>
+struct cache_aligned_allocator {
+  typedef T value_type;
+  static constexpr std::size_t alignment =
+      alignof(T) > 64 ? alignof(T) : std::size_t(64);
+
+  cache_aligned_allocator() noexcept {}
+  template <typename U>
+  cache_aligned_allocator(const cache_aligned_allocator<U> &) noexcept {}
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(
+        ::operator new(n * sizeof(T), std::align_val_t(alignment)));
+  }
+  void deallocate(T *p, std::size_t) noexcept {
+    ::operator delete(p, std::align_val_t(alignment));
+  }
+  template <typename U>
+  bool operator==(const cache_aligned_allocator<U> &) const noexcept {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const cache_aligned_allocator<U> &) const noexcept {
+    return false;
+  }
+};
+
+//! Immutable snapshot of a sorted tree in Eytzinger order, for fast ordered lookups.
+/*!
+ * Made by avl_tree::snapshot. Only the elements are kept,
+ * in one cache line aligned array in Eytzinger (breadth first) order:
+ * the root is at position 1, and the children of position k are at 2k and 2k + 1.
+ * Searches need no links at all, descend without branching on the comparison,
+ * and prefetch the cache line holding the descendants several levels ahead,
+ * so the memory latency of the levels overlaps.
+ * The in-order rank of a position can be computed from the position alone,
+ * so rank queries need no stored sizes either.
+ *
+ * \tparam _Element the element type, which must be default constructible
+ * \tparam _Element_Compare the less than function, which the elements are sorted by
+ */
+template <typename _Element, typename _Element_Compare = std::less<_Element>>
+class eytzinger_snapshot {
+ private:
+  //! Elements in Eytzinger order, with an unused element at position 0.
+  std::vector<_Element, cache_aligned_allocator<_Element>> elements;
+  //! Depth of the last level, which may be partly filled.
+  unsigned last_depth;
+  //! Number of elements on the last level.
+  std::size_t last_count;
+  [[no_unique_address]] _Element_Compare _less;
+
+  std::size_t search(const _Element &) const;
+  std::size_t rank_of(std::size_t) const;
+
+ public:
+  eytzinger_snapshot();
+  explicit eytzinger_snapshot(const std::vector<_Element> &);
+  std::size_t size() const;
+  const _Element *lower_bound(const _Element &) const;
+  bool contains(const _Element &) const;
+  std::size_t rank(const _Element &) const;
+};
+
+//! Get the position of the highest set bit, which must exist.
+inline unsigned floor_log2(std::size_t x) {
+#if defined(__GNUC__)
+  return unsigned(std::numeric_limits<unsigned long long>::digits - 1 -
+                  __builtin_clzll(x));
+#else
+  unsigned result = 0;
+  while (x >>= 1) ++result;
+  return result;
+#endif
+}
+
+//! Construct an empty snapshot.
+template <typename _Element, typename _Element_Compare>
+eytzinger_snapshot<_Element, _Element_Compare>::eytzinger_snapshot()
+    : elements(1), last_depth(0), last_count(0) {}
+
+//! Construct a snapshot from elements in sorted order.
+/*!
+ * Takes O(N) time.
+ *
+ * \param sorted the elements, which must be sorted by the less than function
+ */
+template <typename _Element, typename _Element_Compare>
+eytzinger_snapshot<_Element, _Element_Compare>::eytzinger_snapshot(
+    const std::vector<_Element> &sorted)
+    : elements(sorted.size() + 1) {
+  std::size_t n = sorted.size();
+  // an in-order walk of the implicit tree visits positions in sorted order
+  std::size_t next = 0;
+  auto fill = [&](auto &self, std::size_t position) -> void {
+    if (position > n) return;
+    self(self, 2 * position);
+    elements[position] = sorted[next++];
+    self(self, 2 * position + 1);
+  };
+  fill(fill, 1);
+  last_depth = n == 0 ? 0 : floor_log2(n);
+  last_count = n - ((std::size_t(1) << last_depth) - 1);
+}
+
+//! Get the number of elements.
+template <typename _Element, typename _Element_Compare>
+std::size_t eytzinger_snapshot<_Element, _Element_Compare>::size() const {
+  return elements.size() - 1;
+}
+
+//! Find the position of the first element not less than a value, or 0 if there is none.
+/*!
+ * Branchless descent: each level adds the comparison result to the position,
+ * so the loop always runs once per level.
+ * Afterwards, the position has gone right some number of times since it last went left,
+ * at the element which is the answer; shifting those right turns off, and one more, goes back there.
+ */
+template <typename _Element, typename _Element_Compare>
+std::size_t eytzinger_snapshot<_Element, _Element_Compare>::search(
+    const _Element &value) const {
+  // descendants 4 levels down share a cache line, for small elements
+  constexpr std::size_t prefetch_stride =
+      sizeof(_Element) < 16 ? 64 / sizeof(_Element) : 4;
+  const _Element *data = elements.data();
+  std::size_t n = elements.size() - 1;
+  std::size_t position = 1;
+  while (position <= n) {
+#if defined(__GNUC__)
+    __builtin_prefetch(data + position * prefetch_stride);
+#endif
+    position = 2 * position + std::size_t(_less(data[position], value));
+  }
+  // go back up past the right turns and the last left turn
+#if defined(__GNUC__)
+  unsigned right_turns = unsigned(__builtin_ctzll(~(unsigned long long)position));
+#else
+  unsigned right_turns = 0;
+  while (position & (std::size_t(1) << right_turns)) ++right_turns;
+#endif
+  return position >> (right_turns + 1);
+}
+
+//! Get the in-order rank of a position.
+/*!
+ * In a perfect tree with one more level than the last level, a position at depth d and offset j
+ * within its level has rank (2j + 1) * 2^(last depth - d) - 1.
+ * The last level takes every even rank, so the rank only needs correcting
+ * for the missing positions of the last level which would come before it.
+ */
+template <typename _Element, typename _Element_Compare>
+std::size_t eytzinger_snapshot<_Element, _Element_Compare>::rank_of(
+    std::size_t position) const {
+  unsigned depth = floor_log2(position);
+  std::size_t offset = position - (std::size_t(1) << depth);
+  std::size_t perfect_rank = ((2 * offset + 1) << (last_depth - depth)) - 1;
+  std::size_t last_level_before = (perfect_rank + 1) / 2;
+  return perfect_rank -
+         (last_level_before > last_count ? last_level_before - last_count : 0);
+}
+
+//! Find the first element which is not less than a value.
+/*!
+ * \param value the value to search for
+ * \return pointer to the first element not less than the value, or null if there is none
+ */
+template <typename _Element, typename _Element_Compare>
+const _Element *eytzinger_snapshot<_Element, _Element_Compare>::lower_bound(
+    const _Element &value) const {
+  std::size_t position = search(value);
+  return position == 0 ? nullptr : elements.data() + position;
+}
+
+//! Check if an element equivalent to a value is in the snapshot.
+/*!
+ * \param value the value to search for
+ * \return whether there is an element which is neither less nor greater than the value
+ */
+template <typename _Element, typename _Element_Compare>
+bool eytzinger_snapshot<_Element, _Element_Compare>::contains(
+    const _Element &value) const {
+  std::size_t position = search(value);
+  return position != 0 && !_less(value, elements[position]);
+}
+
+//! Count the elements which are less than a value.
+/*!
+ * This is also the index, in sorted order, of the first element not less than the value.
+ *
+ * \param value the value to search for
+ * \return the number of elements less than the value
+ */
+template <typename _Element, typename _Element_Compare>
+std::size_t eytzinger_snapshot<_Element, _Element_Compare>::rank(
+    const _Element &value) const {
+  std::size_t position = search(value);
+  return position == 0 ? size() : rank_of(position);
+}
+
+// the node handle class
+
+//! Owner of one node taken out of a tree, which can be put into another tree without allocating.
+/*!
+ * Made by avl_tree::extract, and given back to a tree with avl_tree::insert
+ * or avl_tree::insert_ordered, like the node handles of std::map.
+ * The node keeps its element the whole time, so moving an element
+ * from one tree to another needs no allocation and does not copy or move the element,
+ * as long as both trees have the same node type and their allocators compare equal
+ * (see avl_tree::allocator_type).
+ * The element can be changed while it is in the handle,
+ * since its range intermediate value is computed again when it is inserted.
+ * The handle keeps a copy of the allocator, and if it still owns a node when it is destroyed,
+ * the node is destroyed and given back to the allocator.
+ *
+ * The template parameters have the same meaning as for avl_node and avl_tree.
+ *
+ * \sa avl_tree::extract
+ */
+template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
+          typename _Layout, typename _Alloc>
+class avl_node_handle {
+ private:
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+
+  //! The owned node, or null if the handle is empty.
+  node_type *node;
+  //! The allocator which the node came from, or nothing if the handle is empty.
+  std::optional<_Alloc> _alloc;
+
+  //! Take ownership of a lone node from an allocator.
+  avl_node_handle(node_type *i_node, const _Alloc &i_alloc)
+      : node(i_node), _alloc(i_alloc) {}
+
+  //! Give up the node, with its range intermediate value computed again, leaving the handle empty.
+  template <typename _Range_Preprocess, typename _Range_Combine>
+  node_type *release(const _Range_Preprocess &_rpre,
+                     const _Range_Combine &_rcomb) {
+    node_type *released = node;
+    released->update(_rpre, _rcomb);
+    node = nullptr;
+    _alloc.reset();
+    return released;
+  }
+
+  template <typename, typename, typename, typename, typename, typename,
+            typename, typename, typename, typename, std::size_t>
+  friend class avl_tree;
+
+ public:
+  //! Construct an empty handle.
+  avl_node_handle() noexcept : node(nullptr) {}
+  //! Take the node of another handle, leaving it empty.
+  avl_node_handle(avl_node_handle &&other) noexcept
+      : node(other.node), _alloc(std::move(other._alloc)) {
+    other.node = nullptr;
+    other._alloc.reset();
+  }
+  //! Destroy the owned node, if there is one, then take the node of another handle, leaving it empty.
+  avl_node_handle &operator=(avl_node_handle &&other) noexcept {
+    if (this != &other) {
+      reset();
+      node = other.node;
+      other.node = nullptr;
+      if (other._alloc) {
+        // allocators need not be assignable
+        _alloc.emplace(std::move(*other._alloc));
+        other._alloc.reset();
+      }
+    }
+    return *this;
+  }
+  avl_node_handle(const avl_node_handle &) = delete;
+  avl_node_handle &operator=(const avl_node_handle &) = delete;
+  ~avl_node_handle() { reset(); }
+
+  //! Destroy the owned node, if there is one, leaving the handle empty.
+  void reset() noexcept {
+    if (node != nullptr) {
+      std::allocator_traits<_Alloc>::destroy(*_alloc, node);
+      std::allocator_traits<_Alloc>::deallocate(*_alloc, node, 1);
+      node = nullptr;
+    }
+    _alloc.reset();
+  }
+  //! Check if the handle owns no node.
+  bool empty() const noexcept { return node == nullptr; }
+  //! Check if the handle owns a node.
+  explicit operator bool() const noexcept { return node != nullptr; }
+  //! Get the element in the owned node, which must exist.
+  _Element &value() const { return node->element(); }
+  //! Get a copy of the allocator which the owned node, which must exist, came from.
+  _Alloc get_allocator() const { return *_alloc; }
+};
+
+// the avl tree class
+
+//! Fixed capacity array of elements stored inside a tree object; for internal use.
+/*!
+ * Used by avl_tree while it is small, so that small trees need no nodes at all.
+ * Elements are only constructed as needed, so they need not be default constructible.
+ *
+ * \tparam _Element the element type
+ * \tparam _Capacity the most elements which fit
+ * \sa avl_tree
+ */
+template <typename _Element, std::size_t _Capacity>
+class inline_buffer {
+ private:
+  typedef typename std::conditional<(_Capacity < 256), unsigned char,
+                                    std::size_t>::type count_type;
+
+  alignas(_Element) unsigned char storage[_Capacity * sizeof(_Element)];
+  count_type count;
+
+ public:
+  inline_buffer() : count(0) {}
+  inline_buffer(const inline_buffer &) = delete;
+  inline_buffer &operator=(const inline_buffer &) = delete;
+  ~inline_buffer() { clear(); }
+  //! Get the number of elements.
+  std::size_t size() const { return count; }
+  //! Check if there is no space for another element.
+  bool full() const { return count == _Capacity; }
+  //! Get the element at an index, which must be in range [0, size).
+  _Element &operator[](std::size_t index) {
+    return std::launder(reinterpret_cast<_Element *>(storage))[index];
+  }
+  //! Get the element at an index, which must be in range [0, size).
+  const _Element &operator[](std::size_t index) const {
+    return std::launder(reinterpret_cast<const _Element *>(storage))[index];
+  }
+  //! Construct an element in place at the end, if not full, and return it.
+  template <typename... _Args>
+  _Element &emplace_back(_Args &&... args) {
+    ::new (static_cast<void *>(storage + count * sizeof(_Element)))
+        _Element(std::forward<_Args>(args)...);
+    ++count;
+    return (*this)[count - 1];
+  }
+  //! Move the last element to just before an index, which must be in range [0, size).
+  void move_back_to(std::size_t index) {
+    _Element *elements = &(*this)[0];
+    std::rotate(elements + index, elements + count - 1, elements + count);
+  }
+  //! Remove the element at an index, which must be in range [0, size), and return it.
+  _Element remove(std::size_t index) {
+    _Element *elements = &(*this)[0];
+    _Element value = std::move(elements[index]);
+    std::move(elements + index + 1, elements + count, elements + index);
+    --count;
+    elements[count].~_Element();
+    return value;
+  }
+  //! Remove the element at an index, which must be in range [0, size).
+  void erase(std::size_t index) {
+    _Element *elements = &(*this)[0];
+    std::move(elements + index + 1, elements + count, elements + index);
+    --count;
+    elements[count].~_Element();
+  }
+  //! Remove all elements.
+  void clear() {
+    while (count > 0) {
+      --count;
+      (*this)[count].~_Element();
+    }
+  }
+};
+
+//! Inline buffer with no space, used when inline storage is turned off; for internal use.
+template <typename _Element>
+class inline_buffer<_Element, 0> {};
+
+//! What a call of avl_tree::compact did.
+enum class compact_status {
+  //! The compaction has finished, or there was nothing to compact.
+  finished,
+  //! Some nodes were moved, and the compaction goes on with the next call.
+  in_progress,
+  //! Nothing was moved, because the allocator is shared, so its memory could not be given back.
+  shared
+};
+
+//! How much memory a tree uses, as reported by avl_tree::footprint.
+/*!
+ * If the tree shares its allocator with other trees, the allocator's byte counts
+ * are for all of those trees together, and shared is set,
+ * so that adding up the footprints of many trees can count a shared allocator only once.
+ */
+struct memory_footprint {
+  //! Number of elements.
+  std::size_t elements;
+  //! Number of nodes, which is 0 while the elements are stored inline.
+  std::size_t nodes;
+  //! Bytes per node, including padding, and the payload if the layout keeps it apart.
+  std::size_t bytes_per_node;
+  //! Bytes of the tree object itself, including any inline elements.
+  std::size_t tree_bytes;
+  //! Bytes the allocator has taken from the system.
+  /*!
+   * For allocators which cannot say, this is the same as used_bytes,
+   * and does not count the allocator's own overhead.
+   */
+  std::size_t reserved_bytes;
+  //! Bytes of the allocator's memory which are in objects currently allocated.
+  std::size_t used_bytes;
+  //! Whether the allocator is shared, such as with other trees or a node handle.
+  /*!
+   * If so, reserved_bytes and used_bytes are for everything using the allocator,
+   * not just this tree, and every tree sharing it reports the same counts.
+   */
+  bool shared;
+  //! Bytes that a plain array of the elements would take.
+  std::size_t array_bytes;
+
+  //! Get the total memory used, as a multiple of the memory for a plain array of the elements.
+  /*!
+   * \return (tree bytes + reserved bytes) / array bytes, or 0 if there are no elements
+   */
+  double overhead_ratio() const {
+    if (array_bytes == 0) return 0;
+    return double(tree_bytes + reserved_bytes) / double(array_bytes);
+  }
+};
+
+//! The AVL tree class, the most basic and extensible data structure in the public API.
+/*!
+ * The AVL tree class which is actually exposed to the user and encapsulates a lot of the
+ * messy details involved in the implementation. The base extendable data structure on top
+ * of which more useful objects are built.
+ *
+ * To demonstrate use of the range queries, consider an implementation of a simple list
+ * which also wants O(log N) hashing of sublists. We will use range queries here to implement only hashing.
+ * Whatever the element type, we will use range preprocess as
+ * X --> (hash(X), 1). Intermediate values will be tuples of (hash for this range, number of elements in the range).
+ * Hashes will be combined using the Rabin hash, so this is the range combine:
+ * (U, N), (V, M) --> (P ^ N * U + V, N + M) for some odd multiplier P, using ^ to denote exponentiation.
+ * Finally, we want to return a single number as the hash, so the hash postprocess will simply drop the element count:
+ * (U, N) --> U
+ *
+ * \tparam _Element The type of the element stored in the tree collection.
+ * To differentiate it from other data, you may think of the "elements" as the original data.
+ * Without the elements, it's just a plain tree and not useful.
+ * \tparam _Element_Compare A class for a function that takes 2 elements and returns true if the
+ * left argument is less than the right argument. You will only actually need this for methods
+ * which care about the ordering, otherwise, you don't need to have this actually implemented at all.
+ * As a consequence of how templating works in C++, if you never use those ordered functions,
+ * the type-specific code will never be generated, so the compiler won't notice that the comparison function supplied
+ * doesn't actually work.
+ * In the future, with good reason, a major update
+ * may change this to use a 3-way comparison function.
+ * \tparam _Size The integer or integer-like type used for indices and sizes.
+ * Recommended to use std::size_t (which is the default) unless you have a good reason
+ * to use another type.
+ * \tparam _Merge A class for a function that takes 2 element references, and tries to merge the right
+ * argument into the left argument. It will either return false and leave both arguments unchanged, or return true and
+ * combine the right argument with the left argument in some way. The actual behaviour of the merge depends
+ * on what merger you use, and this will depend on your needs. The left argument is kept in place, and if the merge
+ * is successful, the right argument will be discarded, so a destructive merge operation is okay.
+ * \tparam _Range_Preprocess A class for a function, designated the range preprocess function.
+ * For range operations, all elements will individually be mapped first through this function,
+ * to get an object of type _Range_Type_Intermediate.
+ * Often necessary because the intermediate value type differs from the element type
+ * and some conversion work is needed.
+ * \tparam _Range_Type_Intermediate The type of intermediate results of range operations.
+ * \tparam _Range_Combine A class for a function, designated the range combine function.
+ * Represents the binary operator that combines 2 _Range_Type_Intermediate values into 1.
+ * Assumed to be associative, otherwise, the result of a range operation is ill defined.
+ * Only requires associativity, not commutativity or invertability.
+ * \tparam _Range_Postprocess A class for a function, designated the range postprocess function.
+ * After computing the intermediate value for a range, that intermediate value is mapped through the
+ * range postprocess function to get the final result of the range query.
+ * A typical use of this is to drop information that is only relevant for intermediate values.
+ * \tparam _Layout The node layout, which decides how the links between nodes are stored in memory.
+ * By default, is pointer_layout, which uses plain pointers and works with any allocator.
+ * For large trees of small elements, relative_layout uses 32 bit links instead,
+ * but requires all nodes to be in one contiguous arena.
+ * \tparam _Alloc The allocator class for the nodes, which will be used for managing dynamic memory in place
+ * of using new and delete. By default, is the allocator suggested by the node layout, which for
+ * pointer_layout is the pool allocator, which takes nodes from large chunks
+ * and recycles removed nodes, and gives all the memory back at once when the tree is destroyed.
+ * To get the same behaviour as new and delete, use std::allocator instead.
+ * If you want more control over how the nodes are allocated, you can change this.
+ * \tparam _Inline_Capacity The most elements which are stored inside the tree object itself.
+ * While the tree has no more elements than this, they are kept in an array inside the tree object,
+ * and no nodes are allocated; the tree only switches to nodes when it grows past this.
+ * Worth it for programs with very many small trees.
+ * While stored inline, operations take O(_Inline_Capacity) time, and a merge on insert or replace
+ * is tried with the neighbours of the index.
+ * By default is 0, so that elements are always in nodes.
+ */
+template <typename _Element, typename _Element_Compare = std::less<_Element>,
+          typename _Size = std::size_t, typename _Merge = no_merge<_Element>,
+          typename _Range_Preprocess = monostate,
+          typename _Range_Type_Intermediate = typename std::decay<
+              typename std::invoke_result<_Range_Preprocess, _Element>::type>::type,
+          typename _Range_Combine = std::plus<_Range_Type_Intermediate>,
+          typename _Range_Postprocess = identity<_Range_Type_Intermediate>,
+          typename _Layout = pointer_layout,
+          typename _Alloc = typename _Layout::template default_allocator<
+              avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>>,
+          std::size_t _Inline_Capacity = 0>
+class avl_tree {
+ public:
+  //! The frozen version of this tree type, made by freeze.
+  typedef frozen_avl_tree<_Element, _Element_Compare, _Size, _Range_Preprocess,
+                          _Range_Type_Intermediate, _Range_Combine,
+                          _Range_Postprocess>
+      frozen_type;
+  //! The allocator type, so that trees can be constructed to share an allocator.
+  /*!
+   * Nodes can move between trees whose allocators compare equal,
+   * such as when they were constructed from copies of the same allocator.
+   */
+  typedef _Alloc allocator_type;
+  //! The node handle type, made by extract, which trees with the same node handle type can insert.
+  typedef avl_node_handle<_Element, _Size, _Range_Type_Intermediate, _Layout,
+                          _Alloc>
+      node_handle;
+
+ private:
+  typedef avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout> node_type;
+
+  node_type *root;
+  [[no_unique_address]] _Element_Compare _less;
+  [[no_unique_address]] _Merge _merge;
+  [[no_unique_address]] _Range_Preprocess _rpre;
+  [[no_unique_address]] _Range_Combine _rcomb;
+  [[no_unique_address]] _Range_Postprocess _rpost;
+  [[no_unique_address]] _Alloc _alloc;
+  //! Elements of a small tree, used while there are no nodes.
+  [[no_unique_address]] inline_buffer<_Element, _Inline_Capacity>
+      inline_elements;
+  //! State of a compaction which has been started but not finished.
+  struct compaction_state {
+    //! The allocator which the nodes not moved yet belong to.
+    _Alloc old_alloc;
+    //! Index of the first node which may not have been moved yet.
+    std::size_t next;
+  };
+  //! The compaction in progress, or null if there is none.
+  std::unique_ptr<compaction_state> compaction;
+
+  void check_capacity() const;
+  node_type *make_nodes(_Alloc &) const;
+  void move_to_nodes();
+  node_type *unlink_node(std::size_t);
+  template <bool _Ordered>
+  std::size_t link_lone(node_type *, std::size_t);
+  void drop_node(node_type *);
+  template <bool _Ordered, typename... _Args>
+  std::optional<std::size_t> insert_inline(std::size_t, _Args &&...);
+  template <typename _Value>
+  void insert_element(std::size_t, _Value &&);
+  template <typename _Value>
+  _Element replace_element(std::size_t, _Value &&);
+  template <typename _Key>
+  std::pair<std::size_t, bool> search_lower(const _Key &) const;
+  template <typename _Key>
+  std::size_t search_upper(const _Key &) const;
+  node_type *adopt_nodes(avl_tree &);
+  void split_into(std::size_t, avl_tree &);
+  void combine(avl_tree &, set_operation, unsigned);
+
+ public:
+  avl_tree();
+  explicit avl_tree(const _Alloc &);
+  explicit avl_tree(const frozen_type &);
+  template <typename _Iterator>
+  avl_tree(_Iterator, _Iterator);
+  avl_tree(const avl_tree &) = delete;
+  avl_tree &operator=(const avl_tree &) = delete;
+  ~avl_tree();
+  void clear();
+  template <typename _Iterator>
+  void assign(_Iterator, _Iterator, bool = false);
+  std::size_t size() const;
+  _Element get_item(std::size_t);
+  typename std::decay<typename std::invoke_result<
+      _Range_Postprocess, _Range_Type_Intermediate>::type>::type
+  get_range(std::size_t, std::size_t);
+  void insert(std::size_t, const _Element &);
+  void insert(std::size_t, _Element &&);
+  template <typename... _Args>
+  void emplace(std::size_t, _Args &&...);
+  template <typename... _Args>
+  std::size_t emplace_ordered(_Args &&...);
+  _Element remove(std::size_t);
+  void erase(std::size_t);
+  node_handle extract(std::size_t);
+  node_handle extract_ordered(const _Element &);
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  node_handle extract_ordered(const _Key &);
+  void insert(std::size_t, node_handle &&);
+  std::size_t insert_ordered(node_handle &&);
+  void join(avl_tree &);
+  template <typename _Value>
+  void join(_Value &&, avl_tree &);
+  void split_at(std::size_t, avl_tree &);
+  void split_at_detached(std::size_t, avl_tree &);
+  template <typename _Iterator>
+  void insert_sorted_batch(_Iterator, _Iterator);
+  void set_union(avl_tree &, unsigned = 1);
+  void set_intersection(avl_tree &, unsigned = 1);
+  void set_difference(avl_tree &, unsigned = 1);
+  void set_symmetric_difference(avl_tree &, unsigned = 1);
+  _Element replace(std::size_t, const _Element &);
+  _Element replace(std::size_t, _Element &&);
+  template <typename _Modify>
+  void modify(std::size_t, const _Modify &);
+  std::tuple<std::size_t, const _Element *, _Range_Type_Intermediate>
+  find_weighted(_Range_Type_Intermediate) const;
+  std::tuple<std::size_t, _Element *, _Range_Type_Intermediate>
+  find_weighted(_Range_Type_Intermediate);
+  template <typename _Function>
+  void for_each(const _Function &) const;
+  std::size_t lower_bound(const _Element &) const;
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  std::size_t lower_bound(const _Key &) const;
+  std::size_t upper_bound(const _Element &) const;
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  std::size_t upper_bound(const _Key &) const;
+  bool contains(const _Element &) const;
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  bool contains(const _Key &) const;
+  std::size_t count(const _Element &) const;
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  std::size_t count(const _Key &) const;
+  std::size_t find(const _Element &) const;
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  std::size_t find(const _Key &) const;
+  bool erase_ordered(const _Element &);
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  bool erase_ordered(const _Key &);
+  void split_by_key(const _Element &, avl_tree &);
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  void split_by_key(const _Key &, avl_tree &);
+  void split_by_key(const _Element &, avl_tree &, avl_tree &);
+  template <typename _Key, typename = transparent_key_t<_Element_Compare, _Key>>
+  void split_by_key(const _Key &, avl_tree &, avl_tree &);
+  frozen_type freeze() const;
+  eytzinger_snapshot<_Element, _Element_Compare> snapshot() const;
+  memory_footprint footprint() const;
+  compact_status compact(std::size_t = std::numeric_limits<std::size_t>::max());
+};
+
+//! Construct an empty tree.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::avl_tree()
+    : root(nullptr) {
+  check_capacity();
+}
+
+//! Construct an empty tree whose nodes come from the given allocator.
+/*!
+ * Such as a std::pmr::polymorphic_allocator on a memory resource.
+ *
+ * \param alloc the allocator, which the tree keeps a copy of
+ * \exception std::length_error If the node layout cannot link as many nodes as the allocator's arena holds
+ * \sa pmr::avl_tree
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::avl_tree(const _Alloc &alloc)
+    : root(nullptr), _alloc(alloc) {
+  check_capacity();
+}
+
+//! Thaw a frozen tree, making a mutable tree with the same elements.
 /*!
- * Mirrored version of rebalance_right_heavy.
+ * The new tree has exactly the same shape as the tree which was frozen,
+ * so this takes O(N) time.
+ * If copying an element throws, the nodes made so far are destroyed, and the exception is passed on.
+ *
+ * \param frozen the frozen tree
+ * \sa freeze
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-template <typename _Range_Preprocess, typename _Range_Combine>
-avl_node<_Element, _Size, _Range_Type_Intermediate>
-    *avl_node<_Element, _Size, _Range_Type_Intermediate>::rebalance_left_heavy(
-        const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb) {
-  if (this->left != nullptr)
-    this->left = this->left->ensure_not_right_heavy(_rpre, _rcomb);
-  return this->rotate_right(_rpre, _rcomb);
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::avl_tree(const frozen_type &frozen)
+    : root(nullptr) {
+  check_capacity();
+  // the allocator is only ready once the members are initialized
+  root = avl_node_thaw<node_type>(
+      frozen.nodes, frozen.nodes.empty() ? frozen_type::none : _Size(0),
+      _alloc);
 }
 
-//! Get the element at a specific index in the subtree.
+//! Construct a tree holding the elements of a range, in order, in O(N).
 /*!
- * Get (a const reference to) the element at a specific index.
+ * For a sorted tree, the range must be sorted.
+ * Merges are not tried.
  *
- * \param node root of the subtree, which must not be null
- * \param node index to get the element of, in range [0, size of tree)
- * \return (a const reference to) the element at that index
- * \exception std::out_of_range If the requested index is outside the range [0, size of subtree)
+ * \param first iterator to the first element
+ * \param last iterator to one past the last element
+ * \sa assign
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate>
-const _Element&
-avl_node_get_at_index(
-    const avl_node<_Element, _Size, _Range_Type_Intermediate> *node, _Size index) {
-  if (node == nullptr) [[unlikely]] {
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Iterator>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::avl_tree(_Iterator first, _Iterator last)
+    : root(nullptr) {
+  check_capacity();
+  assign(first, last);
+}
+
+//! Check that the node layout can link as many nodes as the allocator's arena holds.
+/*!
+ * Only layouts with a limit, such as the relative layouts, are checked,
+ * and they need an allocator which says its capacity, such as contiguous_arena_allocator.
+ *
+ * \exception std::length_error If the arena can hold more nodes than the layout can link
+ * \sa layout_max_nodes
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::check_capacity() const {
+  constexpr std::size_t max_nodes = layout_max_nodes<_Layout>::value;
+  if constexpr (max_nodes < std::numeric_limits<std::size_t>::max()) {
+    if (_alloc.capacity() > max_nodes) [[unlikely]] {
+      throw std::length_error(
+          "AVL tree construction was given an arena which can hold more nodes "
+          "than the node layout can link.");
+    }
+  }
+}
+
+//! Destroy the tree and all of its elements.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::~avl_tree() {
+  clear();
+}
+
+//! Remove all elements from the tree.
+/*!
+ * With an allocator that can release in bulk, such as the default pool allocator,
+ * all memory is given back at once, and if the elements are trivially destructible,
+ * no nodes are visited at all.
+ * If a compaction is in progress and the new allocator is shared, such as with a node handle,
+ * the nodes are destroyed without giving their memory to the new allocator,
+ * since some of them belong to the old one.
+ *
+ * \sa avl_node_destroy_all
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::clear() {
+  if constexpr (can_release_in_bulk<_Alloc>::value) {
+    if (compaction != nullptr && !_alloc.unshared()) {
+      // the new allocator cannot release in bulk, and nodes of the old one
+      // must not go on its free list, so the nodes are only destroyed
+      node_dropper<_Alloc> dropper(_alloc);
+      avl_node_destroy(root, dropper);
+      root = nullptr;
+    }
+  }
+  avl_node_destroy_all(root, _alloc);
+  root = nullptr;
+  // any nodes in the old allocator of a compaction were destroyed too
+  compaction.reset();
+  if constexpr (_Inline_Capacity > 0) inline_elements.clear();
+}
+
+//! Replace the elements of the tree with the elements of a range, in order, in O(N).
+/*!
+ * Instead of inserting the elements one at a time, which takes O(N log N) time,
+ * builds a perfectly balanced tree directly, setting the sizes, balance factors and
+ * range intermediate values bottom up.
+ * Elements are constructed in their nodes straight from the range,
+ * so a range of std::move_iterator moves them instead of copying them.
+ * For a sorted tree, the range must be sorted.
+ * If the range is small enough for inline storage, the elements are kept inline instead.
+ *
+ * Without merging, the range is read once if its length is known in advance
+ * (it has forward iterators). With merging, or for input iterators,
+ * the nodes are first chained together and then relinked, which visits them twice.
+ *
+ * \param first iterator to the first element
+ * \param last iterator to one past the last element
+ * \param merge whether to try merging each element into the element before it
+ * \sa avl_node_build
+ * \sa avl_node_build_merged
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Iterator>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::assign(_Iterator first, _Iterator last, bool merge) {
+  clear();
+  constexpr bool sized = std::is_base_of<
+      std::forward_iterator_tag,
+      typename std::iterator_traits<_Iterator>::iterator_category>::value;
+  if constexpr (sized) {
+    std::size_t count = std::size_t(std::distance(first, last));
+    if constexpr (_Inline_Capacity > 0) {
+      if (count <= _Inline_Capacity) {
+        for (; first != last; ++first) {
+          if (merge) {
+            emplace(size(), *first);
+          } else {
+            inline_elements.emplace_back(*first);
+          }
+        }
+        return;
+      }
+    }
+    if (!merge) {
+      root = avl_node_build<node_type>(first, _Size(count), _rpre, _rcomb, _alloc);
+      return;
+    }
+  }
+  if (merge) {
+    root = avl_node_build_merged<node_type>(first, last, _merge, _rpre, _rcomb,
+                                            _alloc);
+  } else {
+    root = avl_node_build_merged<node_type>(first, last, no_merge<_Element>(),
+                                            _rpre, _rcomb, _alloc);
+  }
+}
+
+//! Make nodes holding the inline elements, without merging them.
+/*!
+ * \param alloc allocator object for the nodes
+ * \return the root of the new tree
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+typename avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::node_type *
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::make_nodes(_Alloc &alloc) const {
+  node_type *nodes = nullptr;
+  if constexpr (_Inline_Capacity > 0) {
+    for (std::size_t i = 0; i < inline_elements.size(); ++i) {
+      nodes = avl_node_insert_at_index(nodes, _Size(i), inline_elements[i],
+                                       no_merge<_Element>(), _rpre, _rcomb,
+                                       alloc)
+                  .first;
+    }
+  }
+  return nodes;
+}
+
+//! Move the elements from inline storage into nodes, for when the tree grows too large.
+/*!
+ * The nodes are built as a perfectly balanced tree in O(k) time.
+ * Elements are moved if that can not throw, and otherwise copied,
+ * so if building throws, the inline elements are left as they were.
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::move_to_nodes() {
+  if constexpr (_Inline_Capacity > 0) {
+    if (inline_elements.size() == 0) return;
+    _Element *elements = &inline_elements[0];
+    _Size count = _Size(inline_elements.size());
+    if constexpr (std::is_nothrow_move_constructible<_Element>::value ||
+                  !std::is_copy_constructible<_Element>::value) {
+      // the same choice as std::move_if_noexcept
+      auto first = std::make_move_iterator(elements);
+      root = avl_node_build<node_type>(first, count, _rpre, _rcomb, _alloc);
+    } else {
+      const _Element *first = elements;
+      root = avl_node_build<node_type>(first, count, _rpre, _rcomb, _alloc);
+    }
+    inline_elements.clear();
+  }
+}
+
+//! Get the number of elements in the tree.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge,
+                     _Range_Preprocess, _Range_Type_Intermediate,
+                     _Range_Combine, _Range_Postprocess, _Layout, _Alloc, _Inline_Capacity>::size() const {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) return inline_elements.size();
+  }
+  return std::size_t(avl_node_size(root));
+}
+
+//! Get the element at an index.
+/*!
+ * \param index the index, in range [0, size)
+ * \return the element at that index
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+_Element avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::get_item(std::size_t index) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      if (!(index < inline_elements.size())) [[unlikely]] {
+        throw std::out_of_range(
+            "AVL tree operation get item tried to get outside of the range "
+            "of valid indices for this tree.");
+      }
+      return inline_elements[index];
+    }
+  }
+  return avl_node_get_at_index(
+      static_cast<const node_type *>(root),
+      _Size(index));
+}
+
+//! Get the result of the range query over the index range [begin, end).
+/*!
+ * \param begin the first index in the range
+ * \param end one past the last index in the range
+ * \return the postprocessed result of the range query
+ * \exception std::out_of_range If the range is empty or not within [0, size)
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+typename std::decay<typename std::invoke_result<
+    _Range_Postprocess, _Range_Type_Intermediate>::type>::type
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::get_range(std::size_t begin, std::size_t end) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      if (!(begin < end) || inline_elements.size() < end) [[unlikely]] {
+        throw std::out_of_range(
+            "AVL tree operation get range was given an empty range or a range "
+            "which is outside of the range of valid indices for this tree.");
+      }
+      _Range_Type_Intermediate result = _rpre(inline_elements[begin]);
+      for (std::size_t i = begin + 1; i < end; ++i) {
+        result = _rcomb(result, _rpre(inline_elements[i]));
+      }
+      return _rpost(result);
+    }
+  }
+  return _rpost(avl_node_get_range(
+      static_cast<const node_type *>(root),
+      _Size(begin), _Size(end), _rpre, _rcomb));
+}
+
+//! Insert an element just before the given index.
+/*!
+ * The element is copied once, into its node.
+ *
+ * \param index the index to insert at, in range [0, size]
+ * \param value the element to insert
+ * \exception std::out_of_range If the index is outside the range [0, size]
+ * \sa avl_node_insert_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::insert(std::size_t index, const _Element &value) {
+  insert_element(index, value);
+}
+
+//! Insert an element just before the given index, moving it in.
+/*!
+ * The element is moved once, into its node, so move-only elements work.
+ *
+ * \param index the index to insert at, in range [0, size]
+ * \param value the element to insert
+ * \exception std::out_of_range If the index is outside the range [0, size]
+ * \sa avl_node_insert_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::insert(std::size_t index, _Element &&value) {
+  insert_element(index, std::move(value));
+}
+
+//! Put a new element into the inline storage, merging it into a neighbour where possible.
+/*!
+ * The element is constructed at the end of the inline storage and moved to its place.
+ * The neighbours are the elements a tree would pass on the way down,
+ * so a merge into the element before it is tried first, then into the element after it,
+ * and if either works, the new element is destroyed again.
+ * If the inline storage is full, the tree switches to nodes instead,
+ * without using the arguments, so that the caller can insert them into the nodes.
+ * Only for trees with no nodes.
+ *
+ * \tparam _Ordered whether to put the element after all elements less than it, instead of at the index
+ * \param index the index to insert at, in range [0, size], unless ordered
+ * \param args the arguments for the element's constructor
+ * \return the index of the new element, or of the element it merged into, or nothing if the tree switched to nodes
+ * \exception std::out_of_range If the index is outside the range [0, size], in which case nothing is changed
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <bool _Ordered, typename... _Args>
+std::optional<std::size_t>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::insert_inline(std::size_t index, _Args &&... args) {
+  if (!_Ordered && inline_elements.size() < index) [[unlikely]] {
     throw std::out_of_range(
-      "AVL tree operation get at index tried to get from an empty "
-      "subtree. This happens when the index is outside of the range of "
-      "valid indices for this tree.");
+        "AVL tree operation insert at index tried to insert before the "
+        "first valid index or after the last valid index.");
   }
-  _Size left_size = avl_node_size(node->left);
-  if (index == left_size) {
-    // at this node
-    return node->value;
-  } else if (index < left_size) {
-    // on the left
-    return avl_node_get_at_index(node->left, index);
+  if (inline_elements.full()) {
+    // grown too large, so switch to nodes
+    move_to_nodes();
+    return std::nullopt;
+  }
+  const _Element &value = inline_elements.emplace_back(std::forward<_Args>(args)...);
+  if constexpr (_Ordered) {
+    index = 0;
+    while (index + 1 < inline_elements.size() && _less(inline_elements[index], value)) {
+      ++index;
+    }
+  }
+  inline_elements.move_back_to(index);
+  if (index > 0 && _merge(inline_elements[index - 1], inline_elements[index])) {
+    inline_elements.erase(index);
+    return index - 1;
+  }
+  if (index + 1 < inline_elements.size() &&
+      _merge(inline_elements[index + 1], inline_elements[index])) {
+    inline_elements.erase(index);
+  }
+  return index;
+}
+
+//! Insert an element just before the given index, passing it by reference all the way to its node.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Value>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::insert_element(std::size_t index, _Value &&value) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr &&
+        insert_inline<false>(index, std::forward<_Value>(value))) {
+      return;
+    }
+  }
+  _Size old_size = avl_node_size(root);
+  root = avl_node_insert_at_index(root, _Size(index), std::forward<_Value>(value),
+                                  _merge, _rpre, _rcomb, _alloc)
+             .first;
+  if (compaction != nullptr && index < compaction->next &&
+      old_size < avl_node_size(root)) {
+    // the new node is in the new allocator, and the moved nodes shift right
+    ++compaction->next;
+  }
+}
+
+//! Construct an element in place just before the given index.
+/*!
+ * The element is constructed from the arguments directly in its node,
+ * or in the inline storage, and its range intermediate value is computed there,
+ * so it is never copied or moved.
+ * Merges are tried with the constructed element, as for insert,
+ * and if it merges, it is destroyed again and no node is kept.
+ *
+ * \param index the index to insert at, in range [0, size]
+ * \param args the arguments for the element's constructor
+ * \exception std::out_of_range If the index is outside the range [0, size]
+ * \sa avl_node_link_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename... _Args>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::emplace(std::size_t index, _Args &&... args) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr &&
+        insert_inline<false>(index, std::forward<_Args>(args)...)) {
+      return;
+    }
+  }
+  _Size old_size = avl_node_size(root);
+  if (std::size_t(old_size) < index) [[unlikely]] {
+    throw std::out_of_range(
+        "AVL tree operation insert at index tried to insert before the "
+        "first valid index or after the last valid index.");
+  }
+  node_type *lone = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+  try {
+    std::allocator_traits<_Alloc>::construct(_alloc, lone, std::in_place, _rpre,
+                                             std::forward<_Args>(args)...);
+  } catch (...) {
+    std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+    throw;
+  }
+  link_lone<false>(lone, index);
+}
+
+//! Construct an element in place, and insert it just after all elements that are less than it.
+/*!
+ * For sorted trees. The element is constructed from the arguments directly in its node,
+ * or in the inline storage, and its range intermediate value is computed there,
+ * so it is never copied or moved.
+ * Merges are tried with the constructed element on the way down,
+ * and if it merges, it is destroyed again and no node is kept.
+ *
+ * \param args the arguments for the element's constructor
+ * \return the index of the new element, or if it merged, the index of the element it merged into
+ * \sa avl_node_link_ordered
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename... _Args>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+            _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+            _Layout, _Alloc, _Inline_Capacity>::emplace_ordered(_Args &&... args) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      if (auto index = insert_inline<true>(0, std::forward<_Args>(args)...)) {
+        return *index;
+      }
+    }
+  }
+  node_type *lone = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+  try {
+    std::allocator_traits<_Alloc>::construct(_alloc, lone, std::in_place, _rpre,
+                                             std::forward<_Args>(args)...);
+  } catch (...) {
+    std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+    throw;
+  }
+  return link_lone<true>(lone, 0);
+}
+
+//! Link a lone node of this tree's allocator into the tree, at an index or in sorted order.
+/*!
+ * The node is owned by the tree from the start: if linking throws or the element merges,
+ * the node is destroyed and deallocated.
+ * While a compaction is in progress, a node linked before the next node to move
+ * shifts the nodes still to move one to the right, which is kept track of here.
+ *
+ * \tparam _Ordered whether to link the node just after all elements less than its element,
+ * instead of at the index
+ * \param lone the node, with its range intermediate value computed, and no children
+ * \param index the index to link the node at, in range [0, size], ignored if ordered
+ * \return the index of the linked node, or if it merged, the index of the element it merged into,
+ * which is only known if ordered
+ * \sa avl_node_link_at_index
+ * \sa avl_node_link_ordered
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <bool _Ordered>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+            _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+            _Layout, _Alloc, _Inline_Capacity>::link_lone(node_type *lone, std::size_t index) {
+  _Size old_size = avl_node_size(root);
+  try {
+    if constexpr (_Ordered) {
+      auto result = avl_node_link_ordered(root, lone, _less, _merge, _rpre, _rcomb);
+      root = std::get<0>(result);
+      index = std::size_t(std::get<2>(result));
+    } else {
+      root = avl_node_link_at_index(root, _Size(index), lone, _merge, _rpre, _rcomb)
+                 .first;
+    }
+  } catch (...) {
+    std::allocator_traits<_Alloc>::destroy(_alloc, lone);
+    std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+    throw;
+  }
+  if (avl_node_size(root) == old_size) {
+    // merged, so the node is not needed
+    std::allocator_traits<_Alloc>::destroy(_alloc, lone);
+    std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+    return index;
+  }
+  if (compaction != nullptr && index < compaction->next) {
+    // the node is in the new allocator, and the moved nodes shift right
+    ++compaction->next;
+  }
+  return index;
+}
+
+//! Unlink the node at an index from the tree, keeping track of a compaction in progress.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+typename avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::node_type *
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::unlink_node(std::size_t index) {
+  auto result = avl_node_unlink_at_index(root, _Size(index), _rpre, _rcomb);
+  root = std::get<0>(result);
+  if (compaction != nullptr && index < compaction->next) --compaction->next;
+  return std::get<2>(result);
+}
+
+//! Destroy a node which has been unlinked from the tree, and give back its memory.
+/*!
+ * During a compaction, the node may belong to the old allocator,
+ * so it is only destroyed, and its memory goes back with the rest of the old memory.
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::drop_node(node_type *node) {
+  if (compaction != nullptr) {
+    node_dropper<_Alloc> dropper(_alloc);
+    std::allocator_traits<node_dropper<_Alloc>>::destroy(dropper, node);
+    std::allocator_traits<node_dropper<_Alloc>>::deallocate(dropper, node, 1);
+    return;
+  }
+  std::allocator_traits<_Alloc>::destroy(_alloc, node);
+  std::allocator_traits<_Alloc>::deallocate(_alloc, node, 1);
+}
+
+//! Remove the element at an index, and return it.
+/*!
+ * The element is moved out of the tree exactly once, and no other element is moved,
+ * since a removed node with two children is replaced by relinking its successor.
+ *
+ * \param index the index to remove at, in range [0, size)
+ * \return the removed element
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ * \sa avl_node_unlink_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+_Element avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::remove(std::size_t index) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      if (!(index < inline_elements.size())) [[unlikely]] {
+        throw std::out_of_range(
+            "AVL tree operation remove at index tried to remove outside of "
+            "the range of valid indices for this tree.");
+      }
+      return inline_elements.remove(index);
+    }
+  }
+  node_type *removed = unlink_node(index);
+  if (compaction != nullptr) {
+    node_dropper<_Alloc> dropper(_alloc);
+    return avl_node_take_element(removed, dropper);
+  }
+  return avl_node_take_element(removed, _alloc);
+}
+
+//! Remove the element at an index, without returning it.
+/*!
+ * Like remove, but the element is destroyed in place, so it is not even moved.
+ *
+ * \param index the index to remove at, in range [0, size)
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ * \sa avl_node_unlink_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+              _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+              _Layout, _Alloc, _Inline_Capacity>::erase(std::size_t index) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      if (!(index < inline_elements.size())) [[unlikely]] {
+        throw std::out_of_range(
+            "AVL tree operation remove at index tried to remove outside of "
+            "the range of valid indices for this tree.");
+      }
+      inline_elements.erase(index);
+      return;
+    }
+  }
+  drop_node(unlink_node(index));
+}
+
+//! Take the node at an index out of the tree, and return a handle which owns it.
+/*!
+ * The node is unlinked without copying or moving any element,
+ * and can be inserted into any tree with the same node handle type.
+ * Elements of a tree in inline mode, and during a compaction,
+ * elements which may still be in the old allocator, are moved into a new node instead.
+ *
+ * \param index the index to extract at, in range [0, size)
+ * \return a handle which owns the node
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ * \sa avl_node_handle
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+typename avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::node_handle
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::extract(std::size_t index) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      if (!(index < inline_elements.size())) [[unlikely]] {
+        throw std::out_of_range(
+            "AVL tree operation remove at index tried to remove outside of "
+            "the range of valid indices for this tree.");
+      }
+      // the element gets a node of its own
+      node_type *lone = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+      try {
+        std::allocator_traits<_Alloc>::construct(
+            _alloc, lone, std::in_place, _rpre, std::move(inline_elements[index]));
+      } catch (...) {
+        std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+        throw;
+      }
+      inline_elements.erase(index);
+      return node_handle(lone, _alloc);
+    }
+  }
+  if (compaction != nullptr && !(index < compaction->next)) {
+    // the node may belong to the old allocator, so the element moves to a new node
+    if (!(index < std::size_t(avl_node_size(root)))) [[unlikely]] {
+      throw std::out_of_range(
+          "AVL tree operation remove at index tried to remove outside of "
+          "the range of valid indices for this tree.");
+    }
+    node_type *lone = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+    node_dropper<_Alloc> dropper(_alloc);
+    try {
+      std::allocator_traits<_Alloc>::construct(
+          _alloc, lone, std::in_place, _rpre,
+          avl_node_take_element(unlink_node(index), dropper));
+    } catch (...) {
+      std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+      throw;
+    }
+    return node_handle(lone, _alloc);
+  }
+  return node_handle(unlink_node(index), _alloc);
+}
+
+//! Take 1 node with an element equivalent to a value out of the tree, if there is one.
+/*!
+ * Assumes the elements are in sorted order.
+ * If there are several, takes the first of them.
+ *
+ * \param value the value to search for
+ * \return a handle which owns the node, or an empty handle if there is no equivalent element
+ * \sa extract
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+typename avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::node_handle
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::extract_ordered(const _Element &value) {
+  auto lower = search_lower(value);
+  return lower.second ? extract(lower.first) : node_handle();
+}
+
+//! The same as extract_ordered, for keys of other types, if the less than function is transparent.
+/*!
+ * \sa is_transparent_compare
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+typename avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::node_handle
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::extract_ordered(const _Key &value) {
+  auto lower = search_lower(value);
+  return lower.second ? extract(lower.first) : node_handle();
+}
+
+//! Insert the node owned by a handle just before the given index.
+/*!
+ * If the handle's allocator compares equal to this tree's allocator,
+ * the node is linked in as it is, with no allocation, and the element is not copied or moved.
+ * Otherwise, or if this tree is in inline mode, the element is moved into a new node,
+ * as by emplace.
+ * Merges are tried as for insert, and if the element merges, the node is destroyed.
+ * Either way, the handle is left empty, unless it was empty already, in which case nothing happens.
+ *
+ * \param index the index to insert at, in range [0, size]
+ * \param handle the handle, such as one made by extract on another tree
+ * \exception std::out_of_range If the index is outside the range [0, size]
+ * \sa avl_node_link_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::insert(std::size_t index, node_handle &&handle) {
+  if (handle.empty()) return;
+  bool own_node = true;
+  if constexpr (_Inline_Capacity > 0) own_node = root != nullptr;
+  if (!own_node || !(*handle._alloc == _alloc)) {
+    emplace(index, std::move(handle.value()));
+    handle.reset();
+    return;
+  }
+  _Size old_size = avl_node_size(root);
+  if (std::size_t(old_size) < index) [[unlikely]] {
+    throw std::out_of_range(
+        "AVL tree operation insert at index tried to insert before the "
+        "first valid index or after the last valid index.");
+  }
+  // equal allocators can free each other's nodes, so the node is now this tree's
+  link_lone<false>(handle.release(_rpre, _rcomb), index);
+}
+
+//! Insert the node owned by a handle just after all elements that are less than its element.
+/*!
+ * For sorted trees. The node is linked in without allocating in the same cases as for insert,
+ * and otherwise the element is moved into a new node, as by emplace_ordered.
+ * The handle is left empty, unless it was empty already, in which case nothing happens.
+ *
+ * \param handle the handle, such as one made by extract_ordered on another tree
+ * \return the index of the inserted element, or if it merged, the index of the element it merged into,
+ * or the size of the tree if the handle was empty
+ * \sa avl_node_link_ordered
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::insert_ordered(node_handle &&handle) {
+  if (handle.empty()) return size();
+  bool own_node = true;
+  if constexpr (_Inline_Capacity > 0) own_node = root != nullptr;
+  if (!own_node || !(*handle._alloc == _alloc)) {
+    std::size_t index = emplace_ordered(std::move(handle.value()));
+    handle.reset();
+    return index;
+  }
+  // equal allocators can free each other's nodes, so the node is now this tree's
+  return link_lone<true>(handle.release(_rpre, _rcomb), 0);
+}
+
+//! Take all elements of another tree as nodes which this tree's allocator can free, leaving the other tree empty.
+/*!
+ * If the other tree has no inline elements or compaction in progress,
+ * and its allocator compares equal to this tree's allocator, or this tree's allocator can absorb it,
+ * its nodes are taken as they are.
+ * Otherwise its elements are moved out and built into new nodes.
+ *
+ * \param other the other tree
+ * \return the root of the nodes
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+typename avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::node_type *
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::adopt_nodes(avl_tree &other) {
+  bool own_nodes = other.root != nullptr && other.compaction == nullptr;
+  if constexpr (can_absorb<_Alloc>::value) {
+    // an unshared pool, such as a default constructed tree's, is spliced into this one
+    if (own_nodes && !(other._alloc == _alloc)) own_nodes = _alloc.absorb(other._alloc);
   } else {
-    // on the right
-    return avl_node_get_at_index(node->left, index - (left_size + _Size(1)));
+    own_nodes = own_nodes && other._alloc == _alloc;
+  }
+  if (own_nodes) {
+    node_type *nodes = other.root;
+    other.root = nullptr;
+    return nodes;
   }
+  std::vector<_Element> elements;
+  elements.reserve(other.size());
+  while (other.size() > 0) elements.push_back(other.remove(other.size() - 1));
+  other.clear();
+  auto first = std::make_move_iterator(elements.rbegin());
+  return avl_node_build<node_type>(first, _Size(elements.size()), _rpre,
+                                   _rcomb, _alloc);
 }
 
-//! Insert an element just before the given index in the subtree.
-/**
- * Inserts the new element just at the given index.
- * To be specific, if there is some element already at that index,
- * then the new element will be directly before that other element.
- * To insert after the current last element, use (the size of the subtree)
- * as the index.
+//! Move all elements of another tree to the end of this tree, leaving the other tree empty.
+/*!
+ * Concatenates the trees by joining them with avl_node_join,
+ * which takes O(log N) time and does not allocate, copy or move anything,
+ * as long as the other tree's allocator compares equal to this tree's allocator
+ * (see allocator_type), or this tree's allocator can absorb it,
+ * as pool_allocator can if no other allocator shares the other tree's pool,
+ * such as when both trees were default constructed.
+ * Otherwise, or if the other tree is in inline mode or being compacted,
+ * its elements are moved into new nodes first, which takes O(M log M) time.
+ * Merges are not tried.
  *
- * The size of the subtree increases, unless a merge occurs,
- * in which case the size of the subtree stays the same.
+ * \param other the tree to take the elements of, which must not be this tree
+ * \sa avl_node_join
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::join(avl_tree &other) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) move_to_nodes();
+  }
+  node_type *right = adopt_nodes(other);
+  root = avl_node_join(root, right, _rpre, _rcomb);
+}
+
+//! Move all elements of another tree to the end of this tree, with a new element in between.
+/*!
+ * The same as join without the element, except that the new element's node
+ * joins the trees, so no node needs to be unlinked from this tree first.
+ * The new element is constructed from the value directly in its node.
  *
- * \param node the root of the subtree
- * \param index the index to insert at
- * \param value the value to be inserted at that index
- * \param _merge merge function
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \param _alloc allocator object
- * \return tuple: (new subtree root, whether it got taller)
- * \sa avl_tree
- * \exception std::out_of_range If the requested insertion index is outside the range [0, size of subtree + 1)
+ * \param pivot the element to put between the elements of the 2 trees
+ * \param other the tree to take the elements of, which must not be this tree
+ * \sa avl_node_join
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Value>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::join(_Value &&pivot, avl_tree &other) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) move_to_nodes();
+  }
+  node_type *lone = std::allocator_traits<_Alloc>::allocate(_alloc, 1);
+  try {
+    std::allocator_traits<_Alloc>::construct(_alloc, lone, std::in_place, _rpre,
+                                             std::forward<_Value>(pivot));
+  } catch (...) {
+    std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+    throw;
+  }
+  node_type *right;
+  try {
+    right = adopt_nodes(other);
+  } catch (...) {
+    std::allocator_traits<_Alloc>::destroy(_alloc, lone);
+    std::allocator_traits<_Alloc>::deallocate(_alloc, lone, 1);
+    throw;
+  }
+  root = avl_node_join(root, lone, right, _rpre, _rcomb);
+}
+
+//! Move the elements from an index on into another tree, replacing its elements.
+/*!
+ * Splits the tree in 2 with avl_node_split_at_index, keeping the elements before the index,
+ * which takes O(log N) time and does not allocate, copy or move anything.
+ * The other tree is emptied first, and if its allocator does not compare equal to this tree's,
+ * it is given a copy of this tree's allocator, so that the moved nodes can be freed by it.
+ * The trees then share their memory, and the allocator is no more thread safe than the tree,
+ * so they must not be changed from different threads at the same time,
+ * and compact refuses to work on either of them while they share it.
+ * To hand the elements to another thread instead, use split_at_detached.
+ * If the allocator can not be assigned, such as std::pmr::polymorphic_allocator,
+ * the trees are split as with split_at_detached.
+ * If this tree is in inline mode or being compacted,
+ * the elements from the index on are moved out one at a time instead,
+ * which takes O(M log N) time for M elements moved.
+ *
+ * \param index the index of the first element to move, which may be the size of the tree
+ * \param other the tree to move the elements into, which must not be this tree
+ * \exception std::out_of_range If the index is more than the size of the tree, in which case nothing is changed
+ * \sa avl_node_split_at_index
+ * \sa split_at_detached
+ * \sa join
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::split_at(std::size_t index, avl_tree &other) {
+  if (size() < index) [[unlikely]] {
+    throw std::out_of_range(
+        "AVL tree operation split at index tried to split outside of the "
+        "range of valid indices for this tree.");
+  }
+  other.clear();
+  if constexpr (std::is_copy_assignable<_Alloc>::value) {
+    // the other tree is empty, so it can give up its allocator for this one
+    if (root != nullptr && compaction == nullptr && !(other._alloc == _alloc)) {
+      other._alloc = _alloc;
+    }
+  }
+  split_into(index, other);
+}
+
+//! Move the elements from an index on into another tree, which keeps its own allocator.
+/*!
+ * The same as split_at, except that the other tree's allocator is never replaced,
+ * so that the other tree can be handed to another thread.
+ * The tree is still split in O(log N), and then, unless the other tree's allocator
+ * compares equal to this tree's, the elements from the index on are moved
+ * into new nodes of the other tree's allocator, and their old nodes are given back,
+ * which takes O(M + log N) time and M allocations for M elements moved.
+ *
+ * \param index the index of the first element to move, which may be the size of the tree
+ * \param other the tree to move the elements into, which must not be this tree
+ * \exception std::out_of_range If the index is more than the size of the tree, in which case nothing is changed
+ * \sa split_at
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::split_at_detached(std::size_t index,
+                                                               avl_tree &other) {
+  if (size() < index) [[unlikely]] {
+    throw std::out_of_range(
+        "AVL tree operation split at index tried to split outside of the "
+        "range of valid indices for this tree.");
+  }
+  other.clear();
+  split_into(index, other);
+}
+
+//! Move the elements from a valid index on into another, empty tree, with whichever allocator it has.
+/*!
+ * Reuses the nodes if the allocators compare equal, and otherwise moves the elements
+ * into new nodes of the other tree's allocator.
+ *
+ * \param index the index of the first element to move, which may be the size of the tree
+ * \param other the empty tree to move the elements into
+ * \sa split_at
+ * \sa split_at_detached
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::split_into(std::size_t index, avl_tree &other) {
+  std::vector<_Element> elements;
+  if (root != nullptr && compaction == nullptr) {
+    bool same_alloc = other._alloc == _alloc;
+    // made before anything changes, so that running out of memory changes nothing
+    if (!same_alloc) elements.reserve(size() - index);
+    auto parts = avl_node_split_at_index(root, _Size(index), _rpre, _rcomb);
+    root = parts.first;
+    if (same_alloc) {
+      other.root = parts.second;
+      return;
+    }
+    avl_node_take_elements(
+        parts.second, [&](_Element &&value) { elements.push_back(std::move(value)); },
+        _alloc);
+    other.assign(std::make_move_iterator(elements.begin()),
+                 std::make_move_iterator(elements.end()));
+    return;
+  }
+  elements.reserve(size() - index);
+  while (size() > index) elements.push_back(remove(size() - 1));
+  other.assign(std::make_move_iterator(elements.rbegin()),
+               std::make_move_iterator(elements.rend()));
+}
+
+//! Insert a sorted range of elements into a sorted tree.
+/*!
+ * Assumes the elements of the tree and of the range are in sorted order.
+ * The range is first built into nodes in O(M), merging each element into the one before it where possible,
+ * and then the nodes are inserted all together with avl_node_insert_sorted_batch,
+ * which only visits the paths to where they go, and merges and rebuilds the subtrees
+ * which get many of them compared to their size, in O(M log(N / M + 1)) time, and O(M + N) at most.
+ * For batches which are dense compared to the tree, this is much faster than inserting
+ * the elements one at a time, which takes O(M log N), with a new search from the root for each.
+ * A batch which is sparse compared to a large tree can be a little slower than that.
+ * Elements which are equivalent to an element of the tree are tried as merges into it,
+ * and otherwise go after it, keeping their order, as with std::multiset::insert.
+ * If building the nodes or making room to sort them fails, the exception is passed on
+ * and the tree is left as it was.
+ * The less than and merge functions must not throw.
+ * While a compaction is in progress, the elements are inserted one at a time instead,
+ * each after all elements not greater than it.
+ *
+ * \param first iterator to the first element
+ * \param last iterator to one past the last element
+ * \sa avl_node_build_merged
+ * \sa avl_node_insert_sorted_batch
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
-          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
-          typename _Alloc>
-std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate> *, bool>
-avl_node_insert_at_index(
-    avl_node<_Element, _Size, _Range_Type_Intermediate> *node, _Size index,
-    _Element value, const _Merge &_merge, const _Range_Preprocess &_rpre,
-    const _Range_Combine &_rcomb, _Alloc _alloc) {
-  // empty node special case
-  if (node == nullptr) {
-    // only valid index for empty tree is 0
-    if (index != _Size(0)) [[unlikely]] {
-      throw std::out_of_range(
-        "AVL tree operation insert at index tried to insert before the"
-        "first valid index or after the last valid index.");
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Iterator>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::insert_sorted_batch(_Iterator first, _Iterator last) {
+  if (compaction != nullptr) {
+    for (; first != last; ++first) {
+      auto &&value = *first;
+      emplace(search_upper(value), std::forward<decltype(value)>(value));
     }
-    node = _alloc.allocate(1);
-    _alloc.construct(node, value, _rpre(value));
-    return std::make_pair(node, true);
+    return;
   }
-  // attempt merge
-  if (_merge(node->value, value)) {
-    return std::make_pair(node, true);
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) move_to_nodes();
   }
-  // do regular insert
-  _Size left_size = avl_node_size(node->left);
-  if (index <= left_size) {
-    auto partial = avl_node_insert_at_index(node->left, index, value, _merge,
-                                            _rpre, _rcomb, _alloc);
-    node->left = partial.first;
-    bool taller = partial.second;
-    node->balance -= taller;
-    if (!taller || node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_pair(node, false);
-    } else if (node->balance == -1) {
-      node->update(_rpre, _rcomb);
-      return std::make_pair(node, true);
-    }
-    return std::make_pair(node->rebalance_left_heavy(_rpre, _rcomb), false);
-  } else {
-    auto partial = avl_node_insert_at_index(
-        node->right, index - (avl_node_size(node->left) + _Size(1)), value,
-        _merge, _rpre, _rcomb, _alloc);
-    node->right = partial.first;
-    bool taller = partial.second;
-    node->balance += taller;
-    if (!taller || node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_pair(node, false);
-    } else if (node->balance == 1) {
-      node->update(_rpre, _rcomb);
-      return std::make_pair(node, true);
-    }
-    return std::make_pair(node->rebalance_right_heavy(_rpre, _rcomb), false);
+  node_type *batch =
+      avl_node_build_merged<node_type>(first, last, _merge, _rpre, _rcomb, _alloc);
+  std::vector<node_type *> nodes;
+  try {
+    nodes.reserve(std::size_t(avl_node_size(batch)));
+  } catch (...) {
+    // nothing has been inserted yet, so the batch is still whole
+    avl_node_destroy(batch, _alloc);
+    throw;
   }
+  root = avl_node_insert_sorted_batch(root, batch, nodes, _less, _merge, _rpre, _rcomb, _alloc);
 }
 
-//! Insert a new element in the subtree just after all elements that are less than it.
+//! Replace the elements of the tree with the result of a set operation with another tree.
 /*!
- * Insert a new element in the subtree just after all elements that are less than it.
- * As currently implemented, elements which are equivalent or incomparable are considered
- * greater than the new element being inserted
- * for purposes of determining where to insert,
- * though it is only required that the new value is inserted after all elements less than it
- * and before all elements greater than it.
- * It is required as a precondition that the subtree is already sorted in ascending order,
- * that is, for all pairs of elements, the left element is not greater than the right element.
+ * Takes the nodes of both trees, as join does, and combines them with avl_node_set_operation.
+ * The nodes left out of the result are destroyed afterwards, on the calling thread.
+ * If the less than or merge function throws, the exception is passed on,
+ * and both trees are left empty, with all their elements destroyed and deallocated.
  *
- * The size of the subtree increases, unless a merge occurs,
- * in which case the size of the subtree stays the same.
+ * \param other the other tree, which is left empty, and must not be this tree
+ * \param operation the set operation to do
+ * \param threads the most threads to use, including the current thread
+ * \sa avl_node_set_operation
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::combine(avl_tree &other, set_operation operation,
+                                      unsigned threads) {
+  // also takes this tree out of inline mode or a compaction, as the nodes get mixed up
+  root = adopt_nodes(*this);
+  node_type *second = adopt_nodes(other);
+  node_type *dropped = nullptr;
+  try {
+    root = avl_node_set_operation(root, second, operation, _less, _merge, _rpre, _rcomb,
+                                  std::max(threads, 1u), dropped);
+  } catch (...) {
+    // every node is on the dropped list by now
+    root = nullptr;
+    avl_node_destroy_list(dropped, _alloc);
+    throw;
+  }
+  avl_node_destroy_list(dropped, _alloc);
+}
+
+//! Add the elements of another tree, merging equivalent elements where possible.
+/*!
+ * Assumes the elements of both trees are in sorted order.
+ * Elements of the other tree which are equivalent to an element of this tree
+ * are tried as merges into it, and are added after it if the merge fails.
+ * Takes O(M log(N / M + 1)) time for trees of sizes M <= N, split over up to the given number of threads.
  *
- * One of the return values is the insertion index,
- * which is the index of the newly inserted value,
- * or if it was merged, the index of the merged value.
+ * \param other the other tree, which is left empty, and must not be this tree
+ * \param threads the most threads to use, including the current thread,
+ * which is 1 by default, so that no function is called from another thread unless asked for
+ * \sa avl_node_set_operation
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::set_union(avl_tree &other, unsigned threads) {
+  combine(other, set_operation::set_union, threads);
+}
+
+//! Keep only the elements which are equivalent to an element of another tree.
+/*!
+ * Assumes the elements of both trees are in sorted order.
+ * Elements of the other tree which are equivalent to an element of this tree
+ * are tried as merges into it, and are discarded either way.
+ * Takes O(M log(N / M + 1)) time for trees of sizes M <= N, split over up to the given number of threads.
  *
- * \param node the root of the subtree
- * \param value the value to be inserted
- * \param _less less than function
- * \param _merge merge function
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \param _alloc allocator object
- * \return tuple: (new subtree root, whether it got taller, index of the inserted value)
- * \sa avl_tree
+ * \param other the other tree, which is left empty, and must not be this tree
+ * \param threads the most threads to use, including the current thread,
+ * which is 1 by default, so that no function is called from another thread unless asked for
+ * \sa avl_node_set_operation
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
-          typename _Compare, typename _Merge, typename _Range_Preprocess,
-          typename _Range_Combine, typename _Alloc>
-std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate> *, bool, _Size>
-avl_node_insert_ordered(
-    avl_node<_Element, _Size, _Range_Type_Intermediate> *node, _Element value,
-    const _Compare &_less, const _Merge &_merge, const _Range_Preprocess &_rpre,
-    const _Range_Combine &_rcomb, _Alloc _alloc) {
-  // empty node special case
-  if (node == nullptr) {
-    node = _alloc.allocate(1);
-    _alloc.construct(node, value, _rpre(value));
-    return std::make_tuple(node, true, 0);
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::set_intersection(avl_tree &other, unsigned threads) {
+  combine(other, set_operation::set_intersection, threads);
+}
+
+//! Remove the elements which are equivalent to an element of another tree.
+/*!
+ * Assumes the elements of both trees are in sorted order.
+ * Takes O(M log(N / M + 1)) time for trees of sizes M <= N, split over up to the given number of threads.
+ *
+ * \param other the other tree, which is left empty, and must not be this tree
+ * \param threads the most threads to use, including the current thread,
+ * which is 1 by default, so that no function is called from another thread unless asked for
+ * \sa avl_node_set_operation
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::set_difference(avl_tree &other, unsigned threads) {
+  combine(other, set_operation::set_difference, threads);
+}
+
+//! Keep only the elements of either tree which are not equivalent to an element of the other tree.
+/*!
+ * Assumes the elements of both trees are in sorted order.
+ * Equivalent elements within a tree are all kept or all removed together,
+ * so the result is the same whichever tree it is called on.
+ * Takes O(M log(N / M + 1)) time for trees of sizes M <= N, split over up to the given number of threads.
+ *
+ * \param other the other tree, which is left empty, and must not be this tree
+ * \param threads the most threads to use, including the current thread,
+ * which is 1 by default, so that no function is called from another thread unless asked for
+ * \sa avl_node_set_operation
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::set_symmetric_difference(avl_tree &other, unsigned threads) {
+  combine(other, set_operation::set_symmetric_difference, threads);
+}
+
+//! Replace the element at an index, and return the old element.
+/*!
+ * The new element is copied once, into the tree, and the old element is moved out.
+ *
+ * \param index the index to replace at, in range [0, size)
+ * \param value the new element
+ * \return the old element
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ * \sa avl_node_replace_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+_Element avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::replace(std::size_t index, const _Element &value) {
+  return replace_element(index, value);
+}
+
+//! Replace the element at an index, moving the new element in, and return the old element.
+/*!
+ * The new element is moved once, into the tree, and the old element is moved out,
+ * so move-only elements work.
+ *
+ * \param index the index to replace at, in range [0, size)
+ * \param value the new element
+ * \return the old element
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ * \sa avl_node_replace_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+_Element avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::replace(std::size_t index, _Element &&value) {
+  return replace_element(index, std::move(value));
+}
+
+//! Replace the element at an index, passing the new element by reference all the way into the tree.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Value>
+_Element avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::replace_element(std::size_t index, _Value &&value) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      if (!(index < inline_elements.size())) [[unlikely]] {
+        throw std::out_of_range(
+            "AVL tree operation replace at index tried to replace outside of "
+            "the range of valid indices for this tree.");
+      }
+      // there is space for the new element once the old one is out
+      _Element old_value = inline_elements.remove(index);
+      try {
+        insert_inline<false>(index, std::forward<_Value>(value));
+      } catch (...) {
+        inline_elements.emplace_back(std::move(old_value));
+        inline_elements.move_back_to(index);
+        throw;
+      }
+      return old_value;
+    }
   }
-  // attempt merge
-  if (_merge(node->value, value)) {
-    return std::make_tuple(node, false, 0);
+  if (compaction != nullptr) {
+    node_dropper<_Alloc> dropper(_alloc);
+    auto result = avl_node_replace_at_index(root, _Size(index), std::forward<_Value>(value),
+                                            _merge, _rpre, _rcomb, dropper);
+    root = std::get<0>(result);
+    // a merge removes the element at the index
+    if (std::get<1>(result) && index < compaction->next) --compaction->next;
+    return std::move(std::get<2>(result));
   }
-  // insert normally
-  if (!_less(node->value, value)) {
-    auto partial = avl_node_insert_ordered(node->left, value, _less, _merge,
-                                           _rpre, _rcomb, _alloc);
-    node->left = std::get<0>(partial);
-    bool taller = std::get<1>(partial);
-    _Size index = std::get<2>(partial);
-    node->balance -= taller;
-    if (!taller || node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, false, index);
-    } else if (node->balance == -1) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, true, index);
-    }
-    return std::make_tuple(node->rebalance_left_heavy(_rpre, _rcomb), false,
-                           index);
-  } else {
-    auto partial = avl_node_insert_ordered(node->right, value, _less, _merge,
-                                           _rpre, _rcomb, _alloc);
-    node->right = std::get<0>(partial);
-    bool taller = std::get<1>(partial);
-    _Size index = avl_node_size(node->left) + _Size(1) + std::get<2>(partial);
-    node->balance += taller;
-    if (!taller || node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, false, index);
-    } else if (node->balance == 1) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, true, index);
+  auto result = avl_node_replace_at_index(root, _Size(index), std::forward<_Value>(value),
+                                          _merge, _rpre, _rcomb, _alloc);
+  root = std::get<0>(result);
+  return std::move(std::get<2>(result));
+}
+
+
+//! Change the element at an index in place.
+/*!
+ * The modify function is given a reference to the element, and may change it however it likes.
+ * Range values are recomputed afterwards.
+ * Changing the element in a way that breaks the ordering of an ordered tree is not checked.
+ *
+ * \param index the index of the element, in range [0, size)
+ * \param _modify function which takes a reference to the element and changes it
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ * \sa avl_node_modify_at_index
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Modify>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::modify(std::size_t index, const _Modify &_modify) {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      if (!(index < inline_elements.size())) [[unlikely]] {
+        throw std::out_of_range(
+            "AVL tree operation modify at index tried to modify outside of "
+            "the range of valid indices for this tree.");
+      }
+      _modify(inline_elements[index]);
+      return;
     }
-    return std::make_tuple(node->rebalance_right_heavy(_rpre, _rcomb), false,
-                           index);
   }
+  avl_node_modify_at_index(root, _Size(index), _modify, _rpre, _rcomb);
 }
 
-//! Remove a node at a specific index in the subtree.
+//! Find the element covering a position, where range values are element weights.
 /*!
- * Remove an element at a specific index, and return the element that was removed.
+ * Only meaningful if the range intermediate value of an element is its weight,
+ * the number of positions it stands for, and the range combine function adds weights.
  *
- * \param node the root of the subtree
- * \param index the index of the element to remove
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \param _alloc allocator object
- * \return tuple: (new subtree root, whether it got shorter, the removed element)
- * \sa avl_tree
- * \exception std::out_of_range If the requested removal index is outside the range [0, size of subtree)
+ * \param position the position to find, in range [0, total weight)
+ * \return tuple: (index of the element, pointer to the element, position within the element)
+ * \exception std::out_of_range If the position is outside the range [0, total weight)
+ * \sa avl_node_find_weighted
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
-          typename _Range_Preprocess, typename _Range_Combine, typename _Alloc>
-std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate> *, bool,
-           _Element>
-avl_node_remove_at_index(
-    avl_node<_Element, _Size, _Range_Type_Intermediate> *node, _Size index,
-    const _Range_Preprocess &_rpre, const _Range_Combine &_rcomb,
-    _Alloc _alloc) {
-  if (node == nullptr) [[unlikely]] {
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+std::tuple<std::size_t, const _Element *, _Range_Type_Intermediate>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::find_weighted(_Range_Type_Intermediate position) const {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      for (std::size_t i = 0; i < inline_elements.size(); ++i) {
+        _Range_Type_Intermediate weight = _rpre(inline_elements[i]);
+        if (position < weight) {
+          return std::make_tuple(i, &inline_elements[i], position);
+        }
+        position = position - weight;
+      }
       throw std::out_of_range(
-          "AVL tree operation remove at index tried to remove from an empty "
-          "subtree. This happens when the index is outside of the range of "
-          "valid indices for this tree.");
+          "AVL tree operation find weighted tried to find a position which is "
+          "outside of the total weight of this tree.");
     }
-  _Size left_size = avl_node_size(node->left);
-  if (index == left_size) {
-    // we must delete this node
-    _Element result = node->value;
-    if (node->left == nullptr && node->right == nullptr) {
-      _alloc.destroy(node);
-      _alloc.deallocate(node, 1);
-      return std::make_tuple(nullptr, true, result);
-    }
-    if (node->left == nullptr) {
-      auto child = node->right;
-      _alloc.destroy(node);
-      _alloc.deallocate(node, 1);
-      return std::make_tuple(child, true, result);
-    }
-    if (node->right == nullptr) {
-      auto child = node->left;
-      _alloc.destroy(node);
-      _alloc.deallocate(node, 1);
-      return std::make_tuple(child, true, result);
-    }
-    auto partial =
-        avl_node_remove_at_index(node->right, 0, _rpre, _rcomb, _alloc);
-    node->right = std::get<0>(partial);
-    bool shorter = std::get<1>(partial);
-    node->value = std::get<2>(partial);
-    node->balance -= shorter;
-    if (!shorter || node->balance == -1) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, false, result);
-    } else if (node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, true, result);
+  }
+  auto result = avl_node_find_weighted(static_cast<const node_type *>(root),
+                                       position, _rpre);
+  return std::make_tuple(std::size_t(std::get<0>(result)), std::get<1>(result),
+                         std::get<2>(result));
+}
+
+//! Find the element covering a position, where range values are element weights.
+/*!
+ * The element may be changed through the returned pointer,
+ * as long as its range value (its weight) does not change.
+ *
+ * \param position the position to find, in range [0, total weight)
+ * \return tuple: (index of the element, pointer to the element, position within the element)
+ * \exception std::out_of_range If the position is outside the range [0, total weight)
+ * \sa avl_node_find_weighted
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+std::tuple<std::size_t, _Element *, _Range_Type_Intermediate>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::find_weighted(_Range_Type_Intermediate position) {
+  auto result = static_cast<const avl_tree *>(this)->find_weighted(position);
+  return std::make_tuple(std::get<0>(result),
+                         const_cast<_Element *>(std::get<1>(result)),
+                         std::get<2>(result));
+}
+
+//! Call a function on every element in the tree, in order.
+/*!
+ * \param _function function which takes a const reference to an element
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Function>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::for_each(const _Function &_function) const {
+  if constexpr (_Inline_Capacity > 0) {
+    for (std::size_t i = 0; i < inline_elements.size(); ++i) {
+      _function(inline_elements[i]);
     }
-    node = node->rebalance_left_heavy(_rpre, _rcomb);
-    shorter = node->balance == 0;
-    return std::make_tuple(node, shorter, result);
-  } else if (index < left_size) {
-    // it's on the left
-    auto partial =
-        avl_node_remove_at_index(node->left, index, _rpre, _rcomb, _alloc);
-    node->left = std::get<0>(partial);
-    bool shorter = std::get<1>(partial);
-    _Element result = std::get<2>(partial);
-    node->balance += shorter;
-    if (!shorter || node->balance == 1) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, false, result);
-    } else if (node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, true, result);
+  }
+  avl_node_for_each(static_cast<const node_type *>(root), _function);
+}
+
+//! Find the index of the first element not less than a key, and whether it is equivalent to the key.
+/*!
+ * The shared part of the ordered lookups.
+ *
+ * \param value the key to search for
+ * \return pair: (index of the first element not less than the key, or size if there is none,
+ * whether that element is equivalent to the key)
+ * \sa avl_node_lower_bound
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key>
+std::pair<std::size_t, bool> avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::search_lower(const _Key &value) const {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      std::size_t index = 0;
+      while (index < inline_elements.size() &&
+             _less(inline_elements[index], value)) {
+        ++index;
+      }
+      return std::make_pair(index, index < inline_elements.size() &&
+                                       !_less(value, inline_elements[index]));
     }
-    node = node->rebalance_right_heavy(_rpre, _rcomb);
-    shorter = node->balance == 0;
-    return std::make_tuple(node, shorter, result);
-  } else {
-    // it's on the right
-    auto partial = avl_node_remove_at_index(
-        node->right, index - (left_size + _Size(1)), _rpre, _rcomb, _alloc);
-    node->right = std::get<0>(partial);
-    bool shorter = std::get<1>(partial);
-    _Element result = std::get<2>(partial);
-    node->balance -= shorter;
-    if (!shorter || node->balance == -1) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, false, result);
-    } else if (node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, true, result);
+  }
+  auto result =
+      avl_node_lower_bound(static_cast<const node_type *>(root), value, _less);
+  return std::make_pair(std::size_t(result.first), result.second);
+}
+
+//! Find the index of the first element greater than a key.
+/*!
+ * \param value the key to search for
+ * \return the index of the first element greater than the key, or size if there is none
+ * \sa avl_node_upper_bound
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::search_upper(const _Key &value) const {
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      std::size_t index = 0;
+      while (index < inline_elements.size() &&
+             !_less(value, inline_elements[index])) {
+        ++index;
+      }
+      return index;
     }
-    node = node->rebalance_left_heavy(_rpre, _rcomb);
-    shorter = node->balance == 0;
-    return std::make_tuple(node, shorter, result);
   }
+  return std::size_t(
+      avl_node_upper_bound(static_cast<const node_type *>(root), value, _less));
 }
 
-//! Attempt to remove 1 instance of an element from a sorted subtree.
+//! Find the index of the first element which is not less than a value.
 /*!
- * Searches for 1 instance of an element within a sorted (non-decreasing) subtree,
- * and if it is found, removes it.
- * Exact equality using the == operator is required.
- * Note that if the search value is within a contiguous subrange of at least 2
- * incomparable elements, the search may be unable to locate it.
- * This is because the search assumes a total ordering, and will not bother
- * searching in an incomparable subrange.
+ * Assumes the elements are in sorted order.
+ * This is also the rank of the value: the number of elements less than it.
  *
- * If you instead want to find and possibly remove an incomparable element which may
- * not be exactly equal, try using the search methods instead, which are meant for searching
- * rather than removing a very specific value.
+ * \param value the value to search for
+ * \return the index of the first element not less than the value, or size if there is none
+ * \sa avl_node_lower_bound
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::lower_bound(const _Element &value) const {
+  return search_lower(value).first;
+}
+
+//! The same as lower_bound, for keys of other types, if the less than function is transparent.
+/*!
+ * \sa is_transparent_compare
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::lower_bound(const _Key &value) const {
+  return search_lower(value).first;
+}
+
+//! Find the index of the first element which is greater than a value.
+/*!
+ * Assumes the elements are in sorted order.
  *
- * One of the return values is the index of the element (before it was removed).
- * If the remove was successful, that value will be the actual index,
- * otherwise, it will be the empty optional.
+ * \param value the value to search for
+ * \return the index of the first element greater than the value, or size if there is none
+ * \sa avl_node_upper_bound
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::upper_bound(const _Element &value) const {
+  return search_upper(value);
+}
+
+//! The same as upper_bound, for keys of other types, if the less than function is transparent.
+/*!
+ * \sa is_transparent_compare
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::upper_bound(const _Key &value) const {
+  return search_upper(value);
+}
+
+//! Check if an element equivalent to a value is in the tree.
+/*!
+ * Assumes the elements are in sorted order.
  *
- * \param node the root of the subtree
- * \param value the value to search for and remove
- * \param _less less than function
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \param _alloc allocator object
- * \return tuple: (new subtree root, whether it got shorter, optional: the index of the removed element)
- * \sa avl_tree
+ * \param value the value to search for
+ * \return whether there is an element which is neither less nor greater than the value
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
-          typename _Compare, typename _Range_Preprocess,
-          typename _Range_Combine, typename _Alloc>
-std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate> *, bool,
-           avl_optional<_Size>>
-avl_node_remove_ordered(
-    avl_node<_Element, _Size, _Range_Type_Intermediate> *node, _Element value,
-    const _Compare &_less, const _Range_Preprocess &_rpre,
-    const _Range_Combine &_rcomb, _Alloc _alloc) {
-  avl_optional<_Size> index;
-  // empty node -> do nothing, report nothing to delete
-  if (node == nullptr) {
-    return std::make_tuple(node, false, index);
-  }
-  if (node->value == value) {
-    index = avl_node_size(node->left);
-    // we must delete this node
-    if (node->left == nullptr && node->right == nullptr) {
-      _alloc.destroy(node);
-      _alloc.deallocate(node, 1);
-      return std::make_tuple(nullptr, true, index);
-    }
-    if (node->left == nullptr) {
-      auto child = node->right;
-      _alloc.destroy(node);
-      _alloc.deallocate(node, 1);
-      return std::make_tuple(child, true, index);
-    }
-    if (node->right == nullptr) {
-      auto child = node->left;
-      _alloc.destroy(node);
-      _alloc.deallocate(node, 1);
-      return std::make_tuple(child, true, index);
-    }
-    auto partial =
-        avl_node_remove_at_index(node->right, 0, _rpre, _rcomb, _alloc);
-    node->right = std::get<0>(partial);
-    bool shorter = std::get<1>(partial);
-    node->value = std::get<2>(partial);
-    node->balance -= shorter;
-    if (!shorter || node->balance == -1) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, false, index);
-    } else if (node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, true, index);
-    }
-    node = node->rebalance_left_heavy(_rpre, _rcomb);
-    shorter = node->balance == 0;
-    return std::make_tuple(node, shorter, index);
-  } else if (_less(value, node->value)) {
-    // it's on the left
-    auto partial = avl_node_remove_ordered(node->left, value, _less, _rpre,
-                                           _rcomb, _alloc);
-    node->left = std::get<0>(partial);
-    bool shorter = std::get<1>(partial);
-    index = std::get<2>(partial);
-    if (!index) {
-      // remove did nothing
-      return std::make_tuple(node, false, index);
-    }
-    node->balance += shorter;
-    if (!shorter || node->balance == 1) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, false, index);
-    } else if (node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, true, index);
-    }
-    node = node->rebalance_right_heavy(_rpre, _rcomb);
-    shorter = node->balance == 0;
-    return std::make_tuple(node, shorter, index);
-  } else {
-    // it's on the right
-    auto partial = avl_node_remove_ordered(node->right, value, _less, _rpre,
-                                           _rcomb, _alloc);
-    node->right = std::get<0>(partial);
-    bool shorter = std::get<1>(partial);
-    index = std::get<2>(partial);
-    if (!index) {
-      // remove did nothing
-      return std::make_tuple(node, false, index);
-    }
-    index = avl_node_size(node->left) + _Size(1) + index.value();
-    node->balance -= shorter;
-    if (!shorter || node->balance == -1) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, false, index);
-    } else if (node->balance == 0) {
-      node->update(_rpre, _rcomb);
-      return std::make_tuple(node, true, index);
-    }
-    node = node->rebalance_left_heavy(_rpre, _rcomb);
-    shorter = node->balance == 0;
-    return std::make_tuple(node, shorter, index);
-  }
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+bool avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::contains(const _Element &value) const {
+  return search_lower(value).second;
+}
+
+//! The same as contains, for keys of other types, if the less than function is transparent.
+/*!
+ * \sa is_transparent_compare
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+bool avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::contains(const _Key &value) const {
+  return search_lower(value).second;
+}
+
+//! Count the elements equivalent to a value.
+/*!
+ * Assumes the elements are in sorted order.
+ * Takes O(log N) time, however many there are.
+ *
+ * \param value the value to search for
+ * \return the number of elements which are neither less nor greater than the value
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::count(const _Element &value) const {
+  auto lower = search_lower(value);
+  return lower.second ? search_upper(value) - lower.first : 0;
+}
+
+//! The same as count, for keys of other types, if the less than function is transparent.
+/*!
+ * \sa is_transparent_compare
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::count(const _Key &value) const {
+  auto lower = search_lower(value);
+  return lower.second ? search_upper(value) - lower.first : 0;
+}
+
+//! Find the index of an element equivalent to a value.
+/*!
+ * Assumes the elements are in sorted order.
+ * If there are several, finds the first of them.
+ *
+ * \param value the value to search for
+ * \return the index of the first element which is neither less nor greater than the value,
+ * or size if there is none
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::find(const _Element &value) const {
+  auto lower = search_lower(value);
+  return lower.second ? lower.first : size();
+}
+
+//! The same as find, for keys of other types, if the less than function is transparent.
+/*!
+ * \sa is_transparent_compare
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+std::size_t avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::find(const _Key &value) const {
+  auto lower = search_lower(value);
+  return lower.second ? lower.first : size();
+}
+
+//! Remove 1 element equivalent to a value, if there is one.
+/*!
+ * Assumes the elements are in sorted order.
+ * If there are several, removes the first of them.
+ * Unlike avl_node_remove_ordered, the element only has to be equivalent,
+ * not equal by the == operator.
+ *
+ * \param value the value to search for
+ * \return whether an element was removed
+ * \sa erase
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+bool avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::erase_ordered(const _Element &value) {
+  auto lower = search_lower(value);
+  if (!lower.second) return false;
+  erase(lower.first);
+  return true;
 }
 
-//! Removes a node at the specified index in the subtree, then inserts the new element at that index.
+//! The same as erase_ordered, for keys of other types, if the less than function is transparent.
 /*!
- * Removes a node at the specified index, then inserts the new element at that index.
- *
- * The size of the subtree stays the same, unless a merge occurs, in which case
- * the size of the subtree decreases by 1.
+ * \sa is_transparent_compare
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+bool avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::erase_ordered(const _Key &value) {
+  auto lower = search_lower(value);
+  if (!lower.second) return false;
+  erase(lower.first);
+  return true;
+}
+
+//! Move the elements not less than a value into another tree, replacing its elements.
+/*!
+ * Assumes the elements are in sorted order.
+ * Splits the tree at the lower bound of the value with split_at,
+ * keeping the elements less than the value, so it takes O(log N) time
+ * and reuses the nodes, with the other tree sharing this tree's allocator.
  *
- * \param node the root of the subtree
- * \param index the index to replace at
- * \param new_value the new value to insert at that index
- * \param _merge merge function
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \param _alloc allocator object
- * \return tuple: (new subtree root, whether it got smaller)
- * \sa avl_tree
- * \exception std::out_of_range If the requested insertion index is outside the range [0, size of subtree)
+ * \param value the value to split at
+ * \param greater the tree to move the elements not less than the value into,
+ * which must not be this tree
+ * \sa split_at
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
-          typename _Merge, typename _Range_Preprocess, typename _Range_Combine,
-          typename _Alloc>
-std::pair<avl_node<_Element, _Size, _Range_Type_Intermediate> *, bool>
-avl_node_replace_at_index(
-    avl_node<_Element, _Size, _Range_Type_Intermediate> *node, _Size index,
-    _Element new_value, const _Merge &_merge, const _Range_Preprocess &_rpre,
-    const _Range_Combine &_rcomb, _Alloc _alloc) {
-    auto old_size = avl_node_size(node);
-    auto remove_result = avl_node_remove_at_index(node, index, _rpre, _rcomb, _alloc);
-    node = std::get<0>(remove_result);
-    auto insert_result = avl_node_insert_at_index(node, index, new_value, _merge, _rpre, _rcomb, _alloc);
-    node = std::get<0>(insert_result);
-    auto new_size = avl_node_size(node);
-    bool did_merge = old_size != new_size;
-    return std::make_pair(node, did_merge);
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::split_by_key(const _Element &value, avl_tree &greater) {
+  split_at(search_lower(value).first, greater);
 }
 
-/**
- * If the requested old value exists in the tree, replace it by the
- * new value, otherwise, do nothing.
- * The re-insertion may cause a merge, in which case the tree size decreasees by 1.
- * Return tuple is (new subtree root, whether a replacement was made,
- * whether the merge was successful).
+//! The same as split_by_key, for keys of other types, if the less than function is transparent.
+/*!
+ * \sa is_transparent_compare
  */
-//! Make a single replacement in the subtree if the value exists, otherwise do nothing.
-/**
- * Search for the old element within the subtree, assuming sorted order,
- * and remove it if it exists. If the removal was successful, then inserts the new element
- * in the subtree according to the order. The removal index and insertion index are not necessarily the same.
- * Size of the subtree remains the same, unless replacement occurs and merge occurs.
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::split_by_key(const _Key &value, avl_tree &greater) {
+  split_at(search_lower(value).first, greater);
+}
+
+//! Move the elements equivalent to a value, and the elements greater than it, into 2 other trees.
+/*!
+ * Assumes the elements are in sorted order.
+ * Splits the tree at the upper bound and then at the lower bound of the value with split_at,
+ * keeping the elements less than the value, so it takes O(log N) time
+ * and reuses the nodes, with the other tree sharing this tree's allocator.
+ * The elements already in the other trees are replaced.
  *
- * One of the return values is an optional tuple of the removal index and the insertion index.
- * It exists if the replacement is successful.
- * Note that if the insertion index is less than or equal to the removal index and no merge occurs,
- * the actual location where the removal occured is shifted to the right by 1.
- * This function includes correction for this shifting, and reports this actual location, instead of
- * where in the original subtree the removal occurred.
+ * \param value the value to split at
+ * \param equal the tree to move the elements equivalent to the value into
+ * \param greater the tree to move the elements greater than the value into
+ * \sa split_at
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::split_by_key(const _Element &value, avl_tree &equal,
+                                           avl_tree &greater) {
+  auto lower = search_lower(value);
+  split_at(lower.second ? search_upper(value) : lower.first, greater);
+  split_at(lower.first, equal);
+}
+
+//! The same as the 3 way split_by_key, for keys of other types, if the less than function is transparent.
+/*!
+ * \sa is_transparent_compare
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+template <typename _Key, typename>
+void avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::split_by_key(const _Key &value, avl_tree &equal,
+                                           avl_tree &greater) {
+  auto lower = search_lower(value);
+  split_at(lower.second ? search_upper(value) : lower.first, greater);
+  split_at(lower.first, equal);
+}
+
+//! Make an immutable copy of the tree, laid out for fast queries.
+/*!
+ * The copy supports the same index and range queries,
+ * and ordered search, but with far fewer cache misses,
+ * as its nodes are in one array in van Emde Boas order.
+ * Takes O(N log log N) time.
  *
- * \param node the root of the subtree
- * \param old_value the old value to search for and replace
- * \param new_value the new value to insert at that index
- * \param _less less than function
- * \param _merge merge function
- * \param _rpre range preprocess function
- * \param _rcomb range combine function
- * \param _alloc allocator object
- * \return tuple: (new subtree root, whether it got smaller, optional: (removal index, insertion index))
- * \sa avl_tree
+ * \return the frozen copy
+ * \sa frozen_avl_tree
  */
-template <typename _Element, typename _Size, typename _Range_Type_Intermediate,
-          typename _Compare, typename _Merge,
-          typename _Range_Preprocess, typename _Range_Combine,
-          typename _Alloc>
-std::tuple<avl_node<_Element, _Size, _Range_Type_Intermediate> *, bool, avl_optional<std::pair<_Size,_Size>>>
-avl_node_replace_ordered(
-    avl_node<_Element, _Size, _Range_Type_Intermediate> *node, _Element old_value,
-    _Element new_value, const _Compare &_less,
-    const _Merge &_merge, const _Range_Preprocess &_rpre,
-    const _Range_Combine &_rcomb, _Alloc _alloc) {
-    auto old_size = avl_node_size(node);
-    auto remove_result = avl_node_remove_ordered(node, old_value, _less, _rpre, _rcomb, _alloc);
-    avl_optional<_Size> remove_index = std::get<2>(remove_result);
-    avl_optional<std::pair<_Size,_Size>> index_result;
-    // if remove failed, do nothing
-    if(!remove_index){
-      return std::make_tuple(node, false, index_result);
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+typename avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+                  _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+                  _Layout, _Alloc, _Inline_Capacity>::frozen_type
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::freeze() const {
+  frozen_type frozen;
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) {
+      // freeze a temporary copy in nodes, from a local allocator,
+      // since other threads may be reading this tree and allocating from its pool is a change
+      _Alloc alloc;
+      node_type *nodes = make_nodes(alloc);
+      avl_node_freeze(static_cast<const node_type *>(nodes), frozen.nodes);
+      avl_node_destroy(nodes, alloc);
+      return frozen;
     }
-    node = std::get<0>(remove_result);
-    auto insert_result = avl_node_insert_ordered(node, new_value, _less, _merge, _rpre, _rcomb, _alloc);
-    node = std::get<0>(insert_result);
-    auto new_size = avl_node_size(node);
-    bool did_merge = old_size != new_size;
-    _Size corrected_remove_index = *remove_index;
-    _Size insert_index = std::get<2>(insert_result);
-    corrected_remove_index += _Size(insert_index <= corrected_remove_index && !did_merge);
-    index_result = std::make_pair(corrected_remove_index, insert_index);
-    return std::make_tuple(node, did_merge, index_result);
+  }
+  avl_node_freeze(static_cast<const node_type *>(root), frozen.nodes);
+  return frozen;
 }
 
-// the avl tree class
+//! Make an immutable snapshot of a sorted tree in Eytzinger order, for fast ordered lookups.
+/*!
+ * Only the elements are copied, so the snapshot answers ordered lookups and ranks,
+ * but not range queries. Takes O(N) time.
+ *
+ * \return the snapshot
+ * \sa eytzinger_snapshot
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+eytzinger_snapshot<_Element, _Element_Compare>
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::snapshot() const {
+  std::vector<_Element> sorted;
+  sorted.reserve(std::size_t(avl_node_size(root)));
+  for_each([&](const _Element &value) { sorted.push_back(value); });
+  return eytzinger_snapshot<_Element, _Element_Compare>(sorted);
+}
 
-//! The AVL tree class, the most basic and extensible data structure in the public API.
+//! Measure how much memory the tree uses.
 /*!
- * The AVL tree class which is actually exposed to the user and encapsulates a lot of the
- * messy details involved in the implementation. The base extendable data structure on top
- * of which more useful objects are built.
+ * Takes O(1) time and does not allocate, so it is cheap enough to call often, such as for metrics.
+ * The allocator's reserved and used bytes are exact if it can report them,
+ * which the pool and arena allocators can,
+ * and otherwise are estimated as the number of nodes times the bytes per node.
+ * An allocator shared with other trees reports its bytes for all of them,
+ * which the footprint says with its shared flag.
+ * During a compaction, the bytes of the old allocator are counted too.
  *
- * To demonstrate use of the range queries, consider an implementation of a simple list
- * which also wants O(log N) hashing of sublists. We will use range queries here to implement only hashing.
- * Whatever the element type, we will use range preprocess as
- * X --> (hash(X), 1). Intermediate values will be tuples of (hash for this range, number of elements in the range).
- * Hashes will be combined using the Rabin hash, so this is the range combine:
- * (U, N), (V, M) --> (P ^ N * U + V, N + M) for some odd multiplier P, using ^ to denote exponentiation.
- * Finally, we want to return a single number as the hash, so the hash postprocess will simply drop the element count:
- * (U, N) --> U
+ * \return the memory footprint
+ * \sa can_report_memory
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+memory_footprint
+avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::footprint() const {
+  memory_footprint result;
+  result.nodes = std::size_t(avl_node_size(root));
+  result.elements = result.nodes;
+  if constexpr (_Inline_Capacity > 0) {
+    if (root == nullptr) result.elements = inline_elements.size();
+  }
+  result.bytes_per_node = sizeof(node_type);
+  if constexpr (node_type::payload_apart) {
+    result.bytes_per_node += sizeof(typename node_type::payload_type);
+  }
+  result.tree_bytes = sizeof(*this);
+  result.shared = false;
+  if constexpr (can_report_memory<_Alloc>::value) {
+    result.reserved_bytes = _alloc.reserved_bytes();
+    result.used_bytes = _alloc.used_bytes();
+    if (compaction != nullptr) {
+      // the nodes not moved yet are still in the old allocator
+      result.reserved_bytes += compaction->old_alloc.reserved_bytes();
+      result.used_bytes += compaction->old_alloc.used_bytes();
+    }
+    if constexpr (can_release_in_bulk<_Alloc>::value) result.shared = !_alloc.unshared();
+  } else {
+    result.reserved_bytes = result.nodes * result.bytes_per_node;
+    result.used_bytes = result.reserved_bytes;
+  }
+  result.array_bytes = result.elements * sizeof(_Element);
+  return result;
+}
+
+//! Move nodes into fresh memory, in order, to make scans and lookups touch less memory.
+/*!
+ * After many inserts and removes in random places, the nodes of a tree are scattered over
+ * the allocator's memory. Compacting moves every node into memory from a fresh allocator,
+ * in in-order order, and then gives the old allocator's memory back.
+ * The shape of the tree, and its sizes and range values, do not change.
  *
- * \tparam _Element The type of the element stored in the tree collection.
- * To differentiate it from other data, you may think of the "elements" as the original data.
- * Without the elements, it's just a plain tree and not useful.
- * \tparam _Element_Compare A class for a function that takes 2 elements and returns true if the
- * left argument is less than the right argument. You will only actually need this for methods
- * which care about the ordering, otherwise, you don't need to have this actually implemented at all.
- * As a consequence of how templating works in C++, if you never use those ordered functions,
- * the type-specific code will never be generated, so the compiler won't notice that the comparison function supplied
- * doesn't actually work.
- * In the future, with good reason, a major update
- * may change this to use a 3-way comparison function.
- * \tparam _Size The integer or integer-like type used for indices and sizes.
- * Recommended to use std::size_t (which is the default) unless you have a good reason
- * to use another type.
- * \tparam _Merge A class for a function that takes 2 element references, and tries to merge the right
- * argument into the left argument. It will either return false and leave both arguments unchanged, or return true and
- * combine the right argument with the left argument in some way. The actual behaviour of the merge depends
- * on what merger you use, and this will depend on your needs. The left argument is kept in place, and if the merge
- * is successful, the right argument will be discarded, so a destructive merge operation is okay.
- * \tparam _Range_Preprocess A class for a function, designated the range preprocess function.
- * For range operations, all elements will individually be mapped first through this function,
- * to get an object of type _Range_Type_Intermediate.
- * Often necessary because the intermediate value type differs from the element type
- * and some conversion work is needed.
- * \tparam _Range_Type_Intermediate The type of intermediate results of range operations.
- * \tparam _Range_Combine A class for a function, designated the range combine function.
- * Represents the binary operator that combines 2 _Range_Type_Intermediate values into 1.
- * Assumed to be associative, otherwise, the result of a range operation is ill defined.
- * Only requires associativity, not commutativity or invertability.
- * \tparam _Range_Postprocess A class for a function, designated the range postprocess function.
- * After computing the intermediate value for a range, that intermediate value is mapped through the
- * range postprocess function to get the final result of the range query.
- * A typical use of this is to drop information that is only relevant for intermediate values.
- * \tparam _Alloc The allocator class for the nodes, which will be used for managing dynamic memory in place
- * of using new and delete. By default, is the default allocator, which actually has the same behaviour as new and delete.
- * If you want more control over how the nodes, you can change this.
+ * Can be done a bit at a time, such as while idle: each call moves at most the given number of nodes,
+ * starting a new compaction if none is in progress, and says whether it has finished.
+ * The tree can be used and changed freely between calls. While a compaction is in progress,
+ * new nodes come from the fresh allocator, and removed nodes are destroyed but their memory is
+ * only given back when their allocator releases it, at the end of the compaction or when the tree is cleared.
+ *
+ * Needs an allocator which can release in bulk, and a layout whose links can point anywhere,
+ * so it cannot be used with relative_layout or packed_relative_layout.
+ * If the allocator is shared, such as with other trees or a node handle, its memory could not be
+ * given back, and the tree would no longer share an allocator with the others,
+ * so no compaction is started, and compact_status::shared is returned straight away.
+ * Takes O(max nodes + log N) time per call, and O(N) time overall.
+ *
+ * \param max_nodes the most nodes to move in this call
+ * \return compact_status::finished if no compaction is in progress anymore,
+ * compact_status::in_progress if there are nodes left to move,
+ * or compact_status::shared if none were moved since the allocator is shared
+ * \sa avl_node_relocate
+ */
+template <typename _Element, typename _Element_Compare, typename _Size,
+          typename _Merge, typename _Range_Preprocess,
+          typename _Range_Type_Intermediate, typename _Range_Combine,
+          typename _Range_Postprocess, typename _Layout, typename _Alloc,
+          std::size_t _Inline_Capacity>
+compact_status avl_tree<_Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+         _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess,
+         _Layout, _Alloc, _Inline_Capacity>::compact(std::size_t max_nodes) {
+  static_assert(can_release_in_bulk<_Alloc>::value,
+                "compact needs an allocator which can release in bulk");
+  static_assert(!std::is_same<_Layout, relative_layout>::value &&
+                    !std::is_same<_Layout, packed_relative_layout>::value,
+                "compact cannot move nodes out of the arena of a relative layout");
+  if (root == nullptr) {
+    compaction.reset();
+    return compact_status::finished;
+  }
+  if (compaction == nullptr) {
+    // a shared allocator could not give the old memory back, and the other trees would stop sharing
+    if (!_alloc.unshared()) return compact_status::shared;
+    compaction.reset(new compaction_state{_alloc, 0});
+    _alloc = _Alloc();
+  }
+  std::size_t total = std::size_t(avl_node_size(root));
+  std::size_t begin = std::min(compaction->next, total);
+  std::size_t end = begin + std::min(max_nodes, total - begin);
+  root = avl_node_relocate(root, _Size(begin), _Size(end), _alloc);
+  compaction->next = end;
+  if (end < total) return compact_status::in_progress;
+  // every node is in the new allocator, so the old one can give back all of its memory
+  compaction.reset();
+  return compact_status::finished;
+}
+
+#if avl_has_pmr
+//! Aliases for using the library with polymorphic memory resources.
+namespace pmr {
+
+//! AVL tree whose nodes come from a std::pmr::memory_resource.
+/*!
+ * The same as avl_tree, with std::pmr::polymorphic_allocator as the allocator.
+ * Pass the allocator (or the memory resource, which converts to it) to the constructor,
+ * otherwise the default memory resource is used.
+ * With a std::pmr::monotonic_buffer_resource, such as one per request,
+ * node allocation is just a pointer bump, and all of the memory is given back at once with the resource.
+ * Since nodes may be anywhere in the resource, the relative layouts cannot be used.
+ *
+ * The template parameters have the same meaning as for avl_tree.
  */
 template <typename _Element, typename _Element_Compare = std::less<_Element>,
           typename _Size = std::size_t, typename _Merge = no_merge<_Element>,
           typename _Range_Preprocess = monostate,
-          typename _Range_Type_Intermediate =
-              avl_invoke_result(_Range_Preprocess, _Element),
+          typename _Range_Type_Intermediate = typename std::decay<
+              typename std::invoke_result<_Range_Preprocess, _Element>::type>::type,
           typename _Range_Combine = std::plus<_Range_Type_Intermediate>,
           typename _Range_Postprocess = identity<_Range_Type_Intermediate>,
-          typename _Alloc = std::allocator<
-              avl_node<_Element, _Size, _Range_Type_Intermediate>>>
-class avl_tree {
+          typename _Layout = pointer_layout, std::size_t _Inline_Capacity = 0>
+using avl_tree = avl::avl_tree<
+    _Element, _Element_Compare, _Size, _Merge, _Range_Preprocess,
+    _Range_Type_Intermediate, _Range_Combine, _Range_Postprocess, _Layout,
+    std::pmr::polymorphic_allocator<
+        avl_node<_Element, _Size, _Range_Type_Intermediate, _Layout>>,
+    _Inline_Capacity>;
+
+}  // namespace pmr
+#endif
+
+// the unrolled vector
+
+//! Fixed capacity block of consecutive list items, stored as one element of an unrolled list.
+/*!
+ * \tparam T the list item type, which must be default constructible
+ * \tparam _Capacity the most items which fit in one chunk
+ * \sa vector
+ */
+template <typename T, std::size_t _Capacity>
+struct chunk {
+  //! Number of items in use, which are the first ones.
+  std::size_t count = 0;
+  //! Storage for the items.
+  T items[_Capacity];
+
+  //! Insert an item just before an index, which must be in range [0, count], if there is space.
+  void insert(std::size_t index, const T &value) {
+    std::move_backward(items + index, items + count, items + count + 1);
+    items[index] = value;
+    ++count;
+  }
+  //! Remove the item at an index, which must be in range [0, count).
+  void erase(std::size_t index) {
+    std::move(items + index + 1, items + count, items + index);
+    --count;
+  }
+};
+
+//! Range preprocess function for chunks, which gives the number of items in a chunk.
+struct chunk_size {
+  template <typename _Chunk>
+  std::size_t operator()(const _Chunk &c) const noexcept {
+    return c.count;
+  }
+};
+
+//! List with fast insertion and removal anywhere, a replacement for std::vector.
+/*!
+ * An unrolled AVL tree: each node holds a chunk of up to chunk_capacity consecutive items
+ * instead of a single item, and the range values count the items in each subtree,
+ * so positions are found with avl_tree::find_weighted.
+ * Compared to one item per node, the tree is several levels shallower,
+ * and the link, size, and range value overhead is shared by a whole chunk,
+ * so index lookups and scans touch far fewer cache lines.
+ * Insertion and removal are O(log N + chunk_capacity).
+ *
+ * A full chunk is split in half when inserting into it, except that inserting at its end
+ * starts a new chunk, so appending keeps the chunks full.
+ * When removal leaves a chunk less than a quarter full, it takes in the items of the next chunk if they fit.
+ *
+ * Positions are given as indices, not iterators.
+ *
+ * \tparam T the item type, which must be default constructible and copy assignable
+ * \tparam _Chunk_Bytes the target size of the items of one chunk, in bytes.
+ * The default fits a few cache lines per chunk.
+ */
+template <typename T, std::size_t _Chunk_Bytes = 256>
+class vector {
+ public:
+  typedef T value_type;
+  typedef std::size_t size_type;
+  //! The most items which fit in one chunk.
+  static constexpr std::size_t chunk_capacity =
+      _Chunk_Bytes / sizeof(T) < 4 ? 4 : _Chunk_Bytes / sizeof(T);
+
  private:
-  avl_node<_Element, _Size, _Range_Type_Intermediate> *root;
-  [[no_unique_address]] _Element_Compare _less;
-  [[no_unique_address]] _Merge _merge;
-  [[no_unique_address]] _Range_Preprocess _rpre;
-  [[no_unique_address]] _Range_Combine _rcomb;
-  [[no_unique_address]] _Range_Postprocess _rpost;
-  [[no_unique_address]] _Alloc _alloc;
+  typedef chunk<T, chunk_capacity> chunk_type;
+
+  avl_tree<chunk_type, std::less<chunk_type>, std::size_t,
+           no_merge<chunk_type>, chunk_size, std::size_t,
+           std::plus<std::size_t>, identity<std::size_t>>
+      chunks;
+  std::size_t count;
 
  public:
-  avl_tree();
-  ~avl_tree();
-  std::size_t size();
-  _Element get_item(std::size_t);
-  std::result_of<_Range_Postprocess(_Range_Type_Intermediate)> get_range(
-      std::size_t, std::size_t);
-  void insert(std::size_t, _Element);
-  _Element remove(std::size_t);
-  _Element replace(std::size_t, _Element);
+  vector();
+  vector(const vector &) = delete;
+  vector &operator=(const vector &) = delete;
+  std::size_t size() const;
+  bool empty() const;
+  void clear();
+  T &operator[](std::size_t);
+  const T &operator[](std::size_t) const;
+  T &at(std::size_t);
+  const T &at(std::size_t) const;
+  T &front();
+  T &back();
+  void insert(std::size_t, const T &);
+  void erase(std::size_t);
+  void push_back(const T &);
+  void pop_back();
+  template <typename _Function>
+  void for_each(const _Function &) const;
 };
 
+//! Construct an empty vector.
+template <typename T, std::size_t _Chunk_Bytes>
+vector<T, _Chunk_Bytes>::vector() : count(0) {}
+
+//! Get the number of items.
+template <typename T, std::size_t _Chunk_Bytes>
+std::size_t vector<T, _Chunk_Bytes>::size() const {
+  return count;
+}
+
+//! Check if there are no items.
+template <typename T, std::size_t _Chunk_Bytes>
+bool vector<T, _Chunk_Bytes>::empty() const {
+  return count == 0;
+}
+
+//! Remove all items.
+template <typename T, std::size_t _Chunk_Bytes>
+void vector<T, _Chunk_Bytes>::clear() {
+  chunks.clear();
+  count = 0;
+}
+
+//! Get the item at an index.
+/*!
+ * \param index the index, in range [0, size)
+ * \return a reference to the item at that index
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ */
+template <typename T, std::size_t _Chunk_Bytes>
+T &vector<T, _Chunk_Bytes>::operator[](std::size_t index) {
+  auto found = chunks.find_weighted(index);
+  return std::get<1>(found)->items[std::get<2>(found)];
+}
+
+//! Get the item at an index.
+/*!
+ * \param index the index, in range [0, size)
+ * \return a const reference to the item at that index
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ */
+template <typename T, std::size_t _Chunk_Bytes>
+const T &vector<T, _Chunk_Bytes>::operator[](std::size_t index) const {
+  auto found = chunks.find_weighted(index);
+  return std::get<1>(found)->items[std::get<2>(found)];
+}
+
+//! Get the item at an index; same as operator[], which also checks the index.
+template <typename T, std::size_t _Chunk_Bytes>
+T &vector<T, _Chunk_Bytes>::at(std::size_t index) {
+  return (*this)[index];
+}
+
+//! Get the item at an index; same as operator[], which also checks the index.
+template <typename T, std::size_t _Chunk_Bytes>
+const T &vector<T, _Chunk_Bytes>::at(std::size_t index) const {
+  return (*this)[index];
+}
+
+//! Get the first item.
+template <typename T, std::size_t _Chunk_Bytes>
+T &vector<T, _Chunk_Bytes>::front() {
+  return (*this)[0];
+}
+
+//! Get the last item.
+template <typename T, std::size_t _Chunk_Bytes>
+T &vector<T, _Chunk_Bytes>::back() {
+  return (*this)[count - 1];
+}
+
+//! Insert an item just before the given index.
+/*!
+ * \param index the index to insert at, in range [0, size]
+ * \param value the item to insert
+ * \exception std::out_of_range If the index is outside the range [0, size]
+ */
+template <typename T, std::size_t _Chunk_Bytes>
+void vector<T, _Chunk_Bytes>::insert(std::size_t index, const T &value) {
+  if (count < index) [[unlikely]] {
+    throw std::out_of_range(
+        "AVL vector operation insert tried to insert outside of the range of "
+        "valid indices for this vector.");
+  }
+  if (count == 0) {
+    chunk_type first;
+    first.insert(0, value);
+    chunks.insert(0, first);
+    ++count;
+    return;
+  }
+  // find the chunk to insert into, which is the last chunk when appending
+  auto found = chunks.find_weighted(index < count ? index : count - 1);
+  std::size_t chunk_index = std::get<0>(found);
+  std::size_t offset = std::get<2>(found) + std::size_t(index == count);
+  chunk_type *target = std::get<1>(found);
+  if (target->count < chunk_capacity) {
+    chunks.modify(chunk_index,
+                  [&](chunk_type &c) { c.insert(offset, value); });
+  } else if (offset == chunk_capacity) {
+    // inserting at the end of a full chunk starts a new chunk
+    chunk_type next;
+    next.insert(0, value);
+    chunks.insert(chunk_index + 1, next);
+  } else {
+    // split the full chunk in half
+    chunk_type next;
+    chunks.modify(chunk_index, [&](chunk_type &c) {
+      std::size_t half = c.count / 2;
+      std::move(c.items + half, c.items + c.count, next.items);
+      next.count = c.count - half;
+      c.count = half;
+      if (offset <= half) {
+        c.insert(offset, value);
+      } else {
+        next.insert(offset - half, value);
+      }
+    });
+    chunks.insert(chunk_index + 1, next);
+  }
+  ++count;
+}
+
+//! Remove the item at an index.
+/*!
+ * \param index the index to remove at, in range [0, size)
+ * \exception std::out_of_range If the index is outside the range [0, size)
+ */
+template <typename T, std::size_t _Chunk_Bytes>
+void vector<T, _Chunk_Bytes>::erase(std::size_t index) {
+  auto found = chunks.find_weighted(index);
+  std::size_t chunk_index = std::get<0>(found);
+  std::size_t offset = std::get<2>(found);
+  chunk_type *target = std::get<1>(found);
+  --count;
+  if (target->count == 1) {
+    chunks.remove(chunk_index);
+    return;
+  }
+  chunks.modify(chunk_index, [&](chunk_type &c) { c.erase(offset); });
+  // keep chunks at least a quarter full by taking in the next chunk
+  std::size_t next_position = index - offset + target->count;
+  if (target->count < chunk_capacity / 4 && next_position < count) {
+    const chunk_type *next = std::get<1>(chunks.find_weighted(next_position));
+    if (target->count + next->count <= chunk_capacity) {
+      chunks.modify(chunk_index, [&](chunk_type &c) {
+        std::copy(next->items, next->items + next->count, c.items + c.count);
+        c.count += next->count;
+      });
+      chunks.remove(chunk_index + 1);
+    }
+  }
+}
+
+//! Add an item at the end.
+template <typename T, std::size_t _Chunk_Bytes>
+void vector<T, _Chunk_Bytes>::push_back(const T &value) {
+  insert(count, value);
+}
+
+//! Remove the last item.
+/*!
+ * \exception std::out_of_range If the vector is empty
+ */
+template <typename T, std::size_t _Chunk_Bytes>
+void vector<T, _Chunk_Bytes>::pop_back() {
+  erase(count - 1);
+}
+
+//! Call a function on every item, in order.
+/*!
+ * Goes through the chunks in order, so this is much faster than indexing every item.
+ *
+ * \param _function function which takes a const reference to an item
+ */
+template <typename T, std::size_t _Chunk_Bytes>
+template <typename _Function>
+void vector<T, _Chunk_Bytes>::for_each(const _Function &_function) const {
+  chunks.for_each([&](const chunk_type &c) {
+    for (std::size_t i = 0; i < c.count; ++i) _function(c.items[i]);
+  });
+}
+
 }  // namespace avl
 
-#undef avl_invoke_result
-#undef avl_optional
+#undef avl_has_mmap
+#undef avl_has_pmr
 
 #endif
 
 // TODO remove test main when we're sure it compiles and runs fine
 // the test main is only to check if the API works at all, it's not a comprehensive unit test
 // it is useful right now for spotting big errors during development
+// define AVL_TREE_NO_TEST_MAIN to include this file without the test main
+#ifndef AVL_TREE_NO_TEST_MAIN
 #include <iostream>
+#include <string>
+#include <string_view>
 int main() {
   // c++ version
   std::cout << __cplusplus << std::endl;
@@ -1181,40 +8130,60 @@ int main() {
   // (300)
   avl::avl_node<int, int, int> *node =
       new avl::avl_node<int, int, int>(300, 300);
+  std::allocator<avl::avl_node<int, int, int>> alloc;
   std::cout << avl::avl_node_size(node) << " (expected 1)" << std::endl;
   // test some insertion by index
   // (100 300)
   node = avl::avl_node_insert_at_index(
              node, 0, 100, avl::no_merge<int>(), avl::identity<int>(),
-             std::plus<int>(), std::allocator<avl::avl_node<int, int, int>>())
+             std::plus<int>(), alloc)
              .first;
   std::cout << avl::avl_node_size(node) << " (expected 2)" << std::endl;
   // test some insertion ordered
   // (100 100 300)
   node = std::get<0>(avl::avl_node_insert_ordered(
       node, 100, std::less<int>(), avl::no_merge<int>(), avl::identity<int>(),
-      std::plus<int>(), std::allocator<avl::avl_node<int, int, int>>()));
+      std::plus<int>(), alloc));
   std::cout << avl::avl_node_size(node) << " (expected 3)" << std::endl;
   // test some removal
   // (100 300)
   node = std::get<0>(avl::avl_node_remove_at_index(
       node, 1, avl::identity<int>(), std::plus<int>(),
-      std::allocator<avl::avl_node<int, int, int>>()));
+      alloc));
   std::cout << avl::avl_node_size(node) << " (expected 2)" << std::endl;
   // test some removal ordered
   // (100)
   node = std::get<0>(avl::avl_node_remove_ordered(
       node, 300, std::less<int>(), avl::identity<int>(), std::plus<int>(),
-      std::allocator<avl::avl_node<int, int, int>>()));
+      alloc));
   std::cout << avl::avl_node_size(node) << " (expected 1)" << std::endl;
   // test some element get
   // (100)
   std::cout << avl::avl_node_get_at_index(node, 0) << " (expected 100)" << std::endl;
+  // test inserting and replacing with values which only convert to the element explicitly
+  // (vector of 2) (vector of 3), then (vector of 2) (vector of 5)
+  typedef avl::avl_node<std::vector<int>, int, avl::monostate> vector_node;
+  std::allocator<vector_node> vector_alloc;
+  vector_node *vectors = avl::avl_node_insert_at_index(
+      static_cast<vector_node *>(nullptr), 0, std::size_t(3),
+      avl::no_merge<std::vector<int>>(), avl::monostate(), std::plus<avl::monostate>(),
+      vector_alloc).first;
+  vectors = std::get<0>(avl::avl_node_insert_ordered(
+      vectors, std::size_t(2), std::less<std::vector<int>>(),
+      avl::no_merge<std::vector<int>>(), avl::monostate(), std::plus<avl::monostate>(),
+      vector_alloc));
+  vectors = std::get<0>(avl::avl_node_replace_at_index(
+      vectors, 1, std::size_t(5), avl::no_merge<std::vector<int>>(), avl::monostate(),
+      std::plus<avl::monostate>(), vector_alloc));
+  std::cout << avl::avl_node_get_at_index(vectors, 0).size() << " "
+            << avl::avl_node_get_at_index(vectors, 1).size() << " (expected 2 5)"
+            << std::endl;
+  avl::avl_node_destroy(vectors, vector_alloc);
   // test some element replace by index
   // (150)
   node = std::get<0>(avl::avl_node_replace_at_index(
       node, 0, 150, avl::no_merge<int>(), avl::identity<int>(),
-      std::plus<int>(), std::allocator<avl::avl_node<int, int, int>>()
+      std::plus<int>(), alloc
       ));
   std::cout << avl::avl_node_get_at_index(node, 0) << " (expected 150)" << std::endl;
   std::cout << avl::avl_node_size(node) << " (expected 1)" << std::endl;
@@ -1222,14 +8191,551 @@ int main() {
   // (150)
   node = std::get<0>(avl::avl_node_replace_ordered(
       node, 250, 350, std::less<int>(), avl::no_merge<int>(), avl::identity<int>(),
-      std::plus<int>(), std::allocator<avl::avl_node<int, int, int>>()
+      std::plus<int>(), alloc
       ));
   std::cout << avl::avl_node_get_at_index(node, 0) << " (expected 150)" << std::endl;
   std::cout << avl::avl_node_size(node) << " (expected 1)" << std::endl;
   node = std::get<0>(avl::avl_node_replace_ordered(
       node, 150, 350, std::less<int>(), avl::no_merge<int>(), avl::identity<int>(),
-      std::plus<int>(), std::allocator<avl::avl_node<int, int, int>>()
+      std::plus<int>(), alloc
       ));
   std::cout << avl::avl_node_get_at_index(node, 0) << " (expected 350)" << std::endl;
   std::cout << avl::avl_node_size(node) << " (expected 1)" << std::endl;
+  avl::avl_node_destroy(node, alloc);
+  // test the tree class with the pool allocator
+  // (10 20 30 40)
+  avl::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                avl::identity<int>>
+      tree;
+  tree.insert(0, 20);
+  tree.insert(1, 40);
+  tree.insert(0, 10);
+  tree.insert(2, 30);
+  std::cout << tree.size() << " (expected 4)" << std::endl;
+  std::cout << tree.get_item(3) << " (expected 40)" << std::endl;
+  std::cout << tree.get_range(1, 3) << " (expected 50)" << std::endl;
+  // (10 25 30 40)
+  std::cout << tree.replace(1, 25) << " (expected 20)" << std::endl;
+  // (10 25 40)
+  std::cout << tree.remove(2) << " (expected 30)" << std::endl;
+  std::cout << tree.get_range(0, 3) << " (expected 75)" << std::endl;
+  // test measuring the memory of the tree
+  avl::memory_footprint footprint = tree.footprint();
+  std::cout << footprint.nodes << " (expected 3)" << std::endl;
+  std::cout << (footprint.used_bytes == 3 * footprint.bytes_per_node)
+            << " (expected 1)" << std::endl;
+  std::cout << (footprint.overhead_ratio() > 1) << " (expected 1)" << std::endl;
+  std::cout << footprint.shared << " (expected 0)" << std::endl;
+  // test the tree class with 32 bit relative links
+  // (1 2 3 ... 100)
+  avl::avl_tree<int, std::less<int>, std::uint32_t, avl::no_merge<int>,
+                avl::identity<int>, int, std::plus<int>, avl::identity<int>,
+                avl::relative_layout>
+      compact_tree;
+  for (int i = 0; i < 100; ++i) compact_tree.insert(i, i + 1);
+  std::cout << compact_tree.get_item(41) << " (expected 42)" << std::endl;
+  std::cout << compact_tree.get_range(0, 100) << " (expected 5050)" << std::endl;
+  // test that empty trees of the layout reserve nothing, so that many of them fit
+  std::vector<decltype(compact_tree)> empty_compact_trees(10000);
+  std::cout << empty_compact_trees.back().footprint().reserved_bytes << " "
+            << empty_compact_trees.back().size() << " (expected 0 0)" << std::endl;
+  // test that a full arena refuses a node without counting it as used
+  decltype(compact_tree) full_arena_tree(decltype(compact_tree)::allocator_type(4));
+  for (int i = 0; i < 4; ++i) full_arena_tree.insert(i, i + 1);
+  try {
+    full_arena_tree.insert(4, 5);
+    std::cout << "not refused (expected refused)" << std::endl;
+  } catch (const std::length_error &) {
+    std::cout << "refused (expected refused)" << std::endl;
+  }
+  footprint = full_arena_tree.footprint();
+  std::cout << full_arena_tree.size() << " "
+            << (footprint.used_bytes == 4 * footprint.bytes_per_node)
+            << " (expected 4 1)" << std::endl;
+  // test that many default trees with nodes fit in the address space at once
+  std::vector<decltype(compact_tree)> small_compact_trees(5000);
+  for (auto &small : small_compact_trees) small.insert(0, 1);
+  std::cout << small_compact_trees.back().size() << " "
+            << small_compact_trees.back().get_item(0) << " (expected 1 1)" << std::endl;
+  small_compact_trees.clear();
+  // test that a packed relative tree refuses an arena too large for its links
+  typedef avl::avl_tree<int, std::less<int>, std::uint32_t, avl::no_merge<int>,
+                        avl::identity<int>, int, std::plus<int>, avl::identity<int>,
+                        avl::packed_relative_layout>
+      packed_relative_tree_type;
+  packed_relative_tree_type packed_relative_tree;
+  for (int i = 0; i < 100; ++i) packed_relative_tree.insert(i, i + 1);
+  std::cout << packed_relative_tree.get_range(0, 100) << " (expected 5050)" << std::endl;
+  // the arena is refused before anything is reserved for it
+  try {
+    packed_relative_tree_type::allocator_type huge_arena((std::size_t(1) << 28) + 1);
+    packed_relative_tree_type refused(huge_arena);
+    std::cout << "not refused (expected refused)" << std::endl;
+  } catch (const std::length_error &) {
+    std::cout << "refused (expected refused)" << std::endl;
+  }
+  // test the tree class with the balance factor packed into the links
+  // (100 99 98 ... 1)
+  avl::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                avl::identity<int>, int, std::plus<int>, avl::identity<int>,
+                avl::packed_pointer_layout>
+      packed_tree;
+  for (int i = 0; i < 100; ++i) packed_tree.insert(0, i + 1);
+  std::cout << packed_tree.remove(99) << " (expected 1)" << std::endl;
+  std::cout << packed_tree.get_item(0) << " (expected 100)" << std::endl;
+  std::cout << packed_tree.get_range(0, 99) << " (expected 5049)" << std::endl;
+  // test clearing, which releases the whole pool at once, and reusing the tree
+  // (7)
+  packed_tree.clear();
+  std::cout << packed_tree.size() << " (expected 0)" << std::endl;
+  packed_tree.insert(0, 7);
+  std::cout << packed_tree.get_item(0) << " (expected 7)" << std::endl;
+  // test the unrolled vector, with 4 items per chunk
+  // (0 1 2 ... 9), then (0 1 2 ... 9 100) with 5 removed
+  avl::vector<int, 4 * sizeof(int)> list;
+  for (int i = 0; i < 10; ++i) list.push_back(i);
+  list.insert(10, 100);
+  list.erase(5);
+  std::cout << list.size() << " (expected 10)" << std::endl;
+  std::cout << list[5] << " (expected 6)" << std::endl;
+  std::cout << list.back() << " (expected 100)" << std::endl;
+  int list_sum = 0;
+  list.for_each([&](int item) { list_sum += item; });
+  std::cout << list_sum << " (expected 140)" << std::endl;
+  // test freezing and thawing a sorted tree
+  // (0 2 4 ... 198)
+  avl::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                avl::identity<int>>
+      sorted_tree;
+  for (int i = 0; i < 100; ++i) sorted_tree.insert(i, 2 * i);
+  auto frozen = sorted_tree.freeze();
+  std::cout << frozen.get_item(37) << " (expected 74)" << std::endl;
+  std::cout << frozen.get_range(10, 20) << " (expected 290)" << std::endl;
+  std::cout << frozen.lower_bound(51) << " (expected 26)" << std::endl;
+  std::cout << frozen.contains(51) << " (expected 0)" << std::endl;
+  decltype(sorted_tree) thawed(frozen);
+  std::cout << thawed.get_range(0, 100) << " (expected 9900)" << std::endl;
+  // test thawing when copying an element throws partway through
+  // (0 1 2 ... 99)
+  static int fragile_live = 0, fragile_copies_left = -1;
+  struct fragile {
+    int value;
+    fragile(int v) : value(v) { ++fragile_live; }
+    fragile(const fragile &other) : value(other.value) {
+      if (fragile_copies_left == 0) throw std::runtime_error("copy failed");
+      if (fragile_copies_left > 0) --fragile_copies_left;
+      ++fragile_live;
+    }
+    ~fragile() { --fragile_live; }
+    bool operator<(const fragile &other) const { return value < other.value; }
+  };
+  avl::avl_tree<fragile> fragile_tree;
+  for (int i = 0; i < 100; ++i) fragile_tree.insert(i, fragile(i));
+  auto fragile_frozen = fragile_tree.freeze();
+  int fragile_before = fragile_live;
+  fragile_copies_left = 50;
+  try {
+    decltype(fragile_tree) fragile_thawed(fragile_frozen);
+    std::cout << "not thrown";
+  } catch (const std::runtime_error &) {
+    // the 50 elements copied before the throw are destroyed again
+    std::cout << (fragile_live == fragile_before);
+  }
+  std::cout << " (expected 1)" << std::endl;
+  fragile_copies_left = -1;
+  // test compacting a few nodes at a time, with changes in between
+  // (0 2 4 ... 198), then with 0 removed and 1000 at the end
+  std::cout << (thawed.compact(40) == avl::compact_status::in_progress)
+            << " (expected 1)" << std::endl;
+  // the 60 nodes not moved yet still count, in the old pool
+  avl::memory_footprint compacting_footprint = thawed.footprint();
+  std::cout << (compacting_footprint.used_bytes >= 100 * compacting_footprint.bytes_per_node)
+            << " (expected 1)" << std::endl;
+  thawed.remove(0);
+  thawed.insert(99, 1000);
+  while (thawed.compact(40) == avl::compact_status::in_progress) {}
+  std::cout << thawed.get_item(50) << " (expected 102)" << std::endl;
+  std::cout << thawed.get_range(0, 100) << " (expected 10900)" << std::endl;
+  // test clearing in the middle of a compaction, while a node handle shares the new pool
+  // (0 1 2 ... 999), then cleared, then (7)
+  decltype(sorted_tree) compacting;
+  for (int i = 0; i < 1000; ++i) compacting.insert(i, i);
+  compacting.compact(10);
+  auto compacted_handle = compacting.extract(0);
+  compacting.clear();
+  for (int i = 0; i < 100; ++i) compacting.insert(0, 7);
+  std::cout << compacting.get_range(0, 100) << " (expected 700)" << std::endl;
+  // test that a tree which shares its allocator is not compacted
+  decltype(sorted_tree)::allocator_type compact_alloc;
+  decltype(sorted_tree) compact_shared(compact_alloc);
+  for (int i = 0; i < 1000; ++i) compact_shared.insert(i, i);
+  std::cout << (compact_shared.compact(10) == avl::compact_status::shared)
+            << " (expected 1)" << std::endl;
+  // test ordered lookups, live and in an Eytzinger snapshot
+  std::cout << sorted_tree.lower_bound(51) << " (expected 26)" << std::endl;
+  std::cout << sorted_tree.contains(52) << " (expected 1)" << std::endl;
+  auto snapshot = sorted_tree.snapshot();
+  std::cout << *snapshot.lower_bound(51) << " (expected 52)" << std::endl;
+  std::cout << snapshot.rank(51) << " (expected 26)" << std::endl;
+  std::cout << snapshot.contains(198) << " (expected 1)" << std::endl;
+  std::cout << (snapshot.lower_bound(199) == nullptr) << " (expected 1)" << std::endl;
+  // test a tree which keeps up to 4 elements inline, then switches to nodes
+  // (1 2 3 4), then (1 2 3 4 5 6)
+  avl::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                avl::identity<int>, int, std::plus<int>, avl::identity<int>,
+                avl::pointer_layout,
+                avl::pool_allocator<avl::avl_node<int, std::size_t, int>>, 4>
+      small_tree;
+  for (int i = 0; i < 4; ++i) small_tree.insert(i, i + 1);
+  std::cout << small_tree.get_range(1, 4) << " (expected 9)" << std::endl;
+  // the pool takes no chunks until the first node, so nothing has been reserved yet
+  std::cout << small_tree.footprint().reserved_bytes << " (expected 0)" << std::endl;
+  // freezing it builds the temporary nodes with a local allocator, not with its pool
+  std::cout << small_tree.freeze().size() << " "
+            << small_tree.footprint().reserved_bytes << " (expected 4 0)" << std::endl;
+  // copies of an unused allocator share its pool, without changing it
+  const avl::pool_allocator<int> unused_pool_allocator;
+  avl::pool_allocator<int> unused_pool_allocator_copy(unused_pool_allocator);
+  std::cout << (unused_pool_allocator_copy == unused_pool_allocator) << " "
+            << std::is_nothrow_copy_constructible<avl::pool_allocator<int>>::value
+            << " (expected 1 1)" << std::endl;
+  std::cout << small_tree.replace(0, 10) << " (expected 1)" << std::endl;
+  std::cout << small_tree.remove(0) << " (expected 10)" << std::endl;
+  small_tree.insert(0, 1);
+  small_tree.insert(4, 5);
+  small_tree.insert(5, 6);
+  std::cout << small_tree.size() << " (expected 6)" << std::endl;
+  std::cout << small_tree.get_range(0, 6) << " (expected 21)" << std::endl;
+  // test switching to nodes when copying an element throws partway through
+  // (0 1 2 3) kept inline, then (0 1 2 3 4)
+  avl::avl_tree<fragile, std::less<fragile>, std::size_t, avl::no_merge<fragile>,
+                avl::monostate, avl::monostate, std::plus<avl::monostate>,
+                avl::identity<avl::monostate>, avl::pointer_layout,
+                avl::pool_allocator<avl::avl_node<fragile, std::size_t, avl::monostate>>, 4>
+      small_fragile_tree;
+  for (int i = 0; i < 4; ++i) small_fragile_tree.insert(i, fragile(i));
+  fragile_before = fragile_live;
+  fragile_copies_left = 2;
+  try {
+    small_fragile_tree.insert(4, fragile(4));
+    std::cout << "not thrown";
+  } catch (const std::runtime_error &) {
+    // fragile can not be moved, so it is copied, and the inline elements are kept
+    std::cout << small_fragile_tree.size() << " " << (fragile_live == fragile_before);
+  }
+  std::cout << " (expected 4 1)" << std::endl;
+  fragile_copies_left = -1;
+  small_fragile_tree.insert(4, fragile(4));
+  std::cout << small_fragile_tree.size() << " " << small_fragile_tree.get_item(3).value
+            << " (expected 5 3)" << std::endl;
+  // test a tree whose nodes are in huge page chunks
+  // (0 1 2 ... 999)
+  avl::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                avl::identity<int>, int, std::plus<int>, avl::identity<int>,
+                avl::pointer_layout,
+                avl::huge_page_pool_allocator<avl::avl_node<int, std::size_t, int>>>
+      huge_tree;
+  for (int i = 0; i < 1000; ++i) huge_tree.insert(i, i);
+  std::cout << huge_tree.get_item(777) << " (expected 777)" << std::endl;
+  std::cout << huge_tree.get_range(0, 1000) << " (expected 499500)" << std::endl;
+#if __has_include(<memory_resource>)
+  // test a tree whose nodes come from a memory resource
+  // (0 1 2 ... 99)
+  std::pmr::monotonic_buffer_resource resource;
+  avl::pmr::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                     avl::identity<int>>
+      pmr_tree(&resource);
+  for (int i = 0; i < 100; ++i) pmr_tree.insert(i, i);
+  std::cout << pmr_tree.remove(50) << " (expected 50)" << std::endl;
+  std::cout << pmr_tree.get_range(0, 99) << " (expected 4900)" << std::endl;
+#endif
+  // test a tree of move-only elements
+  // (1 2 3), then 3 replaced by 4 and 1 removed
+  avl::avl_tree<std::unique_ptr<int>> owner_tree;
+  for (int i = 1; i <= 3; ++i)
+    owner_tree.insert(i - 1, std::unique_ptr<int>(new int(i)));
+  std::cout << *owner_tree.replace(2, std::unique_ptr<int>(new int(4)))
+            << " (expected 3)" << std::endl;
+  std::cout << *owner_tree.remove(0) << " (expected 1)" << std::endl;
+  int owner_sum = 0;
+  owner_tree.for_each([&](const std::unique_ptr<int> &p) { owner_sum += *p; });
+  std::cout << owner_sum << " (expected 6)" << std::endl;
+  owner_tree.erase(1);
+  std::cout << owner_tree.size() << " (expected 1)" << std::endl;
+  // test constructing elements in place
+  // ("a" "bb" "ccc"), then "zz" at index 3, then "b" in order
+  avl::avl_tree<std::string, std::less<std::string>, std::size_t,
+                avl::no_merge<std::string>, avl::identity<std::string>>
+      emplace_tree;
+  for (int i = 0; i < 3; ++i) emplace_tree.emplace(i, i + 1, char('a' + i));
+  emplace_tree.emplace(3, 2, 'z');
+  std::cout << emplace_tree.emplace_ordered(1, 'b') << " (expected 1)" << std::endl;
+  std::cout << emplace_tree.get_range(0, 5) << " (expected abbbccczz)" << std::endl;
+  // test merging on insert, with (key, count) pairs whose counts add up
+  // ((0, 1) (1, 1) ... (63, 1)), then more counts added to some keys
+  typedef std::pair<int, int> counted;
+  struct counted_less {
+    bool operator()(const counted &a, const counted &b) const { return a.first < b.first; }
+  };
+  struct add_counts {
+    bool operator()(counted &to, const counted &from) const {
+      if (to.first != from.first) return false;
+      to.second += from.second;
+      return true;
+    }
+  };
+  struct count_of {
+    int operator()(const counted &c) const { return c.second; }
+  };
+  avl::avl_tree<counted, counted_less, std::size_t, add_counts, count_of> count_tree;
+  for (int i = 0; i < 64; ++i) count_tree.emplace_ordered(i, 1);
+  // a merged element reports the index it merged into, and its range value is updated
+  std::cout << count_tree.emplace_ordered(40, 5) << " (expected 40)" << std::endl;
+  std::cout << count_tree.get_range(40, 41) << " (expected 6)" << std::endl;
+  // inserting between 2 elements passes both on the way down, so it merges into the later one
+  count_tree.insert(10, counted(10, 3));
+  std::cout << count_tree.size() << " " << count_tree.get_range(10, 11)
+            << " (expected 64 4)" << std::endl;
+  // many merges, between inserts which rotate, keep the tree in order
+  for (int i = 0; i < 64; ++i) {
+    count_tree.emplace_ordered(i, 1);
+    count_tree.emplace_ordered(64 + i, 1);
+  }
+  std::cout << count_tree.size() << " " << count_tree.get_range(0, 128)
+            << " (expected 128 200)" << std::endl;
+  std::cout << count_tree.get_item(127).first << " " << count_tree.get_range(64, 128)
+            << " (expected 127 64)" << std::endl;
+  // test ordered lookups by a key which is not an element
+  // ("apple" "banana" "banana" "cherry"), then 1 "banana" removed
+  avl::avl_tree<std::string, std::less<>, std::size_t,
+                avl::no_merge<std::string>, avl::identity<std::string>>
+      fruit_tree;
+  for (const char *fruit : {"apple", "banana", "banana", "cherry"})
+    fruit_tree.emplace_ordered(fruit);
+  std::string_view banana = "banana";
+  std::cout << fruit_tree.lower_bound(banana) << " (expected 1)" << std::endl;
+  std::cout << fruit_tree.upper_bound(banana) << " (expected 3)" << std::endl;
+  std::cout << fruit_tree.count(banana) << " (expected 2)" << std::endl;
+  std::cout << fruit_tree.find("cherry") << " (expected 3)" << std::endl;
+  std::cout << fruit_tree.contains("date") << " (expected 0)" << std::endl;
+  std::cout << fruit_tree.erase_ordered(banana) << " (expected 1)" << std::endl;
+  std::cout << fruit_tree.get_range(0, 3) << " (expected applebananacherry)"
+            << std::endl;
+  // test moving nodes between trees which share an allocator
+  // pending (5 6 7) and active (1 2), then 6 changed to 3 and 7 moved to active
+  typedef avl::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                        avl::identity<int>>
+      handle_tree_type;
+  handle_tree_type::allocator_type shared_alloc;
+  handle_tree_type pending(shared_alloc), active(shared_alloc);
+  for (int i = 5; i <= 7; ++i) pending.emplace_ordered(i);
+  for (int i = 1; i <= 2; ++i) active.emplace_ordered(i);
+  handle_tree_type::node_handle moving = pending.extract(1);
+  std::cout << moving.value() << " (expected 6)" << std::endl;
+  moving.value() = 3;
+  active.insert(2, std::move(moving));
+  std::cout << moving.empty() << " (expected 1)" << std::endl;
+  std::cout << active.insert_ordered(pending.extract_ordered(7))
+            << " (expected 3)" << std::endl;
+  std::cout << active.get_range(0, 4) << " (expected 13)" << std::endl;
+  std::cout << pending.size() << " (expected 1)" << std::endl;
+  // an empty handle, from extracting an element that is not there, inserts nothing
+  std::cout << active.insert_ordered(pending.extract_ordered(9))
+            << " (expected 4)" << std::endl;
+  std::cout << active.size() << " (expected 4)" << std::endl;
+  // test building a tree from a range in O(N)
+  // (0 1 2 ... 999), then (1 2 3) from (1 1 2 2 3 3) with equal elements merged
+  std::vector<int> sorted_range;
+  for (int i = 0; i < 1000; ++i) sorted_range.push_back(i);
+  avl::avl_tree<int, std::less<int>, std::size_t, avl::merge_if_equal<int>,
+                avl::identity<int>>
+      built_tree(sorted_range.begin(), sorted_range.end());
+  std::cout << built_tree.get_range(0, 1000) << " (expected 499500)" << std::endl;
+  std::cout << built_tree.lower_bound(617) << " (expected 617)" << std::endl;
+  std::vector<int> doubled_range = {1, 1, 2, 2, 3, 3};
+  built_tree.assign(doubled_range.begin(), doubled_range.end(), true);
+  std::cout << built_tree.size() << " (expected 3)" << std::endl;
+  // test joining trees which share an allocator
+  // (0 1 ... 99) + (100 101 ... 199), then + 200 + (1000 1001 ... 1009)
+  handle_tree_type join_left(shared_alloc), join_right(shared_alloc),
+      join_more(shared_alloc);
+  for (int i = 0; i < 100; ++i) {
+    join_left.insert(i, i);
+    join_right.insert(i, 100 + i);
+  }
+  for (int i = 0; i < 10; ++i) join_more.insert(i, 1000 + i);
+  join_left.join(join_right);
+  std::cout << join_right.size() << " (expected 0)" << std::endl;
+  std::cout << join_left.get_range(0, 200) << " (expected 19900)" << std::endl;
+  join_left.join(200, join_more);
+  std::cout << join_left.get_item(201) << " (expected 1000)" << std::endl;
+  std::cout << join_left.get_range(150, 211) << " (expected 18970)" << std::endl;
+  // test splitting it again, into (0 1 ... 149) and (150 151 ... 1009)
+  join_left.split_at(150, join_right);
+  std::cout << join_left.size() << " " << join_right.size()
+            << " (expected 150 61)" << std::endl;
+  std::cout << join_right.get_range(0, 61) << " (expected 18970)" << std::endl;
+  // both report the shared pool, and say that it is shared
+  std::cout << join_left.footprint().shared << " "
+            << (join_left.footprint().used_bytes == join_right.footprint().used_bytes)
+            << " (expected 1 1)" << std::endl;
+  // test joining default constructed trees, whose pools are spliced instead of copied
+  handle_tree_type pooled_left, pooled_right;
+  for (int i = 0; i < 100; ++i) {
+    pooled_left.insert(i, i);
+    pooled_right.insert(i, 100 + i);
+  }
+  std::size_t pooled_bytes = pooled_left.footprint().reserved_bytes +
+                             pooled_right.footprint().reserved_bytes;
+  pooled_left.join(pooled_right);
+  std::cout << (pooled_left.footprint().reserved_bytes == pooled_bytes) << " "
+            << pooled_right.footprint().reserved_bytes << " (expected 1 0)" << std::endl;
+  // the nodes of both pools are freed and reused by the spliced pool
+  for (int i = 0; i < 150; ++i) pooled_left.remove(50);
+  for (int i = 0; i < 300; ++i) pooled_left.insert(pooled_left.size(), 1);
+  std::cout << pooled_left.size() << " " << pooled_left.get_range(0, 50)
+            << " (expected 350 1225)" << std::endl;
+  pooled_right.insert(0, 7);
+  std::cout << pooled_right.get_item(0) << " (expected 7)" << std::endl;
+  // test splitting into a default constructed tree, which takes the nodes and shares the pool
+  handle_tree_type split_whole, split_part;
+  for (int i = 0; i < 100; ++i) split_whole.insert(i, i);
+  std::size_t split_bytes = split_whole.footprint().reserved_bytes;
+  split_whole.split_at(60, split_part);
+  std::cout << split_part.size() << " " << split_part.get_range(0, 40) << " "
+            << split_whole.get_range(0, 60) << " (expected 40 3180 1770)" << std::endl;
+  footprint = split_part.footprint();
+  std::cout << footprint.shared << " " << (footprint.reserved_bytes == split_bytes)
+            << " " << (footprint.used_bytes == 100 * footprint.bytes_per_node)
+            << " (expected 1 1 1)" << std::endl;
+  // test splitting off a detached tree, which keeps its own pool
+  split_whole.join(split_part);
+  handle_tree_type split_detached;
+  split_whole.split_at_detached(60, split_detached);
+  std::cout << split_detached.size() << " " << split_detached.get_range(0, 40) << " "
+            << split_whole.get_range(0, 60) << " (expected 40 3180 1770)" << std::endl;
+  // the moved nodes are given back to the pool this tree shares with the emptied tree
+  footprint = split_whole.footprint();
+  std::cout << (footprint.used_bytes == 60 * footprint.bytes_per_node) << " ";
+  footprint = split_detached.footprint();
+  std::cout << (footprint.used_bytes == 40 * footprint.bytes_per_node)
+            << " (expected 1 1)" << std::endl;
+  // test set operations on evens (0 2 ... 98) and multiples of 3 (0 3 ... 99)
+  typedef avl::avl_tree<int, std::less<int>, std::size_t, avl::merge_if_equal<int>,
+                        avl::identity<int>>
+      set_tree_type;
+  set_tree_type::allocator_type set_alloc;
+  set_tree_type set_a(set_alloc), set_b(set_alloc);
+  std::vector<int> evens, triples;
+  for (int i = 0; i < 100; i += 2) evens.push_back(i);
+  for (int i = 0; i < 100; i += 3) triples.push_back(i);
+  set_a.assign(evens.begin(), evens.end());
+  set_b.assign(triples.begin(), triples.end());
+  set_a.set_union(set_b);
+  std::cout << set_a.size() << " " << set_a.get_range(0, set_a.size())
+            << " (expected 67 3317)" << std::endl;
+  set_a.assign(evens.begin(), evens.end());
+  set_b.assign(triples.begin(), triples.end());
+  set_a.set_intersection(set_b);
+  std::cout << set_a.size() << " " << set_a.get_range(0, set_a.size())
+            << " (expected 17 816)" << std::endl;
+  set_a.assign(evens.begin(), evens.end());
+  set_b.assign(triples.begin(), triples.end());
+  set_a.set_difference(set_b);
+  std::cout << set_a.size() << " " << set_a.get_range(0, set_a.size())
+            << " (expected 33 1634)" << std::endl;
+  set_a.assign(evens.begin(), evens.end());
+  set_b.assign(triples.begin(), triples.end());
+  set_a.set_symmetric_difference(set_b);
+  std::cout << set_a.size() << " " << set_a.get_range(0, set_a.size())
+            << " (expected 50 2501)" << std::endl;
+  // test a symmetric difference with repeated elements, from either side:
+  // (5) ^ (5 5 5), (5 5 5) ^ (5), then (1 5 7) ^ (5 5 6) is (1 6 7)
+  handle_tree_type repeat_a, repeat_b;
+  for (int order = 0; order < 2; ++order) {
+    repeat_a.clear();
+    repeat_b.clear();
+    for (int i = 0; i < 3; ++i) (order == 0 ? repeat_b : repeat_a).emplace_ordered(5);
+    (order == 0 ? repeat_a : repeat_b).emplace_ordered(5);
+    repeat_a.set_symmetric_difference(repeat_b);
+    std::cout << repeat_a.size() << " (expected 0)" << std::endl;
+  }
+  for (int value : {1, 5, 7}) repeat_a.emplace_ordered(value);
+  for (int value : {5, 5, 6}) repeat_b.emplace_ordered(value);
+  repeat_a.set_symmetric_difference(repeat_b);
+  std::cout << repeat_a.size() << " " << repeat_a.get_range(0, 3) << " (expected 3 14)"
+            << std::endl;
+  // test a union of default constructed trees, which takes the nodes of both as they are
+  set_tree_type plain_a, plain_b;
+  plain_a.assign(evens.begin(), evens.end());
+  plain_b.assign(triples.begin(), triples.end());
+  std::size_t plain_bytes =
+      plain_a.footprint().reserved_bytes + plain_b.footprint().reserved_bytes;
+  plain_a.set_union(plain_b);
+  std::cout << plain_a.size() << " " << (plain_a.footprint().reserved_bytes == plain_bytes)
+            << " (expected 67 1)" << std::endl;
+  // test a less than function throwing on the forked thread, and then on the calling one
+  static int set_trap = -1;
+  struct trap_less {
+    bool operator()(int a, int b) const {
+      if (a == set_trap || b == set_trap) throw std::runtime_error("trapped");
+      return a < b;
+    }
+  };
+  avl::avl_tree<int, trap_less, std::size_t, avl::merge_if_equal<int>, avl::identity<int>>
+      trap_a, trap_b;
+  std::vector<int> trap_evens, trap_odds;
+  for (int i = 0; i < 40000; i += 2) {
+    trap_evens.push_back(i);
+    trap_odds.push_back(i + 1);
+  }
+  for (int trap : {10001, 30001}) {
+    trap_a.assign(trap_evens.begin(), trap_evens.end());
+    trap_b.assign(trap_odds.begin(), trap_odds.end());
+    set_trap = trap;
+    try {
+      trap_a.set_union(trap_b, 2);
+      std::cout << "not trapped";
+    } catch (const std::runtime_error &) {
+      // every node of both trees is destroyed, none lost
+      std::cout << trap_a.footprint().used_bytes + trap_b.footprint().used_bytes;
+    }
+    std::cout << " (expected 0)" << std::endl;
+    set_trap = -1;
+  }
+  // test inserting the multiples of 3 as a sorted batch, which is the same as the union
+  set_a.assign(evens.begin(), evens.end());
+  set_a.insert_sorted_batch(triples.begin(), triples.end());
+  std::cout << set_a.size() << " " << set_a.get_range(0, set_a.size())
+            << " (expected 67 3317)" << std::endl;
+  // test batches of 1, which are linked in as by a plain insert: 1 is new, and 2 merges
+  std::vector<int> single_new = {1}, single_equal = {2};
+  set_a.insert_sorted_batch(single_new.begin(), single_new.end());
+  set_a.insert_sorted_batch(single_equal.begin(), single_equal.end());
+  std::cout << set_a.size() << " " << set_a.get_range(0, set_a.size())
+            << " (expected 68 3318)" << std::endl;
+  // test splitting by key: (apple) (banana banana) (cherry date)
+  fruit_tree.emplace_ordered("banana");
+  fruit_tree.emplace_ordered("date");
+  decltype(fruit_tree) banana_tree, later_tree;
+  fruit_tree.split_by_key("banana", banana_tree, later_tree);
+  std::cout << fruit_tree.size() << " " << banana_tree.size() << " "
+            << later_tree.size() << " (expected 1 2 2)" << std::endl;
+  std::cout << later_tree.get_range(0, 2) << " (expected cherrydate)" << std::endl;
+  banana_tree.split_by_key("c", later_tree);
+  std::cout << banana_tree.size() << " " << later_tree.size() << " (expected 2 0)"
+            << std::endl;
+  // test a tree of strings, kept in an array parallel to the nodes
+  // ("0" "1" ... "4999"), then with "0" ... "2499" removed
+  avl::avl_tree<std::string, std::less<std::string>, std::size_t,
+                avl::no_merge<std::string>, avl::monostate, avl::monostate,
+                std::plus<avl::monostate>, avl::identity<avl::monostate>,
+                avl::split_layout>
+      split_tree;
+  for (int i = 0; i < 5000; ++i) split_tree.insert(i, std::to_string(i));
+  for (int i = 0; i < 2500; ++i) split_tree.remove(0);
+  std::cout << split_tree.get_item(1234) << " (expected 3734)" << std::endl;
+  std::cout << split_tree.replace(0, "x") << " (expected 2500)" << std::endl;
+  std::cout << split_tree.get_item(0) << " (expected x)" << std::endl;
 }
+#endif
@@ -0,0 +1,686 @@
+// Benchmarks for the AVL tree library.
+// Build with optimizations, ex. g++ -std=c++17 -O2 avl_tree_bench.cpp
+// Usage: avl_tree_bench [number of elements] [allocators|clear|vector|freeze|lookup|small|tlb|split|compact|build|sets|batch] [runs of allocators]
+
+#define AVL_TREE_NO_TEST_MAIN
+#include "avl_tree.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// count every allocation made through the global operator new
+
+static std::size_t allocation_count = 0;
+
+void *operator new(std::size_t bytes) {
+  ++allocation_count;
+  if (void *p = std::malloc(bytes)) return p;
+  throw std::bad_alloc();
+}
+void *operator new(std::size_t bytes, std::align_val_t align) {
+  ++allocation_count;
+  if (void *p = std::aligned_alloc(std::size_t(align),
+                                   (bytes + std::size_t(align) - 1) /
+                                       std::size_t(align) * std::size_t(align)))
+    return p;
+  throw std::bad_alloc();
+}
+// every operator new above gets its memory from malloc or aligned_alloc, both of which
+// free releases, but once these are inlined, GCC only sees a new paired with a free
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+//! Times of the same phases over several runs, to report the median and the spread.
+class phase_samples {
+ private:
+  std::vector<std::pair<std::string, std::vector<double>>> phases;
+
+ public:
+  void add(const std::string &name, double ns_per_op) {
+    for (auto &phase : phases) {
+      if (phase.first == name) {
+        phase.second.push_back(ns_per_op);
+        return;
+      }
+    }
+    phases.emplace_back(name, std::vector<double>{ns_per_op});
+  }
+  void report() const {
+    for (const auto &phase : phases) {
+      std::vector<double> times = phase.second;
+      std::sort(times.begin(), times.end());
+      std::size_t middle = times.size() / 2;
+      double median = times.size() % 2 == 1
+                          ? times[middle]
+                          : (times[middle - 1] + times[middle]) / 2;
+      std::cout << "  " << phase.first << ": median " << median
+                << " ns/op (min " << times.front() << ", max " << times.back()
+                << ", " << times.size() << " runs)" << std::endl;
+    }
+  }
+};
+
+//! Measures time and allocations for one phase of a benchmark.
+class phase_timer {
+ private:
+  std::chrono::steady_clock::time_point start;
+  std::size_t start_allocations;
+
+ public:
+  phase_timer()
+      : start(std::chrono::steady_clock::now()),
+        start_allocations(allocation_count) {}
+  void report(const std::string &name, std::size_t ops,
+              phase_samples *samples = nullptr) {
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    std::cout << "  " << name << ": " << ns / ops << " ns/op, "
+              << double(allocation_count - start_allocations) / ops
+              << " allocations/op" << std::endl;
+    if (samples != nullptr) samples->add(name, ns / ops);
+  }
+};
+
+//! Counts data TLB misses in user space, where the hardware and kernel allow it.
+class tlb_miss_counter {
+ private:
+  int fd;
+
+ public:
+  tlb_miss_counter() : fd(-1) {
+#if defined(__linux__)
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+  ~tlb_miss_counter() {
+#if defined(__linux__)
+    if (fd >= 0) close(fd);
+#endif
+  }
+  tlb_miss_counter(const tlb_miss_counter &) = delete;
+  tlb_miss_counter &operator=(const tlb_miss_counter &) = delete;
+  void report(std::size_t ops) {
+#if defined(__linux__)
+    long long misses = 0;
+    if (fd >= 0 && read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+      std::cout << "  dTLB misses: " << double(misses) / ops << " /op"
+                << std::endl;
+      return;
+    }
+#endif
+    std::cout << "  dTLB misses: unavailable (no hardware counter, or "
+                 "perf_event_paranoid too high)"
+              << std::endl;
+  }
+};
+
+//! Random inserts, then random removes, at random indices.
+template <typename _Tree>
+void bench_insert_remove(const std::string &name, std::size_t n,
+                         phase_samples *samples = nullptr) {
+  std::cout << name << " (" << n << " elements)" << std::endl;
+  std::mt19937_64 rng(12345);
+  phase_timer total;
+  {
+    _Tree tree;
+    {
+      phase_timer timer;
+      for (std::size_t i = 0; i < n; ++i) {
+        tree.insert(rng() % (i + 1), int(i));
+      }
+      timer.report("insert", n, samples);
+    }
+    {
+      phase_timer timer;
+      for (std::size_t i = 0; i < n; ++i) {
+        tree.get_item(rng() % n);
+      }
+      timer.report("get", n, samples);
+    }
+    {
+      phase_timer timer;
+      for (std::size_t i = 0; i < n; ++i) {
+        tree.replace(rng() % n, int(i));
+      }
+      timer.report("replace", n, samples);
+    }
+    {
+      phase_timer timer;
+      for (std::size_t i = n / 2; i > 0; --i) {
+        tree.remove(rng() % tree.size());
+        tree.insert(rng() % (tree.size() + 1), int(i));
+      }
+      timer.report("remove + insert", n / 2, samples);
+    }
+    phase_timer timer;
+    for (std::size_t i = n; i > 0; --i) {
+      tree.remove(rng() % i);
+    }
+    timer.report("remove", n, samples);
+  }
+  total.report("total, including destruction", n, samples);
+}
+
+//! Build a tree, then time clearing it.
+template <typename _Tree>
+void bench_teardown(const std::string &name, std::size_t n) {
+  std::cout << name << " (" << n << " elements)" << std::endl;
+  _Tree tree;
+  for (std::size_t i = 0; i < n; ++i) {
+    tree.insert(i, int(i));
+  }
+  phase_timer timer;
+  tree.clear();
+  timer.report("clear", n);
+}
+
+template <typename _Element, typename _Alloc>
+using bench_list =
+    avl::avl_tree<_Element, std::less<_Element>, std::size_t,
+                  avl::no_merge<_Element>, avl::monostate, avl::monostate,
+                  std::plus<avl::monostate>, avl::identity<avl::monostate>,
+                  avl::pointer_layout, _Alloc>;
+
+void bench_allocators(std::size_t n, std::size_t runs) {
+  typedef avl::avl_node<int, std::size_t, avl::monostate> node;
+  phase_samples std_samples, pool_samples;
+  for (std::size_t run = 0; run < runs; ++run) {
+    // take turns going first, so that neither allocator always gets the fresher heap
+    if (run % 2 == 0) {
+      bench_insert_remove<bench_list<int, std::allocator<node>>>(
+          "std::allocator", n, &std_samples);
+    }
+    bench_insert_remove<bench_list<int, avl::pool_allocator<node>>>(
+        "avl::pool_allocator", n, &pool_samples);
+    if (run % 2 == 1) {
+      bench_insert_remove<bench_list<int, std::allocator<node>>>(
+          "std::allocator", n, &std_samples);
+    }
+  }
+  if (runs > 1) {
+    std::cout << "std::allocator, over " << runs << " runs" << std::endl;
+    std_samples.report();
+    std::cout << "avl::pool_allocator, over " << runs << " runs" << std::endl;
+    pool_samples.report();
+  }
+}
+
+void bench_clear(std::size_t n) {
+  typedef avl::avl_node<int, std::size_t, avl::monostate> node;
+  bench_teardown<bench_list<int, std::allocator<node>>>(
+      "clear, std::allocator", n);
+  bench_teardown<bench_list<int, avl::pool_allocator<node>>>(
+      "clear, avl::pool_allocator", n);
+}
+
+// adapters so that the list tree and the vector can share a benchmark
+
+template <typename _Tree>
+int sequence_get(_Tree &tree, std::size_t index) {
+  return tree.get_item(index);
+}
+template <typename T, std::size_t _Chunk_Bytes>
+int sequence_get(avl::vector<T, _Chunk_Bytes> &list, std::size_t index) {
+  return list[index];
+}
+template <typename _Tree>
+void sequence_erase(_Tree &tree, std::size_t index) {
+  tree.remove(index);
+}
+template <typename T, std::size_t _Chunk_Bytes>
+void sequence_erase(avl::vector<T, _Chunk_Bytes> &list, std::size_t index) {
+  list.erase(index);
+}
+
+//! Appends, random inserts, random gets, a full scan, then random removes.
+template <typename _Sequence>
+void bench_sequence(const std::string &name, std::size_t n) {
+  std::cout << name << " (" << n << " elements)" << std::endl;
+  std::mt19937_64 rng(12345);
+  _Sequence list;
+  {
+    phase_timer timer;
+    for (std::size_t i = 0; i < n / 2; ++i) {
+      list.insert(i, int(i));
+    }
+    timer.report("append", n / 2);
+  }
+  {
+    phase_timer timer;
+    for (std::size_t i = n / 2; i < n; ++i) {
+      list.insert(rng() % (i + 1), int(i));
+    }
+    timer.report("insert", n - n / 2);
+  }
+  {
+    phase_timer timer;
+    long long sum = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      sum += sequence_get(list, rng() % n);
+    }
+    timer.report("get", n);
+    if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+  }
+  {
+    phase_timer timer;
+    long long sum = 0;
+    list.for_each([&](int item) { sum += item; });
+    timer.report("scan", n);
+    if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+  }
+  phase_timer timer;
+  for (std::size_t i = n; i > 0; --i) {
+    sequence_erase(list, rng() % i);
+  }
+  timer.report("remove", n);
+}
+
+void bench_vector(std::size_t n) {
+  bench_sequence<avl::avl_tree<int>>("avl_tree, 1 element per node", n);
+  bench_sequence<avl::vector<int>>("avl::vector, chunked", n);
+}
+
+//! Random index and range queries on a live tree and its frozen copy.
+void bench_freeze(std::size_t n) {
+  typedef avl::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                        avl::identity<int>, long long>
+      tree_type;
+  std::cout << "freeze (" << n << " elements)" << std::endl;
+  std::mt19937_64 rng(12345);
+  tree_type tree;
+  // insert in random order, so that the nodes are scattered in memory
+  for (std::size_t i = 0; i < n; ++i) {
+    tree.insert(rng() % (i + 1), int(i));
+  }
+  long long sum = 0;
+  {
+    phase_timer timer;
+    for (std::size_t i = 0; i < n; ++i) sum += tree.get_item(rng() % n);
+    timer.report("get, live tree", n);
+  }
+  {
+    phase_timer timer;
+    for (std::size_t i = 0; i < n; ++i) {
+      std::size_t begin = rng() % n;
+      sum += tree.get_range(begin, begin + 1 + rng() % (n - begin));
+    }
+    timer.report("get range, live tree", n);
+  }
+  phase_timer freeze_timer;
+  tree_type::frozen_type frozen = tree.freeze();
+  freeze_timer.report("freeze", n);
+  {
+    phase_timer timer;
+    for (std::size_t i = 0; i < n; ++i) sum += frozen.get_item(rng() % n);
+    timer.report("get, frozen", n);
+  }
+  {
+    phase_timer timer;
+    for (std::size_t i = 0; i < n; ++i) {
+      std::size_t begin = rng() % n;
+      sum += frozen.get_range(begin, begin + 1 + rng() % (n - begin));
+    }
+    timer.report("get range, frozen", n);
+  }
+  phase_timer thaw_timer;
+  tree_type thawed(frozen);
+  thaw_timer.report("thaw", n);
+  if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+}
+
+//! Random ordered lookups in a sorted tree, its read-only copies, and std::set.
+void bench_lookup(std::size_t n) {
+  std::cout << "lookup (" << n << " elements)" << std::endl;
+  std::mt19937_64 rng(12345);
+  // even keys, inserted in random order, so that half of the lookups miss
+  std::vector<int> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::shuffle(keys.begin(), keys.end(), rng);
+  std::size_t found = 0;
+  {
+    avl::avl_tree<int> tree;
+    for (int key : keys) tree.insert(tree.lower_bound(2 * key), 2 * key);
+    {
+      phase_timer timer;
+      for (std::size_t i = 0; i < n; ++i) found += tree.contains(int(rng() % (2 * n)));
+      timer.report("contains, live tree", n);
+    }
+    {
+      auto frozen = tree.freeze();
+      phase_timer timer;
+      for (std::size_t i = 0; i < n; ++i) found += frozen.contains(int(rng() % (2 * n)));
+      timer.report("contains, frozen", n);
+    }
+    auto snapshot = tree.snapshot();
+    {
+      phase_timer timer;
+      for (std::size_t i = 0; i < n; ++i) found += snapshot.contains(int(rng() % (2 * n)));
+      timer.report("contains, eytzinger snapshot", n);
+    }
+    {
+      phase_timer timer;
+      for (std::size_t i = 0; i < n; ++i) found += snapshot.rank(int(rng() % (2 * n)));
+      timer.report("rank, eytzinger snapshot", n);
+    }
+  }
+  {
+    std::set<int> set;
+    for (int key : keys) set.insert(2 * key);
+    phase_timer timer;
+    for (std::size_t i = 0; i < n; ++i) found += set.count(int(rng() % (2 * n)));
+    timer.report("contains, std::set", n);
+  }
+  if (found == 42) std::cout << "  (unlikely count)" << std::endl;
+}
+
+//! Many small trees, with a few elements each.
+template <typename _Tree>
+void bench_small_trees(const std::string &name, std::size_t n) {
+  constexpr std::size_t per_tree = 8;
+  std::size_t trees = n / per_tree;
+  std::cout << name << " (" << trees << " trees of " << per_tree
+            << " elements)" << std::endl;
+  std::mt19937_64 rng(12345);
+  phase_timer total;
+  {
+    std::vector<_Tree> forest(trees);
+    {
+      phase_timer timer;
+      for (std::size_t i = 0; i < per_tree; ++i) {
+        for (_Tree &tree : forest) tree.insert(rng() % (i + 1), int(i));
+      }
+      timer.report("insert", trees * per_tree);
+    }
+    {
+      phase_timer timer;
+      long long sum = 0;
+      for (std::size_t i = 0; i < trees * per_tree; ++i) {
+        sum += forest[rng() % trees].get_range(0, per_tree);
+      }
+      timer.report("get range", trees * per_tree);
+      if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+    }
+  }
+  total.report("total, including destruction", trees * per_tree);
+}
+
+void bench_small(std::size_t n) {
+  typedef avl::avl_node<int, std::size_t, int> node;
+  bench_small_trees<avl::avl_tree<int, std::less<int>, std::size_t,
+                                   avl::no_merge<int>, avl::identity<int>>>(
+      "small trees, nodes", n);
+  bench_small_trees<avl::avl_tree<
+      int, std::less<int>, std::size_t, avl::no_merge<int>, avl::identity<int>,
+      int, std::plus<int>, avl::identity<int>, avl::pointer_layout,
+      avl::pool_allocator<node>, 16>>("small trees, 16 inline", n);
+}
+
+//! Random index queries on a large tree, counting data TLB misses.
+template <typename _Tree>
+void bench_tlb_tree(const std::string &name, std::size_t n) {
+  std::cout << name << " (" << n << " elements)" << std::endl;
+  std::mt19937_64 rng(12345);
+  _Tree tree;
+  // insert in random order, so that the nodes are scattered in memory
+  for (std::size_t i = 0; i < n; ++i) {
+    tree.insert(rng() % (i + 1), int(i));
+  }
+  long long sum = 0;
+  tlb_miss_counter misses;
+  phase_timer timer;
+  for (std::size_t i = 0; i < n; ++i) sum += tree.get_item(rng() % n);
+  timer.report("get", n);
+  misses.report(n);
+  if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+}
+
+void bench_tlb(std::size_t n) {
+  typedef avl::avl_node<int, std::size_t, avl::monostate> node;
+  bench_tlb_tree<bench_list<int, avl::pool_allocator<node>>>(
+      "avl::pool_allocator", n);
+  bench_tlb_tree<bench_list<int, avl::huge_page_pool_allocator<node>>>(
+      "avl::huge_page_pool_allocator", n);
+}
+
+//! A large element, such as a record with several fields.
+struct record {
+  long long key;
+  char fields[192];
+};
+
+//! Random positional inserts and gets on a tree of large elements.
+template <typename _Tree>
+void bench_records(const std::string &name, std::size_t n) {
+  std::cout << name << " (" << n << " elements)" << std::endl;
+  std::mt19937_64 rng(12345);
+  _Tree tree;
+  {
+    phase_timer timer;
+    for (std::size_t i = 0; i < n; ++i) {
+      tree.insert(rng() % (i + 1), record{(long long)i, {}});
+    }
+    timer.report("insert", n);
+  }
+  long long sum = 0;
+  {
+    phase_timer timer;
+    for (std::size_t i = 0; i < n; ++i) sum += tree.get_item(rng() % n).key;
+    timer.report("get", n);
+  }
+  if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+}
+
+template <typename _Layout>
+using record_list =
+    avl::avl_tree<record, std::less<record>, std::size_t, avl::no_merge<record>,
+                  avl::monostate, avl::monostate, std::plus<avl::monostate>,
+                  avl::identity<avl::monostate>, _Layout>;
+
+void bench_split(std::size_t n) {
+  bench_records<record_list<avl::pointer_layout>>(
+      "200 byte records, avl::pointer_layout", n);
+  bench_records<record_list<avl::split_layout>>(
+      "200 byte records, avl::split_layout", n);
+}
+
+//! In-order scans and random gets on a churned tree, before and after compacting it.
+void bench_compact(std::size_t n) {
+  std::cout << "compact (" << n << " elements)" << std::endl;
+  std::mt19937_64 rng(12345);
+  avl::avl_tree<int, std::less<int>, std::size_t, avl::no_merge<int>,
+                avl::identity<int>, long long>
+      tree;
+  // random inserts and removes, so that neighbouring elements are far apart in memory
+  for (std::size_t i = 0; i < n; ++i) tree.insert(rng() % (i + 1), int(i));
+  for (std::size_t i = 0; i < n; ++i) {
+    tree.remove(rng() % n);
+    tree.insert(rng() % n, int(i));
+  }
+  long long sum = 0;
+  auto measure = [&](const std::string &when) {
+    {
+      phase_timer timer;
+      tree.for_each([&](int value) { sum += value; });
+      timer.report("scan, " + when, n);
+    }
+    {
+      phase_timer timer;
+      for (std::size_t i = 0; i < n; ++i) sum += tree.get_item(rng() % n);
+      timer.report("get, " + when, n);
+    }
+  };
+  measure("scattered");
+  {
+    phase_timer timer;
+    std::size_t steps = 1;
+    while (tree.compact(100000) == avl::compact_status::in_progress) ++steps;
+    timer.report("compact, in " + std::to_string(steps) + " steps", n);
+  }
+  measure("compacted");
+  if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+}
+
+//! Filling a tree from sorted elements, one insert at a time and in bulk.
+void bench_build(std::size_t n) {
+  typedef avl::avl_tree<int, std::less<int>, std::size_t,
+                        avl::merge_if_equal<int>, avl::identity<int>, long long>
+      tree_type;
+  std::cout << "build (" << n << " sorted elements)" << std::endl;
+  std::vector<int> sorted(n);
+  for (std::size_t i = 0; i < n; ++i) sorted[i] = int(i);
+  long long sum = 0;
+  {
+    phase_timer timer;
+    tree_type tree;
+    for (int value : sorted) tree.emplace_ordered(value);
+    timer.report("emplace_ordered, one at a time", n);
+    sum += tree.get_range(0, n);
+  }
+  {
+    phase_timer timer;
+    tree_type tree(sorted.begin(), sorted.end());
+    timer.report("construct from range", n);
+    sum += tree.get_range(0, n);
+  }
+  {
+    phase_timer timer;
+    tree_type tree;
+    tree.assign(sorted.begin(), sorted.end(), true);
+    timer.report("assign from range, merging", n);
+    sum += tree.get_range(0, n);
+  }
+  if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+}
+
+void bench_set_operations(std::size_t n) {
+  typedef avl::avl_tree<int, std::less<int>, std::size_t,
+                        avl::merge_if_equal<int>, avl::identity<int>, long long>
+      tree_type;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::cout << "set operations (2 trees of " << n / 2
+            << " elements, a third of them shared, up to " << threads << " threads)"
+            << std::endl;
+  // multiples of 2 and of 3
+  std::vector<int> first, second;
+  for (std::size_t i = 0; i < n / 2; ++i) {
+    first.push_back(int(2 * i));
+    second.push_back(int(3 * i));
+  }
+  long long sum = 0;
+  auto run = [&](const std::string &label, auto operation) {
+    tree_type::allocator_type alloc;
+    tree_type a(alloc), b(alloc);
+    a.assign(first.begin(), first.end());
+    b.assign(second.begin(), second.end());
+    phase_timer timer;
+    operation(a, b);
+    timer.report(label, n);
+    sum += a.get_range(0, a.size());
+  };
+  run("union, one element at a time", [&](tree_type &a, tree_type &b) {
+    for (int value : second) a.emplace_ordered(value);
+    b.clear();
+  });
+  run("union, 1 thread", [&](tree_type &a, tree_type &b) { a.set_union(b, 1); });
+  run("union, all threads", [&](tree_type &a, tree_type &b) { a.set_union(b, threads); });
+  run("intersection, all threads",
+      [&](tree_type &a, tree_type &b) { a.set_intersection(b, threads); });
+  run("difference, all threads",
+      [&](tree_type &a, tree_type &b) { a.set_difference(b, threads); });
+  if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+}
+
+void bench_sorted_batch(std::size_t n) {
+  typedef avl::avl_tree<int, std::less<int>, std::size_t,
+                        avl::merge_if_equal<int>, avl::identity<int>, long long>
+      tree_type;
+  std::cout << "sorted batch insert (into " << n << " elements)" << std::endl;
+  std::vector<int> existing(n);
+  for (std::size_t i = 0; i < n; ++i) existing[i] = int(2 * i);
+  std::mt19937 rng(31);
+  long long sum = 0;
+  for (std::size_t batch_size : {n / 1000, n / 100, n / 10, n}) {
+    if (batch_size == 0) continue;
+    // random keys over the whole range, some of them already in the tree
+    std::uniform_int_distribution<int> key(0, int(2 * n));
+    std::vector<int> batch(batch_size);
+    for (int &value : batch) value = key(rng);
+    std::sort(batch.begin(), batch.end());
+    std::string label = "batch of " + std::to_string(batch_size);
+    {
+      tree_type tree(existing.begin(), existing.end());
+      phase_timer timer;
+      for (int value : batch) tree.emplace_ordered(value);
+      timer.report(label + ", emplace_ordered, one at a time", batch_size);
+      sum += tree.get_range(0, tree.size());
+    }
+    {
+      tree_type tree(existing.begin(), existing.end());
+      phase_timer timer;
+      tree.insert_sorted_batch(batch.begin(), batch.end());
+      timer.report(label + ", insert_sorted_batch", batch_size);
+      sum += tree.get_range(0, tree.size());
+    }
+  }
+  if (sum == 42) std::cout << "  (unlikely sum)" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::size_t n = 10000000;
+  if (argc > 1) n = std::stoull(argv[1]);
+  std::string which = argc > 2 ? argv[2] : "";
+  std::size_t runs = 3;
+  if (argc > 3) runs = std::stoull(argv[3]);
+  if (which.empty() || which == "allocators") bench_allocators(n, runs);
+  if (which.empty() || which == "clear") bench_clear(n);
+  if (which.empty() || which == "vector") bench_vector(n);
+  if (which.empty() || which == "freeze") bench_freeze(n);
+  if (which.empty() || which == "lookup") bench_lookup(n);
+  if (which.empty() || which == "small") bench_small(n);
+  if (which.empty() || which == "tlb") bench_tlb(n);
+  if (which.empty() || which == "split") bench_split(n);
+  if (which.empty() || which == "compact") bench_compact(n);
+  if (which.empty() || which == "build") bench_build(n);
+  if (which.empty() || which == "sets") bench_set_operations(n);
+  if (which.empty() || which == "batch") bench_sorted_batch(n);
+}